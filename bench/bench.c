@@ -0,0 +1,1404 @@
+/*
+ * Microbenchmarks for the hsdt implementation.
+ *
+ * Run `build/bench/bench` to run all benchmarks, or pass the names of the
+ * benchmarks to run as arguments. Each benchmark prints the time per
+ * operation and the throughput relative to the encoded size of its input.
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/hsdt.h"
+
+/* Minimum time to spend on each measurement, in seconds. */
+#define MIN_TIME 0.5
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Run `op` repeatedly for at least `MIN_TIME` seconds and report the results.
+ * `bytes` is the amount of data processed per call.
+ */
+static void measure(const char *name, void (*op)(void *), void *ctx, size_t bytes) {
+  size_t iterations = 0;
+  double start = now();
+  double elapsed;
+
+  do {
+    op(ctx);
+    iterations += 1;
+    elapsed = now() - start;
+  } while (elapsed < MIN_TIME);
+
+  double per_op = elapsed / iterations;
+  printf("  %-32s %12.1f us/op %10.1f MB/s\n", name, per_op * 1e6, bytes / per_op / 1e6);
+}
+
+/* A buffer into which test inputs are assembled. */
+typedef struct Buf {
+  uint8_t *data;
+  size_t len;
+  size_t cap;
+} Buf;
+
+static void buf_push(Buf *buf, const void *data, size_t len) {
+  if (buf->len + len > buf->cap) {
+    buf->cap = 2 * (buf->len + len);
+    buf->data = realloc(buf->data, buf->cap);
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+static void buf_push_byte(Buf *buf, uint8_t byte) {
+  buf_push(buf, &byte, 1);
+}
+
+/* Append the header of a string or collection, `major` is the shifted major type. */
+static void buf_push_header(Buf *buf, uint8_t major, uint64_t len) {
+  if (len <= 23) {
+    buf_push_byte(buf, major | len);
+  } else if (len <= 255) {
+    buf_push_byte(buf, major | 24);
+    buf_push_byte(buf, len);
+  } else if (len <= 65535) {
+    buf_push_byte(buf, major | 25);
+    buf_push_byte(buf, len >> 8);
+    buf_push_byte(buf, len);
+  } else {
+    buf_push_byte(buf, major | 26);
+    buf_push_byte(buf, len >> 24);
+    buf_push_byte(buf, len >> 16);
+    buf_push_byte(buf, len >> 8);
+    buf_push_byte(buf, len);
+  }
+}
+
+/* `depth` nested arrays around a null. */
+static Buf input_deep(size_t depth) {
+  Buf buf = {0};
+  for (size_t i = 0; i < depth; i++) {
+    buf_push_byte(&buf, 0x81);
+  }
+  buf_push_byte(&buf, 0xF6);
+  return buf;
+}
+
+/* An array of `len` entries, cycling through short strings, floats and primitives. */
+static Buf input_wide_array(size_t len) {
+  Buf buf = {0};
+  buf_push_header(&buf, 0x80, len);
+  for (size_t i = 0; i < len; i++) {
+    switch (i % 4) {
+      case 0:
+        buf_push(&buf, "\x65hello", 6);
+        break;
+      case 1:
+        buf_push(&buf, "\xfb\x3f\xf1\x99\x99\x99\x99\x99\x9a", 9);
+        break;
+      case 2:
+        buf_push(&buf, "\x43\x01\x02\x03", 4);
+        break;
+      default:
+        buf_push_byte(&buf, 0xF5);
+        break;
+    }
+  }
+  return buf;
+}
+
+/* A map of `len` entries with distinct keys of the form "key00000042", mapping to small arrays. */
+static Buf input_wide_map(size_t len) {
+  Buf buf = {0};
+  buf_push_header(&buf, 0xA0, len);
+  for (size_t i = 0; i < len; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "key%08zu", i);
+    buf_push_header(&buf, 0x60, 11);
+    buf_push(&buf, key, 11);
+    buf_push(&buf, "\x82\xf6\x63\x61\x62\x63", 6);
+  }
+  return buf;
+}
+
+/* An array of `len` utf8 strings of 8 to 71 bytes each. */
+static Buf input_strings(size_t len) {
+  Buf buf = {0};
+  buf_push_header(&buf, 0x80, len);
+  for (size_t i = 0; i < len; i++) {
+    size_t str_len = 8 + (i * 7) % 64;
+    buf_push_header(&buf, 0x60, str_len);
+    for (size_t j = 0; j < str_len; j++) {
+      buf_push_byte(&buf, 'a' + (i + j) % 26);
+    }
+  }
+  return buf;
+}
+
+typedef struct DecodeCtx {
+  Buf input;
+  size_t max_depth;
+} DecodeCtx;
+
+static void op_decode(void *ctx_) {
+  DecodeCtx *ctx = ctx_;
+  HSDT_Value val;
+  size_t consumed;
+  HSDT_ERR err = hsdt_decode_stack(ctx->input.data, ctx->input.len, &val, &consumed, NULL, ctx->max_depth);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+  hsdt_value_free(val);
+}
+
+typedef struct DecodeWithCtx {
+  Buf input;
+  HSDT_Dec_Options opts;
+} DecodeWithCtx;
+
+static void op_decode_with(void *ctx_) {
+  DecodeWithCtx *ctx = ctx_;
+  HSDT_Value val;
+  size_t consumed;
+  HSDT_ERR err = hsdt_decode_with(&ctx->opts, ctx->input.data, ctx->input.len, &val, &consumed);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+  hsdt_value_free(val);
+}
+
+static void bench_decode(void) {
+  DecodeCtx ctx;
+
+  ctx.max_depth = SIZE_MAX;
+  ctx.input = input_deep(1000);
+  measure("deep (1000 levels)", op_decode, &ctx, ctx.input.len);
+  free(ctx.input.data);
+
+  ctx.input = input_wide_array(100000);
+  measure("wide array (100000 entries)", op_decode, &ctx, ctx.input.len);
+  free(ctx.input.data);
+
+  ctx.input = input_wide_map(10000);
+  measure("wide map (10000 entries)", op_decode, &ctx, ctx.input.len);
+  free(ctx.input.data);
+}
+
+static void op_decode_view(void *ctx_) {
+  DecodeCtx *ctx = ctx_;
+  HSDT_View view;
+  size_t consumed;
+  HSDT_ERR err = hsdt_decode_view(ctx->input.data, ctx->input.len, &view, &consumed, ctx->max_depth);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+  hsdt_view_free(view);
+}
+
+static void bench_view(void) {
+  DecodeCtx ctx;
+  ctx.max_depth = HSDT_DEFAULT_MAX_DEPTH;
+
+  ctx.input = input_strings(100000);
+  measure("strings, copying", op_decode, &ctx, ctx.input.len);
+  measure("strings, view", op_decode_view, &ctx, ctx.input.len);
+  free(ctx.input.data);
+
+  ctx.input = input_wide_map(10000);
+  measure("wide map, copying", op_decode, &ctx, ctx.input.len);
+  measure("wide map, view", op_decode_view, &ctx, ctx.input.len);
+  free(ctx.input.data);
+}
+
+typedef struct ArenaCtx {
+  Buf input;
+  HSDT_Arena arena;
+} ArenaCtx;
+
+static void op_decode_arena(void *ctx_) {
+  ArenaCtx *ctx = ctx_;
+  HSDT_Value val;
+  size_t consumed;
+  HSDT_ERR err = hsdt_decode_arena(&ctx->arena, ctx->input.data, ctx->input.len, &val, &consumed);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+  hsdt_arena_reset(&ctx->arena);
+}
+
+static void bench_arena(void) {
+  DecodeCtx ctx;
+  ArenaCtx arena_ctx;
+  ctx.max_depth = HSDT_DEFAULT_MAX_DEPTH;
+  hsdt_arena_init(&arena_ctx.arena);
+
+  ctx.input = input_wide_map(10000);
+  arena_ctx.input = ctx.input;
+  measure("wide map, malloc", op_decode, &ctx, ctx.input.len);
+  measure("wide map, arena", op_decode_arena, &arena_ctx, ctx.input.len);
+  free(ctx.input.data);
+
+  ctx.input = input_wide_array(100000);
+  arena_ctx.input = ctx.input;
+  measure("wide array, malloc", op_decode, &ctx, ctx.input.len);
+  measure("wide array, arena", op_decode_arena, &arena_ctx, ctx.input.len);
+  free(ctx.input.data);
+
+  hsdt_arena_free(&arena_ctx.arena);
+}
+
+typedef struct ParseCtx {
+  Buf input;
+  HSDT_Callbacks callbacks;
+  size_t count;
+} ParseCtx;
+
+static bool count_key(void *ctx_, uint8_t *key, size_t len) {
+  ParseCtx *ctx = ctx_;
+  (void) key;
+  ctx->count += len;
+  return true;
+}
+
+static bool count_utf8_string(void *ctx_, uint8_t *str, size_t len) {
+  ParseCtx *ctx = ctx_;
+  (void) str;
+  ctx->count += len;
+  return true;
+}
+
+static void op_parse(void *ctx_) {
+  ParseCtx *ctx = ctx_;
+  HSDT_Parse_Frame stack[HSDT_DEFAULT_MAX_DEPTH];
+  size_t consumed;
+  HSDT_ERR err = hsdt_parse(ctx->input.data, ctx->input.len, &ctx->callbacks, ctx, &consumed, stack, HSDT_DEFAULT_MAX_DEPTH);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+}
+
+static void bench_parse(void) {
+  DecodeCtx ctx;
+  ParseCtx parse_ctx = {0};
+  ctx.max_depth = HSDT_DEFAULT_MAX_DEPTH;
+
+  ctx.input = input_wide_map(10000);
+  parse_ctx.input = ctx.input;
+  measure("wide map, decode", op_decode, &ctx, ctx.input.len);
+  measure("wide map, parse (no callbacks)", op_parse, &parse_ctx, ctx.input.len);
+  parse_ctx.callbacks.key = count_key;
+  parse_ctx.callbacks.utf8_string = count_utf8_string;
+  measure("wide map, parse (counting)", op_parse, &parse_ctx, ctx.input.len);
+  free(ctx.input.data);
+}
+
+static void op_validate(void *ctx_) {
+  DecodeCtx *ctx = ctx_;
+  size_t consumed;
+  HSDT_ERR err = hsdt_validate(ctx->input.data, ctx->input.len, &consumed);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+}
+
+static void bench_validate(void) {
+  DecodeCtx ctx;
+
+  ctx.input = input_wide_map(10000);
+  measure("wide map", op_validate, &ctx, ctx.input.len);
+  free(ctx.input.data);
+
+  ctx.input = input_wide_array(100000);
+  measure("wide array", op_validate, &ctx, ctx.input.len);
+  free(ctx.input.data);
+
+  ctx.input = input_strings(100000);
+  measure("strings", op_validate, &ctx, ctx.input.len);
+  free(ctx.input.data);
+}
+
+/* Text in which every `period`-th character is the utf8 encoding `multi` (`NULL` for plain ascii). */
+static Buf input_text(size_t len, size_t period, const char *multi) {
+  Buf text = {0};
+  size_t i = 0;
+  while (text.len < len) {
+    if (multi != NULL && i % period == 0) {
+      buf_push(&text, multi, strlen(multi));
+    } else {
+      buf_push_byte(&text, 'a' + i % 26);
+    }
+    i += 1;
+  }
+
+  Buf buf = {0};
+  buf_push_header(&buf, 0x60, text.len);
+  buf_push(&buf, text.data, text.len);
+  free(text.data);
+  return buf;
+}
+
+static void bench_utf8(void) {
+  DecodeCtx ctx;
+  const char *impl_names[] = {"auto", "scalar", "sse4.2", "avx2"};
+  const char *corpus_names[] = {"ascii", "mixed", "cjk"};
+  char name[64];
+
+  for (size_t corpus = 0; corpus < 3; corpus++) {
+    if (corpus == 0) {
+      ctx.input = input_text(1 << 20, 1, NULL);
+    } else if (corpus == 1) {
+      ctx.input = input_text(1 << 20, 10, "\xc3\xbc"); /* u umlaut */
+    } else {
+      ctx.input = input_text(1 << 20, 1, "\xe6\xb0\xb4"); /* water */
+    }
+
+    for (HSDT_UTF8_IMPL impl = HSDT_UTF8_SCALAR; impl <= HSDT_UTF8_AVX2; impl++) {
+      if (hsdt_set_utf8_impl(impl)) {
+        snprintf(name, sizeof(name), "%s, %s", corpus_names[corpus], impl_names[impl]);
+        measure(name, op_validate, &ctx, ctx.input.len);
+      }
+    }
+    free(ctx.input.data);
+  }
+
+  hsdt_set_utf8_impl(HSDT_UTF8_AUTO);
+}
+
+/* A map of `len` entries, each a map of 8 short strings, some of them nested once more. */
+static Buf input_nested_maps(size_t len) {
+  Buf buf = {0};
+  buf_push_header(&buf, 0xA0, len);
+  for (size_t i = 0; i < len; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "entry%08zu", i);
+    buf_push_header(&buf, 0x60, 13);
+    buf_push(&buf, key, 13);
+
+    buf_push_header(&buf, 0xA0, 8);
+    for (char c = 'a'; c < 'i'; c++) {
+      buf_push_byte(&buf, 0x61);
+      buf_push_byte(&buf, c);
+      if (c == 'h') {
+        buf_push(&buf, "\xa2\x61x\xf5\x61y\x82\xf6\xf4", 9);
+      } else {
+        buf_push(&buf, "\x66" "foobar", 7);
+      }
+    }
+  }
+  return buf;
+}
+
+/* Append `len` small messages, maps which all use the same keys. */
+static void buf_push_messages(Buf *buf, size_t len) {
+  const char *keys[] = {"author", "content", "hash", "previous", "sequence", "signature", "timestamp"};
+  for (size_t i = 0; i < len; i++) {
+    buf_push_header(buf, 0xA0, 7);
+    for (size_t j = 0; j < 7; j++) {
+      buf_push_header(buf, 0x60, strlen(keys[j]));
+      buf_push(buf, keys[j], strlen(keys[j]));
+      if (j == 1) {
+        buf_push(buf, "\xa2\x64text\x65hello\x64type\x64post", 22);
+      } else {
+        buf_push(buf, "\x48\x01\x02\x03\x04\x05\x06\x07\x08", 9);
+      }
+    }
+  }
+}
+
+/* An array of `len` small messages. */
+static Buf input_messages(size_t len) {
+  Buf buf = {0};
+  buf_push_header(&buf, 0x80, len);
+  buf_push_messages(&buf, len);
+  return buf;
+}
+
+/* The same messages, but concatenated rather than in an array. */
+static Buf input_message_batch(size_t len) {
+  Buf buf = {0};
+  buf_push_messages(&buf, len);
+  return buf;
+}
+
+typedef struct EncodeCtx {
+  HSDT_Value val;
+  size_t len;
+  uint8_t *out; /* Room for `len` bytes. */
+} EncodeCtx;
+
+static void op_encode(void *ctx_) {
+  EncodeCtx *ctx = ctx_;
+  size_t len;
+  uint8_t *enc = hsdt_encode(ctx->val, &len);
+  assert(len == ctx->len);
+  free(enc);
+}
+
+static void op_encode_into(void *ctx_) {
+  EncodeCtx *ctx = ctx_;
+  size_t len = hsdt_encode_into(ctx->val, ctx->out, ctx->len);
+  assert(len == ctx->len);
+  (void) len;
+}
+
+static bool discard_write(void *ctx, const uint8_t *chunk, size_t len) {
+  (void) ctx;
+  (void) chunk;
+  (void) len;
+  return true;
+}
+
+static void op_encode_stream(void *ctx_) {
+  EncodeCtx *ctx = ctx_;
+  uint8_t chunk[4096];
+  bool done = hsdt_encode_stream(ctx->val, chunk, sizeof(chunk), discard_write, NULL);
+  assert(done);
+  (void) done;
+}
+
+static void op_encoding_len(void *ctx_) {
+  EncodeCtx *ctx = ctx_;
+  size_t len = hsdt_encoding_len(ctx->val);
+  assert(len == ctx->len);
+  (void) len;
+}
+
+static void bench_encode(void) {
+  Buf inputs[] = {input_nested_maps(10000), input_wide_map(10000), input_wide_array(100000)};
+  const char *names[] = {"nested maps", "wide map", "wide array"};
+  char name[64];
+
+  for (size_t i = 0; i < 3; i++) {
+    EncodeCtx ctx;
+    size_t consumed;
+    HSDT_ERR err = hsdt_decode(inputs[i].data, inputs[i].len, &ctx.val, &consumed);
+    assert(err == HSDT_ERR_NONE);
+    (void) err;
+    ctx.len = inputs[i].len;
+    ctx.out = malloc(ctx.len);
+
+    snprintf(name, sizeof(name), "%s, encode", names[i]);
+    measure(name, op_encode, &ctx, ctx.len);
+    snprintf(name, sizeof(name), "%s, encode_into", names[i]);
+    measure(name, op_encode_into, &ctx, ctx.len);
+    snprintf(name, sizeof(name), "%s, encode_stream (4KiB chunks)", names[i]);
+    measure(name, op_encode_stream, &ctx, ctx.len);
+    snprintf(name, sizeof(name), "%s, encoding_len", names[i]);
+    measure(name, op_encoding_len, &ctx, ctx.len);
+
+    hsdt_value_free(ctx.val);
+    free(ctx.out);
+    free(inputs[i].data);
+  }
+}
+
+typedef struct StreamCtx {
+  Buf input;
+  size_t chunk_len;
+} StreamCtx;
+
+static void op_stream(void *ctx_) {
+  StreamCtx *ctx = ctx_;
+  HSDT_Value val;
+  HSDT_Dec_State state;
+  HSDT_ERR err = HSDT_ERR_EOF;
+
+  hsdt_dec_init(&state, &val, HSDT_DEFAULT_MAX_DEPTH);
+  for (size_t pos = 0; pos < ctx->input.len && err == HSDT_ERR_EOF; pos += ctx->chunk_len) {
+    size_t consumed;
+    size_t len = ctx->input.len - pos < ctx->chunk_len ? ctx->input.len - pos : ctx->chunk_len;
+    err = hsdt_dec_feed(&state, ctx->input.data + pos, len, &consumed);
+  }
+  assert(err == HSDT_ERR_NONE);
+  hsdt_dec_free(&state);
+  hsdt_value_free(val);
+}
+
+static void bench_stream(void) {
+  StreamCtx ctx;
+  char name[64];
+  size_t chunk_lens[] = {16, 1500, 65536};
+
+  ctx.input = input_wide_map(10000);
+  for (size_t i = 0; i < sizeof(chunk_lens) / sizeof(size_t); i++) {
+    ctx.chunk_len = chunk_lens[i];
+    snprintf(name, sizeof(name), "wide map, %zu byte chunks", ctx.chunk_len);
+    measure(name, op_stream, &ctx, ctx.input.len);
+  }
+  free(ctx.input.data);
+
+  ctx.input = input_wide_array(100000);
+  ctx.chunk_len = 1500;
+  measure("wide array, 1500 byte chunks", op_stream, &ctx, ctx.input.len);
+  free(ctx.input.data);
+}
+
+typedef struct TapeCtx {
+  Buf input;
+  HSDT_Tape tape;
+  HSDT_Value val;
+  size_t count;
+} TapeCtx;
+
+static void op_decode_tape(void *ctx_) {
+  TapeCtx *ctx = ctx_;
+  size_t consumed;
+  HSDT_ERR err = hsdt_decode_tape(&ctx->tape, ctx->input.data, ctx->input.len, &consumed, HSDT_DEFAULT_MAX_DEPTH);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+}
+
+/* Visit all entries of the top-level map, summing up key lengths and entry counts of the values. */
+static void op_iterate_rax(void *ctx_) {
+  TapeCtx *ctx = ctx_;
+  raxIterator iter;
+  raxStart(&iter, ctx->val.map);
+  raxSeek(&iter, "^", (unsigned char*) "", 0);
+  while (raxNext(&iter)) {
+    ctx->count += iter.key_len + ((HSDT_Value *) iter.data)->array.len;
+  }
+  raxStop(&iter);
+}
+
+static void op_iterate_tape(void *ctx_) {
+  TapeCtx *ctx = ctx_;
+  HSDT_Tape *tape = &ctx->tape;
+  for (size_t i = 1; i < tape->entries[0].end; i = hsdt_tape_skip(tape, i + 1)) {
+    ctx->count += tape->entries[i].len + tape->entries[i + 1].len;
+  }
+}
+
+/* Look up every 100th key of the top-level map. */
+static void op_lookup_rax(void *ctx_) {
+  TapeCtx *ctx = ctx_;
+  char key[16];
+  for (size_t i = 0; i < 10000; i += 100) {
+    snprintf(key, sizeof(key), "key%08zu", i);
+    ctx->count += raxFind(ctx->val.map, (unsigned char *) key, 11) != raxNotFound;
+  }
+}
+
+static void op_lookup_tape(void *ctx_) {
+  TapeCtx *ctx = ctx_;
+  char key[16];
+  for (size_t i = 0; i < 10000; i += 100) {
+    snprintf(key, sizeof(key), "key%08zu", i);
+    ctx->count += hsdt_tape_map_get(&ctx->tape, 0, (uint8_t *) key, 11) != SIZE_MAX;
+  }
+}
+
+static void bench_tape(void) {
+  DecodeCtx ctx;
+  TapeCtx tape_ctx;
+  size_t consumed;
+  ctx.max_depth = HSDT_DEFAULT_MAX_DEPTH;
+  hsdt_tape_init(&tape_ctx.tape);
+
+  ctx.input = input_wide_map(10000);
+  tape_ctx.input = ctx.input;
+  tape_ctx.count = 0;
+  measure("wide map, decode", op_decode, &ctx, ctx.input.len);
+  measure("wide map, decode_tape", op_decode_tape, &tape_ctx, ctx.input.len);
+
+  HSDT_ERR err = hsdt_decode(ctx.input.data, ctx.input.len, &tape_ctx.val, &consumed);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+  op_decode_tape(&tape_ctx);
+  measure("wide map, iterate rax", op_iterate_rax, &tape_ctx, ctx.input.len);
+  measure("wide map, iterate tape", op_iterate_tape, &tape_ctx, ctx.input.len);
+  measure("wide map, 100 lookups rax", op_lookup_rax, &tape_ctx, ctx.input.len);
+  measure("wide map, 100 lookups tape", op_lookup_tape, &tape_ctx, ctx.input.len);
+  hsdt_value_free(tape_ctx.val);
+  free(ctx.input.data);
+
+  ctx.input = input_wide_array(100000);
+  tape_ctx.input = ctx.input;
+  measure("wide array, decode", op_decode, &ctx, ctx.input.len);
+  measure("wide array, decode_tape", op_decode_tape, &tape_ctx, ctx.input.len);
+  free(ctx.input.data);
+
+  hsdt_tape_free(&tape_ctx.tape);
+}
+
+typedef struct MapsCtx {
+  DecodeWithCtx decode;
+  HSDT_Value val;
+  size_t count;
+} MapsCtx;
+
+/* Look up every 100th key of a wide map, and one that does not exist. */
+static void op_map_get(void *ctx_) {
+  MapsCtx *ctx = ctx_;
+  char key[16];
+  for (size_t i = 0; i <= 10000; i += 100) {
+    snprintf(key, sizeof(key), "key%08zu", i);
+    ctx->count += hsdt_map_get(&ctx->val, (uint8_t *) key, 11) != NULL;
+  }
+}
+
+static void bench_maps(void) {
+  Buf inputs[] = {input_wide_map(10000), input_nested_maps(10000)};
+  const char *names[] = {"wide map", "nested maps"};
+  const char *repr_names[] = {"rax", "sorted"};
+  char name[64];
+
+  for (size_t i = 0; i < 2; i++) {
+    for (HSDT_MAP_REPR repr = HSDT_MAP_RAX; repr <= HSDT_MAP_SORTED; repr++) {
+      MapsCtx ctx;
+      EncodeCtx enc_ctx;
+      size_t consumed;
+      ctx.decode.input = inputs[i];
+      ctx.decode.opts.map_repr = repr;
+      ctx.decode.opts.short_strings = false;
+      ctx.decode.opts.intern = NULL;
+      ctx.count = 0;
+
+      snprintf(name, sizeof(name), "%s, decode %s", names[i], repr_names[repr]);
+      measure(name, op_decode_with, &ctx.decode, inputs[i].len);
+
+      HSDT_ERR err = hsdt_decode_with(&ctx.decode.opts, inputs[i].data, inputs[i].len, &ctx.val, &consumed);
+      assert(err == HSDT_ERR_NONE);
+      (void) err;
+      if (i == 0) {
+        snprintf(name, sizeof(name), "%s, 101 lookups %s", names[i], repr_names[repr]);
+        measure(name, op_map_get, &ctx, inputs[i].len);
+      }
+
+      enc_ctx.val = ctx.val;
+      enc_ctx.len = inputs[i].len;
+      snprintf(name, sizeof(name), "%s, encode %s", names[i], repr_names[repr]);
+      measure(name, op_encode, &enc_ctx, inputs[i].len);
+      hsdt_value_free(ctx.val);
+    }
+    free(inputs[i].data);
+  }
+}
+
+static void bench_short_strings(void) {
+  Buf inputs[] = {input_wide_array(100000), input_strings(100000), input_nested_maps(10000)};
+  const char *names[] = {"wide array", "strings", "nested maps"};
+  char name[64];
+
+  for (size_t i = 0; i < 3; i++) {
+    for (int enabled = 0; enabled < 2; enabled++) {
+      DecodeWithCtx ctx;
+      EncodeCtx enc_ctx;
+      size_t consumed;
+      ctx.input = inputs[i];
+      ctx.opts.map_repr = HSDT_MAP_RAX;
+      ctx.opts.short_strings = enabled;
+      ctx.opts.intern = NULL;
+
+      snprintf(name, sizeof(name), "%s, decode %s", names[i], enabled ? "inline" : "sds");
+      measure(name, op_decode_with, &ctx, inputs[i].len);
+
+      HSDT_ERR err = hsdt_decode_with(&ctx.opts, inputs[i].data, inputs[i].len, &enc_ctx.val, &consumed);
+      assert(err == HSDT_ERR_NONE);
+      (void) err;
+      enc_ctx.len = inputs[i].len;
+      snprintf(name, sizeof(name), "%s, encode %s", names[i], enabled ? "inline" : "sds");
+      measure(name, op_encode, &enc_ctx, inputs[i].len);
+      hsdt_value_free(enc_ctx.val);
+    }
+    free(inputs[i].data);
+  }
+}
+
+typedef struct InternCtx {
+  Buf input;
+  HSDT_Intern_Table table;
+  HSDT_Value val;
+  HSDT_Key *key;
+  size_t count;
+} InternCtx;
+
+/* Look up the "sequence" of every message. */
+static void op_get_sequence(void *ctx_) {
+  InternCtx *ctx = ctx_;
+  for (size_t i = 0; i < ctx->val.array.len; i++) {
+    ctx->count += hsdt_map_get(&ctx->val.array.elems[i], (uint8_t *) "sequence", 8) != NULL;
+  }
+}
+
+static void op_get_sequence_interned(void *ctx_) {
+  InternCtx *ctx = ctx_;
+  for (size_t i = 0; i < ctx->val.array.len; i++) {
+    ctx->count += hsdt_map_get_interned(&ctx->val.array.elems[i], ctx->key) != NULL;
+  }
+}
+
+static void bench_intern(void) {
+  DecodeWithCtx ctx;
+  DecodeWithCtx interned_ctx;
+  InternCtx intern_ctx;
+  size_t consumed;
+  ctx.input = input_messages(10000);
+  ctx.opts.map_repr = HSDT_MAP_SORTED;
+  ctx.opts.short_strings = false;
+  ctx.opts.intern = NULL;
+  intern_ctx.input = ctx.input;
+  intern_ctx.count = 0;
+  hsdt_intern_init(&intern_ctx.table, 1024);
+  interned_ctx = ctx;
+  interned_ctx.opts.intern = &intern_ctx.table;
+
+  measure("messages, decode sorted", op_decode_with, &ctx, ctx.input.len);
+  measure("messages, decode interned", op_decode_with, &interned_ctx, ctx.input.len);
+
+  HSDT_ERR err = hsdt_decode_with(&ctx.opts, ctx.input.data, ctx.input.len, &intern_ctx.val, &consumed);
+  assert(err == HSDT_ERR_NONE);
+  measure("messages, get sequence", op_get_sequence, &intern_ctx, ctx.input.len);
+  hsdt_value_free(intern_ctx.val);
+
+  err = hsdt_decode_with(&interned_ctx.opts, ctx.input.data, ctx.input.len, &intern_ctx.val, &consumed);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+  intern_ctx.key = hsdt_intern_find(&intern_ctx.table, (uint8_t *) "sequence", 8);
+  measure("messages, get sequence interned", op_get_sequence_interned, &intern_ctx, ctx.input.len);
+  hsdt_value_free(intern_ctx.val);
+
+  hsdt_intern_free(&intern_ctx.table);
+  free(ctx.input.data);
+}
+
+typedef struct LazyCtx {
+  Buf input;
+  int mode; /* 0: decode everything, 1: lazy with validation, 2: lazy without validation */
+  size_t count;
+} LazyCtx;
+
+/* Decode an array of messages and read the content type of the one in the middle. */
+static void op_lazy(void *ctx_) {
+  LazyCtx *ctx = ctx_;
+  HSDT_Value val;
+  size_t consumed;
+  HSDT_ERR err;
+  if (ctx->mode == 0) {
+    err = hsdt_decode(ctx->input.data, ctx->input.len, &val, &consumed);
+  } else {
+    err = hsdt_decode_lazy(ctx->input.data, ctx->input.len, &val, &consumed, ctx->mode == 1);
+  }
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+
+  HSDT_Value *msg = hsdt_array_get(&val, val.array.len / 2);
+  HSDT_Value *type = hsdt_map_get(hsdt_map_get(msg, (uint8_t *) "content", 7), (uint8_t *) "type", 4);
+  ctx->count += sdslen(type->utf8_string);
+  hsdt_value_free(val);
+}
+
+static void bench_lazy(void) {
+  LazyCtx ctx;
+  const char *names[] = {"messages, decode", "messages, lazy", "messages, lazy unvalidated"};
+  ctx.input = input_messages(10000);
+  ctx.count = 0;
+
+  for (ctx.mode = 0; ctx.mode < 3; ctx.mode++) {
+    measure(names[ctx.mode], op_lazy, &ctx, ctx.input.len);
+  }
+  free(ctx.input.data);
+}
+
+typedef struct CursorCtx {
+  Buf input;
+  bool all; /* Read the content type of every message, not only of the one in the middle */
+  size_t count;
+} CursorCtx;
+
+/* Read the content type of a message without decoding it. */
+static void cursor_read_type(CursorCtx *ctx, HSDT_Cursor msg) {
+  HSDT_Cursor_Item item;
+  bool found;
+  HSDT_ERR err = hsdt_cursor_find(&msg, (uint8_t *) "content", 7, &found);
+  assert(err == HSDT_ERR_NONE && found);
+  err = hsdt_cursor_find(&msg, (uint8_t *) "type", 4, &found);
+  assert(err == HSDT_ERR_NONE && found);
+  err = hsdt_cursor_read(&msg, &item);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+  ctx->count += item.str.len;
+}
+
+static void op_cursor(void *ctx_) {
+  CursorCtx *ctx = ctx_;
+  HSDT_Cursor cur;
+  HSDT_Cursor_Item item;
+  bool found;
+  hsdt_cursor_init(&cur, ctx->input.data, ctx->input.len);
+  HSDT_ERR err = hsdt_cursor_read(&cur, &item);
+  assert(err == HSDT_ERR_NONE);
+
+  if (ctx->all) {
+    err = hsdt_cursor_enter(&cur);
+    while (err == HSDT_ERR_NONE && cur.remaining > 0) {
+      cursor_read_type(ctx, cur);
+      err = hsdt_cursor_next(&cur);
+    }
+  } else {
+    err = hsdt_cursor_index(&cur, item.len / 2, &found);
+    cursor_read_type(ctx, cur);
+  }
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+}
+
+/* Read the content type of every message from a fully decoded value, for comparison. */
+static void op_decode_all_types(void *ctx_) {
+  CursorCtx *ctx = ctx_;
+  HSDT_Value val;
+  size_t consumed;
+  HSDT_ERR err = hsdt_decode(ctx->input.data, ctx->input.len, &val, &consumed);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+
+  for (size_t i = 0; i < val.array.len; i++) {
+    HSDT_Value *type = hsdt_map_get(hsdt_map_get(&val.array.elems[i], (uint8_t *) "content", 7), (uint8_t *) "type", 4);
+    ctx->count += sdslen(type->utf8_string);
+  }
+  hsdt_value_free(val);
+}
+
+static void bench_cursor(void) {
+  CursorCtx ctx;
+  ctx.input = input_messages(10000);
+  ctx.count = 0;
+
+  ctx.all = false;
+  measure("messages, cursor, middle type", op_cursor, &ctx, ctx.input.len);
+  measure("messages, decode, all types", op_decode_all_types, &ctx, ctx.input.len);
+  ctx.all = true;
+  measure("messages, cursor, all types", op_cursor, &ctx, ctx.input.len);
+  free(ctx.input.data);
+}
+
+typedef struct PathCtx {
+  Buf input;
+  HSDT_Path path;
+  bool each; /* Query every message instead of the whole array */
+  size_t count;
+} PathCtx;
+
+static void op_path(void *ctx_) {
+  PathCtx *ctx = ctx_;
+  HSDT_Cursor cur;
+  HSDT_Cursor_Item item;
+  bool found;
+  HSDT_ERR err;
+  hsdt_cursor_init(&cur, ctx->input.data, ctx->input.len);
+
+  if (ctx->each) {
+    err = hsdt_cursor_enter(&cur);
+    while (err == HSDT_ERR_NONE && cur.remaining > 0) {
+      HSDT_Cursor msg = cur;
+      err = hsdt_path_query(&ctx->path, &msg, &found);
+      assert(err == HSDT_ERR_NONE && found);
+      err = hsdt_cursor_read(&msg, &item);
+      assert(err == HSDT_ERR_NONE);
+      ctx->count += item.str.len;
+      err = hsdt_cursor_next(&cur);
+    }
+  } else {
+    err = hsdt_path_query(&ctx->path, &cur, &found);
+    assert(err == HSDT_ERR_NONE && found);
+    err = hsdt_cursor_read(&cur, &item);
+    ctx->count += item.str.len;
+  }
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+}
+
+static void bench_path(void) {
+  PathCtx ctx;
+  ctx.input = input_messages(10000);
+  ctx.count = 0;
+
+  bool ok = hsdt_path_compile(&ctx.path, "[5000].content.type");
+  assert(ok);
+  ctx.each = false;
+  measure("messages, [5000].content.type", op_path, &ctx, ctx.input.len);
+  hsdt_path_free(&ctx.path);
+
+  ok = hsdt_path_compile(&ctx.path, "content.type");
+  assert(ok);
+  (void) ok;
+  ctx.each = true;
+  measure("messages, each content.type", op_path, &ctx, ctx.input.len);
+  hsdt_path_free(&ctx.path);
+  free(ctx.input.data);
+}
+
+/* The paths an indexer extracts from every message, some of them are missing. */
+static const char *index_paths[] = {
+  "author", "branch", "content", "content.mentions[0].link", "content.mentions[1].link", "content.root",
+  "content.text", "content.type", "hash", "previous", "root", "sequence", "signature", "timestamp"
+};
+#define NUM_INDEX_PATHS (sizeof(index_paths) / sizeof(char *))
+
+typedef struct PathSetCtx {
+  Buf input;
+  HSDT_Path paths[NUM_INDEX_PATHS];
+  HSDT_Path_Set set;
+  size_t count;
+} PathSetCtx;
+
+/* Query each path separately on every message. */
+static void op_paths_separately(void *ctx_) {
+  PathSetCtx *ctx = ctx_;
+  HSDT_Cursor cur;
+  hsdt_cursor_init(&cur, ctx->input.data, ctx->input.len);
+  HSDT_ERR err = hsdt_cursor_enter(&cur);
+  while (err == HSDT_ERR_NONE && cur.remaining > 0) {
+    for (size_t i = 0; i < NUM_INDEX_PATHS && err == HSDT_ERR_NONE; i++) {
+      HSDT_Cursor target = cur;
+      bool found;
+      err = hsdt_path_query(&ctx->paths[i], &target, &found);
+      ctx->count += found;
+    }
+    if (err == HSDT_ERR_NONE) {
+      err = hsdt_cursor_next(&cur);
+    }
+  }
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+}
+
+/* Extract all paths from every message in one pass. */
+static void op_path_set(void *ctx_) {
+  PathSetCtx *ctx = ctx_;
+  HSDT_Cursor cur;
+  HSDT_Cursor results[NUM_INDEX_PATHS];
+  bool found[NUM_INDEX_PATHS];
+  hsdt_cursor_init(&cur, ctx->input.data, ctx->input.len);
+  HSDT_ERR err = hsdt_cursor_enter(&cur);
+  while (err == HSDT_ERR_NONE && cur.remaining > 0) {
+    err = hsdt_path_set_extract(&ctx->set, &cur, results, found);
+    for (size_t i = 0; i < NUM_INDEX_PATHS; i++) {
+      ctx->count += found[i];
+    }
+    if (err == HSDT_ERR_NONE) {
+      err = hsdt_cursor_next(&cur);
+    }
+  }
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+}
+
+static void bench_path_set(void) {
+  PathSetCtx ctx;
+  bool ok = true;
+  ctx.input = input_messages(10000);
+  ctx.count = 0;
+  for (size_t i = 0; i < NUM_INDEX_PATHS; i++) {
+    ok = ok && hsdt_path_compile(&ctx.paths[i], index_paths[i]);
+  }
+  ok = ok && hsdt_path_set_compile(&ctx.set, index_paths, NUM_INDEX_PATHS);
+  assert(ok);
+  (void) ok;
+
+  measure("messages, 14 paths separately", op_paths_separately, &ctx, ctx.input.len);
+  measure("messages, 14 paths in one pass", op_path_set, &ctx, ctx.input.len);
+
+  for (size_t i = 0; i < NUM_INDEX_PATHS; i++) {
+    hsdt_path_free(&ctx.paths[i]);
+  }
+  hsdt_path_set_free(&ctx.set);
+  free(ctx.input.data);
+}
+
+typedef struct IndexCtx {
+  Buf input;
+  HSDT_Index index;
+  bool use_index;
+  size_t count;
+} IndexCtx;
+
+static void op_index_build(void *ctx_) {
+  IndexCtx *ctx = ctx_;
+  size_t consumed;
+  HSDT_ERR err = hsdt_index_build(&ctx->index, ctx->input.data, ctx->input.len, 16, &consumed);
+  assert(err == HSDT_ERR_NONE);
+  (void) err;
+}
+
+/* Read 100 entries spread over the top-level array. */
+static void op_index_array(void *ctx_) {
+  IndexCtx *ctx = ctx_;
+  HSDT_Cursor root;
+  hsdt_cursor_init(&root, ctx->input.data, ctx->input.len);
+  for (size_t i = 0; i < 100; i++) {
+    HSDT_Cursor cur = root;
+    bool found;
+    HSDT_ERR err;
+    if (ctx->use_index) {
+      err = hsdt_index_array_get(&ctx->index, &cur, i * 997, &found);
+    } else {
+      err = hsdt_cursor_index(&cur, i * 997, &found);
+    }
+    assert(err == HSDT_ERR_NONE && found);
+    (void) err;
+    ctx->count += cur.pos;
+  }
+}
+
+/* Look up 100 keys spread over the top-level map. */
+static void op_index_map(void *ctx_) {
+  IndexCtx *ctx = ctx_;
+  HSDT_Cursor root;
+  hsdt_cursor_init(&root, ctx->input.data, ctx->input.len);
+  for (size_t i = 0; i < 100; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "key%08zu", i * 997);
+    HSDT_Cursor cur = root;
+    bool found;
+    HSDT_ERR err;
+    if (ctx->use_index) {
+      err = hsdt_index_map_get(&ctx->index, &cur, (uint8_t *) key, 11, &found);
+    } else {
+      err = hsdt_cursor_find(&cur, (uint8_t *) key, 11, &found);
+    }
+    assert(err == HSDT_ERR_NONE && found);
+    (void) err;
+    ctx->count += cur.pos;
+  }
+}
+
+static void bench_index(void) {
+  IndexCtx ctx;
+  size_t consumed;
+  Buf inputs[] = {input_messages(100000), input_wide_map(100000)};
+  const char *names[] = {"messages", "wide map"};
+  void (*ops[])(void *) = {op_index_array, op_index_map};
+  char name[64];
+  ctx.count = 0;
+  hsdt_index_init(&ctx.index);
+
+  for (size_t i = 0; i < 2; i++) {
+    ctx.input = inputs[i];
+    snprintf(name, sizeof(name), "%s, build index", names[i]);
+    measure(name, op_index_build, &ctx, ctx.input.len);
+
+    ctx.use_index = false;
+    snprintf(name, sizeof(name), "%s, 100 lookups, cursor", names[i]);
+    measure(name, ops[i], &ctx, ctx.input.len);
+    HSDT_ERR err = hsdt_index_build(&ctx.index, ctx.input.data, ctx.input.len, 16, &consumed);
+    assert(err == HSDT_ERR_NONE);
+    (void) err;
+    ctx.use_index = true;
+    snprintf(name, sizeof(name), "%s, 100 lookups, index", names[i]);
+    measure(name, ops[i], &ctx, ctx.input.len);
+    free(inputs[i].data);
+  }
+  hsdt_index_free(&ctx.index);
+}
+
+typedef struct BatchCtx {
+  Buf input;
+  HSDT_Arena arena;
+  HSDT_Batch_Result *results;
+  size_t max_results;
+  int mode; /* 0: hsdt_decode, 1: hsdt_decode_arena, 2: batch, 3: batch in an arena */
+} BatchCtx;
+
+static void op_batch(void *ctx_) {
+  BatchCtx *ctx = ctx_;
+  size_t consumed;
+  size_t n = 0;
+
+  if (ctx->mode < 2) {
+    size_t pos = 0;
+    while (pos < ctx->input.len) {
+      HSDT_ERR err;
+      if (ctx->mode == 0) {
+        err = hsdt_decode(ctx->input.data + pos, ctx->input.len - pos, &ctx->results[n].val, &consumed);
+      } else {
+        err = hsdt_decode_arena(&ctx->arena, ctx->input.data + pos, ctx->input.len - pos, &ctx->results[n].val, &consumed);
+      }
+      assert(err == HSDT_ERR_NONE);
+      (void) err;
+      pos += consumed;
+      n += 1;
+    }
+  } else {
+    n = hsdt_decode_batch(ctx->mode == 3 ? &ctx->arena : NULL, ctx->input.data, ctx->input.len, ctx->results, ctx->max_results, &consumed);
+    assert(consumed == ctx->input.len);
+  }
+
+  if (ctx->mode % 2 == 0) {
+    for (size_t i = 0; i < n; i++) {
+      hsdt_value_free(ctx->results[i].val);
+    }
+  } else {
+    hsdt_arena_reset(&ctx->arena);
+  }
+}
+
+static void bench_batch(void) {
+  BatchCtx ctx;
+  const char *names[] = {"messages, decode loop", "messages, decode_arena loop", "messages, batch", "messages, batch in arena"};
+  ctx.max_results = 10000;
+  ctx.input = input_message_batch(ctx.max_results);
+  ctx.results = malloc(ctx.max_results * sizeof(HSDT_Batch_Result));
+  hsdt_arena_init(&ctx.arena);
+
+  for (ctx.mode = 0; ctx.mode < 4; ctx.mode++) {
+    measure(names[ctx.mode], op_batch, &ctx, ctx.input.len);
+  }
+
+  hsdt_arena_free(&ctx.arena);
+  free(ctx.results);
+  free(ctx.input.data);
+}
+
+typedef struct ParallelBatchCtx {
+  Buf input;
+  HSDT_Pool *pool;
+  HSDT_Arena *arenas;
+  HSDT_Batch_Result *results;
+  size_t max_results;
+} ParallelBatchCtx;
+
+static void op_batch_parallel(void *ctx_) {
+  ParallelBatchCtx *ctx = ctx_;
+  size_t consumed;
+  size_t n = hsdt_decode_batch_parallel(ctx->pool, ctx->arenas, ctx->input.data, ctx->input.len, ctx->results, ctx->max_results, &consumed);
+  assert(n == ctx->max_results && consumed == ctx->input.len);
+  (void) n;
+  for (size_t i = 0; i < hsdt_pool_threads(ctx->pool); i++) {
+    hsdt_arena_reset(ctx->arenas + i);
+  }
+}
+
+/* Decode a batch with 1, 2, 4, ... threads, up to the number of processors. */
+static void bench_parallel(void) {
+  ParallelBatchCtx ctx;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_threads = cpus < 1 ? 1 : cpus;
+  char name[64];
+  ctx.max_results = 100000;
+  ctx.input = input_message_batch(ctx.max_results);
+  ctx.results = malloc(ctx.max_results * sizeof(HSDT_Batch_Result));
+  ctx.arenas = malloc(max_threads * sizeof(HSDT_Arena));
+  for (size_t i = 0; i < max_threads; i++) {
+    hsdt_arena_init(ctx.arenas + i);
+  }
+
+  for (size_t threads = 1; ; threads *= 2) {
+    if (threads > max_threads) {
+      threads = max_threads;
+    }
+    ctx.pool = hsdt_pool_new(threads);
+    snprintf(name, sizeof(name), "messages, %zu threads", threads);
+    measure(name, op_batch_parallel, &ctx, ctx.input.len);
+    hsdt_pool_free(ctx.pool);
+    if (threads == max_threads) {
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < max_threads; i++) {
+    hsdt_arena_free(ctx.arenas + i);
+  }
+  free(ctx.arenas);
+  free(ctx.results);
+  free(ctx.input.data);
+}
+
+typedef struct ParallelEncodeCtx {
+  HSDT_Value val;
+  size_t len;
+  HSDT_Pool *pool;
+} ParallelEncodeCtx;
+
+static void op_encode_parallel(void *ctx_) {
+  ParallelEncodeCtx *ctx = ctx_;
+  size_t len;
+  uint8_t *enc = hsdt_encode_parallel(ctx->pool, ctx->val, &len);
+  assert(len == ctx->len);
+  free(enc);
+}
+
+/* Encode large values with 1, 2, 4, ... threads, up to the number of processors. */
+static void bench_parallel_encode(void) {
+  ParallelEncodeCtx ctx;
+  EncodeCtx enc_ctx;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_threads = cpus < 1 ? 1 : cpus;
+  Buf inputs[] = {input_wide_array(1000000), input_messages(100000)};
+  const char *names[] = {"wide array", "messages"};
+  char name[64];
+
+  for (size_t i = 0; i < 2; i++) {
+    size_t consumed;
+    HSDT_ERR err = hsdt_decode(inputs[i].data, inputs[i].len, &ctx.val, &consumed);
+    assert(err == HSDT_ERR_NONE);
+    (void) err;
+    ctx.len = inputs[i].len;
+    enc_ctx.val = ctx.val;
+    enc_ctx.len = ctx.len;
+    snprintf(name, sizeof(name), "%s, encode", names[i]);
+    measure(name, op_encode, &enc_ctx, ctx.len);
+
+    for (size_t threads = 1; ; threads *= 2) {
+      if (threads > max_threads) {
+        threads = max_threads;
+      }
+      ctx.pool = hsdt_pool_new(threads);
+      snprintf(name, sizeof(name), "%s, %zu threads", names[i], threads);
+      measure(name, op_encode_parallel, &ctx, ctx.len);
+      hsdt_pool_free(ctx.pool);
+      if (threads == max_threads) {
+        break;
+      }
+    }
+
+    hsdt_value_free(ctx.val);
+    free(inputs[i].data);
+  }
+}
+
+typedef struct ParallelValidateCtx {
+  Buf input;
+  HSDT_Pool *pool;
+} ParallelValidateCtx;
+
+static void op_validate_parallel(void *ctx_) {
+  ParallelValidateCtx *ctx = ctx_;
+  size_t consumed;
+  HSDT_ERR err = hsdt_validate_parallel(ctx->pool, ctx->input.data, ctx->input.len, &consumed);
+  assert(err == HSDT_ERR_NONE && consumed == ctx->input.len);
+  (void) err;
+}
+
+/* Validate large documents with 1, 2, 4, ... threads, up to the number of processors. */
+static void bench_parallel_validate(void) {
+  ParallelValidateCtx ctx;
+  DecodeCtx validate_ctx;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_threads = cpus < 1 ? 1 : cpus;
+  Buf inputs[] = {input_wide_map(1000000), input_messages(100000)};
+  const char *names[] = {"wide map", "messages"};
+  char name[64];
+
+  for (size_t i = 0; i < 2; i++) {
+    ctx.input = inputs[i];
+    validate_ctx.input = inputs[i];
+    snprintf(name, sizeof(name), "%s, validate", names[i]);
+    measure(name, op_validate, &validate_ctx, ctx.input.len);
+
+    for (size_t threads = 1; ; threads *= 2) {
+      if (threads > max_threads) {
+        threads = max_threads;
+      }
+      ctx.pool = hsdt_pool_new(threads);
+      snprintf(name, sizeof(name), "%s, %zu threads", names[i], threads);
+      measure(name, op_validate_parallel, &ctx, ctx.input.len);
+      hsdt_pool_free(ctx.pool);
+      if (threads == max_threads) {
+        break;
+      }
+    }
+
+    free(inputs[i].data);
+  }
+}
+
+typedef struct ReencodeCtx {
+  HSDT_Value val;
+  uint8_t *enc; /* The previous encoding, `val` may point into it */
+  bool lazy;
+  size_t count;
+} ReencodeCtx;
+
+/* Change one field of the message in the middle, then encode all messages again. */
+static void op_reencode(void *ctx_) {
+  ReencodeCtx *ctx = ctx_;
+  HSDT_Value *msg = hsdt_array_get(&ctx->val, ctx->val.array.len / 2);
+  HSDT_Value *sequence = hsdt_map_get(msg, (uint8_t *) "sequence", 8);
+  hsdt_value_free(*sequence);
+  sequence->tag = ctx->count % 2 == 0 ? HSDT_TRUE : HSDT_FALSE;
+  ctx->count += 1;
+
+  size_t len;
+  uint8_t *enc = ctx->lazy ? hsdt_encode_lazy(&ctx->val, &len) : hsdt_encode(ctx->val, &len);
+  free(ctx->enc);
+  ctx->enc = enc;
+}
+
+static void bench_reencode(void) {
+  ReencodeCtx ctx;
+  Buf input = input_messages(10000);
+  size_t consumed;
+  HSDT_ERR err;
+
+  for (int lazy = 0; lazy < 2; lazy++) {
+    ctx.lazy = lazy;
+    ctx.count = 0;
+    if (lazy) {
+      ctx.enc = malloc(input.len);
+      memcpy(ctx.enc, input.data, input.len);
+      err = hsdt_decode_lazy(ctx.enc, input.len, &ctx.val, &consumed, true);
+    } else {
+      ctx.enc = NULL;
+      err = hsdt_decode(input.data, input.len, &ctx.val, &consumed);
+    }
+    assert(err == HSDT_ERR_NONE);
+    (void) err;
+
+    measure(lazy ? "messages, lazy" : "messages, full", op_reencode, &ctx, input.len);
+    hsdt_value_free(ctx.val);
+    free(ctx.enc);
+  }
+  free(input.data);
+}
+
+typedef struct Benchmark {
+  const char *name;
+  void (*run)(void);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+  {"decode", bench_decode},
+  {"stream", bench_stream},
+  {"view", bench_view},
+  {"arena", bench_arena},
+  {"parse", bench_parse},
+  {"validate", bench_validate},
+  {"utf8", bench_utf8},
+  {"encode", bench_encode},
+  {"tape", bench_tape},
+  {"maps", bench_maps},
+  {"short", bench_short_strings},
+  {"intern", bench_intern},
+  {"lazy", bench_lazy},
+  {"cursor", bench_cursor},
+  {"path", bench_path},
+  {"paths", bench_path_set},
+  {"index", bench_index},
+  {"batch", bench_batch},
+  {"parallel", bench_parallel},
+  {"parallel_encode", bench_parallel_encode},
+  {"parallel_validate", bench_parallel_validate},
+  {"reencode", bench_reencode},
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(Benchmark))
+
+int main(int argc, char *argv[]) {
+  for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+    bool selected = argc == 1;
+    for (int j = 1; j < argc; j++) {
+      selected = selected || strcmp(argv[j], benchmarks[i].name) == 0;
+    }
+
+    if (selected) {
+      printf("%s\n", benchmarks[i].name);
+      benchmarks[i].run();
+    }
+  }
+
+  return 0;
+}
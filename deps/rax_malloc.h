@@ -37,7 +37,12 @@
 
 #ifndef RAX_ALLOC_H
 #define RAX_ALLOC_H
-#define rax_malloc malloc
-#define rax_realloc realloc
-#define rax_free free
+#include <stddef.h>
+/* hsdt routes these through its arena allocator, see src/hsdt.h */
+void *hsdt_malloc(size_t size);
+void *hsdt_realloc(void *ptr, size_t size);
+void hsdt_free(void *ptr);
+#define rax_malloc hsdt_malloc
+#define rax_realloc hsdt_realloc
+#define rax_free hsdt_free
 #endif
@@ -37,6 +37,11 @@
  * the include of your alternate allocator if needed (not needed in order
  * to use the default libc allocator). */
 
-#define s_malloc malloc
-#define s_realloc realloc
-#define s_free free
+#include <stddef.h>
+/* hsdt routes these through its arena allocator, see src/hsdt.h */
+void *hsdt_malloc(size_t size);
+void *hsdt_realloc(void *ptr, size_t size);
+void hsdt_free(void *ptr);
+#define s_malloc hsdt_malloc
+#define s_realloc hsdt_realloc
+#define s_free hsdt_free
@@ -1,4 +1,7 @@
 #include <arpa/inet.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -8,84 +11,397 @@
 #define htonll(x) ((1==htonl(1)) ? (x) : ((uint64_t)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
 #define ntohll(x) ((1==ntohl(1)) ? (x) : ((uint64_t)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
 
-// TODO make everything iterative rather than recursive
-// TODO handle OOM
-// TODO introduce COLLECTION_SIZE_IN_BYTES
+/*
+ * Arena allocation. All memory of HSDT_Value trees (including the internals of
+ * rax and sds) is allocated through `hsdt_malloc` and friends. While
+ * `hsdt_decode_arena` runs, these take memory from its arena, else they defer
+ * to the system allocator.
+ */
 
-bool hsdt_value_eq(HSDT_Value a, HSDT_Value b) {
-  if (a.tag != b.tag) {
+/* Allocations are aligned like malloc would align them. */
+#define ARENA_ALIGN _Alignof(max_align_t)
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+/* Each allocation is preceded by its size, so that it can be reallocated. */
+#define ARENA_HEADER ARENA_ROUND(sizeof(size_t))
+
+#define ARENA_MIN_CHUNK 4096
+#define ARENA_MAX_CHUNK (1 << 20)
+
+struct HSDT_Arena_Chunk {
+  HSDT_Arena_Chunk *prev;
+  size_t size; /* Usable bytes after the (aligned) chunk header */
+};
+
+#define ARENA_CHUNK_HEADER ARENA_ROUND(sizeof(HSDT_Arena_Chunk))
+
+static _Thread_local HSDT_Arena *current_arena = NULL;
+
+void hsdt_arena_init(HSDT_Arena *arena) {
+  arena->chunks = NULL;
+  arena->next = NULL;
+  arena->end = NULL;
+  arena->allocated = 0;
+}
+
+void hsdt_arena_reset(HSDT_Arena *arena) {
+  if (arena->chunks == NULL) {
+    return;
+  }
+
+  /*
+   * Keep the largest chunk around for reuse. That is not necessarily the most
+   * recent one, a chunk for a single large allocation can exceed the size of
+   * all later chunks.
+   */
+  HSDT_Arena_Chunk *keep = arena->chunks;
+  for (HSDT_Arena_Chunk *chunk = keep->prev; chunk != NULL; chunk = chunk->prev) {
+    if (chunk->size > keep->size) {
+      keep = chunk;
+    }
+  }
+
+  HSDT_Arena_Chunk *chunk = arena->chunks;
+  while (chunk != NULL) {
+    HSDT_Arena_Chunk *prev = chunk->prev;
+    if (chunk != keep) {
+      free(chunk);
+    }
+    chunk = prev;
+  }
+
+  keep->prev = NULL;
+  arena->chunks = keep;
+  arena->next = (uint8_t *) keep + ARENA_CHUNK_HEADER;
+  arena->end = arena->next + keep->size;
+  arena->allocated = keep->size;
+}
+
+void hsdt_arena_free(HSDT_Arena *arena) {
+  HSDT_Arena_Chunk *chunk = arena->chunks;
+  while (chunk != NULL) {
+    HSDT_Arena_Chunk *prev = chunk->prev;
+    free(chunk);
+    chunk = prev;
+  }
+  hsdt_arena_init(arena);
+}
+
+static void *arena_alloc(HSDT_Arena *arena, size_t size) {
+  size_t needed = ARENA_HEADER + ARENA_ROUND(size);
+
+  if ((size_t) (arena->end - arena->next) < needed) {
+    /* Chunks grow with the arena, so large messages need few of them. */
+    size_t chunk_size = arena->allocated < ARENA_MIN_CHUNK ? ARENA_MIN_CHUNK : arena->allocated;
+    if (chunk_size > ARENA_MAX_CHUNK) {
+      chunk_size = ARENA_MAX_CHUNK;
+    }
+    if (chunk_size < needed) {
+      chunk_size = needed;
+    }
+
+    HSDT_Arena_Chunk *chunk = malloc(ARENA_CHUNK_HEADER + chunk_size); // XXX OOM
+    chunk->prev = arena->chunks;
+    chunk->size = chunk_size;
+    arena->chunks = chunk;
+    arena->next = (uint8_t *) chunk + ARENA_CHUNK_HEADER;
+    arena->end = arena->next + chunk_size;
+    arena->allocated += chunk_size;
+  }
+
+  uint8_t *mem = arena->next;
+  arena->next += needed;
+  memcpy(mem, &size, sizeof(size_t));
+  return mem + ARENA_HEADER;
+}
+
+void *hsdt_malloc(size_t size) {
+  if (current_arena == NULL) {
+    return malloc(size);
+  } else {
+    return arena_alloc(current_arena, size);
+  }
+}
+
+#ifndef NDEBUG
+/* Return whether `ptr` points into one of the chunks of `arena`. */
+static bool arena_owns(HSDT_Arena *arena, void *ptr) {
+  for (HSDT_Arena_Chunk *chunk = arena->chunks; chunk != NULL; chunk = chunk->prev) {
+    uint8_t *start = (uint8_t *) chunk + ARENA_CHUNK_HEADER;
+    if ((uint8_t *) ptr >= start + ARENA_HEADER && (uint8_t *) ptr < start + chunk->size) {
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+void *hsdt_realloc(void *ptr, size_t size) {
+  if (current_arena == NULL) {
+    return realloc(ptr, size);
+  } else if (ptr == NULL) {
+    return arena_alloc(current_arena, size);
+  } else {
+    /* The size is read from in front of `ptr`, which only arena allocations have. */
+    assert(arena_owns(current_arena, ptr));
+    size_t old_size;
+    memcpy(&old_size, (uint8_t *) ptr - ARENA_HEADER, sizeof(size_t));
+
+    /* The most recent allocation can grow and shrink in place. */
+    if ((uint8_t *) ptr + ARENA_ROUND(old_size) == current_arena->next && (uint8_t *) ptr + ARENA_ROUND(size) <= current_arena->end) {
+      current_arena->next = (uint8_t *) ptr + ARENA_ROUND(size);
+      memcpy((uint8_t *) ptr - ARENA_HEADER, &size, sizeof(size_t));
+      return ptr;
+    }
+
+    void *new_ptr = arena_alloc(current_arena, size);
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    return new_ptr;
+  }
+}
+
+void hsdt_free(void *ptr) {
+  if (current_arena == NULL) {
+    free(ptr);
+  }
+  /* Arena memory is only released all at once. */
+}
+
+HSDT_ERR hsdt_decode_arena(HSDT_Arena *arena, uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed) {
+  HSDT_Arena *prev_arena = current_arena;
+  current_arena = arena;
+  HSDT_ERR err = hsdt_decode(in, in_len, out, consumed);
+  current_arena = prev_arena;
+  return err;
+}
+
+/* The options of all decoders that do not take any. */
+static const HSDT_Dec_Options default_dec_options = {HSDT_MAP_RAX, false, NULL};
+
+/*
+ * String representations. Decoders create strings with `str_init`, which
+ * stores them inline if `opts` enable that and they are short enough.
+ */
+
+/* Initialize `out` as a string of the given logical type (`HSDT_BYTE_STRING` or `HSDT_UTF8_STRING`). */
+static void str_init(HSDT_Value *out, HSDT_TYPE_TAG tag, uint8_t *str, size_t len, const HSDT_Dec_Options *opts) {
+  if (opts->short_strings && len <= HSDT_SHORT_STRING_MAX) {
+    out->tag = tag == HSDT_BYTE_STRING ? HSDT_SHORT_BYTE_STRING : HSDT_SHORT_UTF8_STRING;
+    out->short_byte_string.len = (uint8_t) len;
+    if (len > 0) {
+      memcpy(out->short_byte_string.data, str, len);
+    }
+  } else {
+    out->tag = tag;
+    out->byte_string = sdsnewlen(str, len); // XXX OOM
+  }
+}
+
+uint8_t *hsdt_value_str(HSDT_Value *val, size_t *len) {
+  if (val->tag == HSDT_SHORT_BYTE_STRING || val->tag == HSDT_SHORT_UTF8_STRING) {
+    *len = val->short_byte_string.len;
+    return val->short_byte_string.data;
+  } else {
+    *len = sdslen(val->byte_string);
+    return (uint8_t *) val->byte_string;
+  }
+}
+
+/* Return the type of the logical data model that the tag represents. */
+static HSDT_TYPE_TAG logical_tag(HSDT_TYPE_TAG tag) {
+  switch (tag) {
+    case HSDT_SORTED_MAP:
+      return HSDT_MAP;
+    case HSDT_SHORT_BYTE_STRING:
+      return HSDT_BYTE_STRING;
+    case HSDT_SHORT_UTF8_STRING:
+      return HSDT_UTF8_STRING;
+    default:
+      return tag;
+  }
+}
+
+HSDT_TYPE_TAG hsdt_value_type(HSDT_Value *val) {
+  if (val->tag == HSDT_LAZY) {
+    return val->lazy.enc[0] >> 5 == 4 ? HSDT_ARRAY : HSDT_MAP;
+  } else {
+    return logical_tag(val->tag);
+  }
+}
+
+/*
+ * Iterative traversal of value trees. A `Walk` holds one frame for each
+ * collection whose entries are currently being visited. Frames are allocated
+ * individually and reused, they never move since a raxIterator must stay in
+ * place while in use.
+ */
+typedef struct Walk_Frame {
+  HSDT_Value *val;
+  size_t next; /* The index of the next array element */
+  raxIterator iter; /* Iterates the entries of a map */
+#ifdef COLLECTION_SIZE_IN_BYTES
+  size_t size_slot; /* Where the size of the content goes in `sizes` of the walk */
+  size_t size; /* The size of the entries visited so far */
+#endif
+} Walk_Frame;
+
+typedef struct Walk {
+  Walk_Frame **frames;
+  size_t depth;
+  size_t cap; /* How many frames have been allocated */
+#ifdef COLLECTION_SIZE_IN_BYTES
+  size_t *sizes; /* The content sizes of collections, in the order in which they are visited */
+  size_t sizes_len;
+  size_t sizes_cap;
+  size_t next_size; /* The entry of `sizes` for the next collection header */
+#endif
+} Walk;
+
+static void walk_init(Walk *walk) {
+  walk->frames = NULL;
+  walk->depth = 0;
+  walk->cap = 0;
+#ifdef COLLECTION_SIZE_IN_BYTES
+  walk->sizes = NULL;
+  walk->sizes_len = 0;
+  walk->sizes_cap = 0;
+  walk->next_size = 0;
+#endif
+}
+
+static void walk_free(Walk *walk) {
+  for (size_t i = 0; i < walk->cap; i++) {
+    if (i < walk->depth && walk->frames[i]->val->tag == HSDT_MAP) {
+      raxStop(&walk->frames[i]->iter);
+    }
+    free(walk->frames[i]);
+  }
+  free(walk->frames);
+#ifdef COLLECTION_SIZE_IN_BYTES
+  free(walk->sizes);
+#endif
+  walk_init(walk);
+}
+
+/* Return whether the value is an array or a map, in any representation. */
+static bool is_collection(HSDT_Value *val) {
+  return val->tag == HSDT_ARRAY || val->tag == HSDT_MAP || val->tag == HSDT_SORTED_MAP;
+}
+
+/* Return the number of entries of a collection. */
+static size_t collection_len(HSDT_Value *val) {
+  switch (val->tag) {
+    case HSDT_ARRAY:
+      return val->array.len;
+    case HSDT_MAP:
+      return raxSize(val->map);
+    case HSDT_SORTED_MAP:
+      return val->sorted_map.len;
+    default:
+      return 0;
+  }
+}
+
+/* If `val` is a nonempty collection, start visiting its entries. Return whether it is. */
+static bool walk_enter(Walk *walk, HSDT_Value *val) {
+  if (collection_len(val) == 0) {
     return false;
+  }
+
+  if (walk->depth == walk->cap) {
+    walk->cap = walk->cap == 0 ? 8 : 2 * walk->cap;
+    walk->frames = realloc(walk->frames, walk->cap * sizeof(Walk_Frame *)); // XXX OOM
+    for (size_t i = walk->depth; i < walk->cap; i++) {
+      walk->frames[i] = malloc(sizeof(Walk_Frame)); // XXX OOM
+    }
+  }
+
+  Walk_Frame *frame = walk->frames[walk->depth];
+  frame->val = val;
+  if (val->tag != HSDT_MAP) {
+    frame->next = 0;
   } else {
-    switch (a.tag) {
-      case HSDT_NULL:
-        return true;
-      case HSDT_TRUE:
-        return true;
-      case HSDT_FALSE:
-        return true;
-      case HSDT_BYTE_STRING:
-        return sdscmp(a.byte_string, b.byte_string) == 0;
-      case HSDT_UTF8_STRING:
-        return sdscmp(a.utf8_string, b.utf8_string) == 0;
-      case HSDT_FP:
-        if (isnan(a.fp) && isnan(b.fp)) {
-          return true;
-        } else {
-          return a.fp == b.fp;
-        }
-      case HSDT_ARRAY:
-        if (a.array.len != b.array.len) {
-          return false;
-        } else {
-          for (size_t i = 0; i < a.array.len; i++) {
-            if (!hsdt_value_eq(a.array.elems[i], b.array.elems[i])) { // XXX recursion
-              return false;
-            }
-          }
-          return true;
-        }
-      case HSDT_MAP:
-        if (raxSize(a.map) != raxSize(b.map)) {
-          return false;
-        } else {
-          raxIterator ia;
-          raxIterator ib;
-          raxStart(&ia, a.map);
-          raxStart(&ib, b.map);
-          raxSeek(&ia, "^", (unsigned char*) "", 0); // XXX OOM
-          raxSeek(&ib, "^", (unsigned char*) "", 0); // XXX OOM
-
-          while (raxNext(&ia)) { // XXX OOM
-            raxNext(&ib); // XXX OOM
-
-            if (ia.key_len != ib.key_len) {
-              raxStop(&ia);
-              raxStop(&ib);
-              return false;
-            } else if (memcmp(ia.key, ib.key, ia.key_len) != 0) {
-              raxStop(&ia);
-              raxStop(&ib);
-              return false;
-            } else if (!hsdt_value_eq(*(HSDT_Value *) ia.data, *(HSDT_Value *) ib.data)) { // XXX recursion
-              raxStop(&ia);
-              raxStop(&ib);
-              return false;
-            }
-          }
+    raxStart(&frame->iter, val->map);
+    raxSeek(&frame->iter, "^", (unsigned char*) "", 0); // XXX OOM
+  }
+  walk->depth += 1;
+  return true;
+}
 
-          raxStop(&ia);
-          raxStop(&ib);
-          return true;
-        }
-      default:
-        return false; /* unreachable if tags are valid */
+/*
+ * Get the next entry of the innermost collection, `key` is set for map entries
+ * and to `NULL` for array elements. If all entries have been visited, leave
+ * the collection and return false instead.
+ */
+static bool walk_next(Walk *walk, uint8_t **key, size_t *key_len, HSDT_Value **entry) {
+  Walk_Frame *frame = walk->frames[walk->depth - 1];
+
+  if (frame->val->tag == HSDT_ARRAY) {
+    if (frame->next < frame->val->array.len) {
+      *key = NULL;
+      *key_len = 0;
+      *entry = frame->val->array.elems + frame->next;
+      frame->next += 1;
+      return true;
+    }
+  } else if (frame->val->tag == HSDT_SORTED_MAP) {
+    if (frame->next < frame->val->sorted_map.len) {
+      HSDT_Map_Entry *map_entry = frame->val->sorted_map.entries + frame->next;
+      *key = map_entry->key->bytes;
+      *key_len = map_entry->key->len;
+      *entry = &map_entry->val;
+      frame->next += 1;
+      return true;
     }
+  } else {
+    if (raxNext(&frame->iter)) { // XXX OOM
+      *key = frame->iter.key;
+      *key_len = frame->iter.key_len;
+      *entry = frame->iter.data;
+      return true;
+    }
+    raxStop(&frame->iter);
+  }
+
+  walk->depth -= 1;
+  return false;
+}
+
+// TODO make everything iterative rather than recursive
+// TODO handle OOM
+
+/*
+ * The values that still need to be freed. Maps are torn down with
+ * `raxFreeWithCallback`, whose callback takes no context argument, so it finds
+ * the list through this variable.
+ */
+typedef struct Free_List {
+  HSDT_Value *vals;
+  size_t len;
+  size_t cap;
+} Free_List;
+
+static _Thread_local Free_List *current_free_list = NULL;
+
+static void free_list_push(Free_List *list, HSDT_Value val) {
+  if (list->len == list->cap) {
+    list->cap = list->cap == 0 ? 16 : 2 * list->cap;
+    list->vals = realloc(list->vals, list->cap * sizeof(HSDT_Value)); // XXX OOM
   }
+  list->vals[list->len] = val;
+  list->len += 1;
 }
 
-void hsdt_value_free(HSDT_Value val) {
-  raxIterator iter;
+static void free_map_entry(void *data) {
+  HSDT_Value *entry = data;
+  if (is_collection(entry)) {
+    free_list_push(current_free_list, *entry);
+  } else {
+    hsdt_value_free(*entry);
+  }
+  hsdt_free(entry);
+}
 
+void hsdt_value_free(HSDT_Value val) {
   switch (val.tag) {
     case HSDT_NULL:
       return;
@@ -101,29 +417,60 @@ void hsdt_value_free(HSDT_Value val) {
       return;
     case HSDT_FP:
       return;
-    case HSDT_ARRAY:
-      for (size_t i = 0; i < val.array.len; i++) {
-        hsdt_value_free(val.array.elems[i]); // XXX recursion
-      }
-      free(val.array.elems);
+    case HSDT_SHORT_BYTE_STRING:
       return;
-    case HSDT_MAP:
-      raxStart(&iter, val.map);
-      raxSeek(&iter, "^", (unsigned char*) "", 0); // XXX OOM
+    case HSDT_SHORT_UTF8_STRING:
+      return;
+    case HSDT_LAZY:
+      return;
+    default:
+      break;
+  }
 
-      while (raxNext(&iter)) { // XXX OOM
-        hsdt_value_free(*(HSDT_Value *) iter.data); // XXX recursion
-        free(iter.data);
-      }
+  /*
+   * Collections: free strings right away, and remember nested collections
+   * instead of recursing into them.
+   */
+  Free_List list = {NULL, 0, 0};
+  current_free_list = &list;
 
-      raxStop(&iter);
-      raxFree(val.map);
-      return;
+  free_list_push(&list, val);
+  while (list.len > 0) {
+    list.len -= 1;
+    val = list.vals[list.len];
+
+    if (val.tag == HSDT_ARRAY) {
+      for (size_t i = 0; i < val.array.len; i++) {
+        if (is_collection(val.array.elems + i)) {
+          free_list_push(&list, val.array.elems[i]);
+        } else {
+          hsdt_value_free(val.array.elems[i]);
+        }
+      }
+      hsdt_free(val.array.elems);
+    } else if (val.tag == HSDT_SORTED_MAP) {
+      for (size_t i = 0; i < val.sorted_map.len; i++) {
+        HSDT_Map_Entry *entry = val.sorted_map.entries + i;
+        if (!entry->key->interned) {
+          hsdt_free(entry->key);
+        }
+        if (is_collection(&entry->val)) {
+          free_list_push(&list, entry->val);
+        } else {
+          hsdt_value_free(entry->val);
+        }
+      }
+      hsdt_free(val.sorted_map.entries);
+    } else {
+      raxFreeWithCallback(val.map, free_map_entry);
+    }
   }
+
+  current_free_list = NULL;
+  free(list.vals);
 }
 
 #ifdef COLLECTION_SIZE_IN_BYTES
-// TODO memoize results?
 size_t hsdt_decode_len(uint8_t *in, size_t in_len) {
   if (in_len == 0) {
     return SIZE_MAX;
@@ -250,98 +597,428 @@ static uint32_t validate_utf8(uint32_t *state, uint8_t *str, size_t len) {
 }
 /* End utf8 checking code */
 
-/* Return how many bytes are needed to encode the length of a collection of the given size. */
-/* Works independent of whether `size` is in bytes or in entries. */
-static size_t len_enc(size_t size) {
-  if (size <= 23) {
-    return 0;
-  } else if (size <= 255) {
-    return 1;
-  } else if (size <= 65535) {
-    return 2;
-  } else if (size <= 4294967295) {
-    return 4;
-  } else {
-    return 8;
-  }
-}
+/*
+ * Vectorized utf8 validation, following "Validating UTF-8 In Less Than One
+ * Instruction Per Byte" by John Keiser and Daniel Lemire. Each byte is
+ * classified by three table lookups (on the high and low nibble of the
+ * previous byte and the high nibble of the byte itself), whose conjunction
+ * yields all errors involving two consecutive bytes. The remaining errors
+ * (missing or excess continuation bytes of three and four byte sequences)
+ * are found by comparing against the bytes two and three positions earlier.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define HSDT_HAVE_SIMD_UTF8
+#include <immintrin.h>
+
+#define U8_TOO_SHORT (1 << 0)
+#define U8_TOO_LONG (1 << 1)
+#define U8_OVERLONG_3 (1 << 2)
+#define U8_TOO_LARGE (1 << 3)
+#define U8_SURROGATE (1 << 4)
+#define U8_OVERLONG_2 (1 << 5)
+#define U8_TOO_LARGE_1000 (1 << 6)
+#define U8_OVERLONG_4 (1 << 6)
+#define U8_TWO_CONTS (1 << 7)
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+/* Indexed by the high nibble of the previous byte */
+#define U8_BYTE_1_HIGH \
+  U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, \
+  U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, \
+  U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, \
+  U8_TOO_SHORT | U8_OVERLONG_2, \
+  U8_TOO_SHORT, \
+  U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE, \
+  U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4
+
+/* Indexed by the low nibble of the previous byte */
+#define U8_BYTE_1_LOW \
+  U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4, \
+  U8_CARRY | U8_OVERLONG_2, \
+  U8_CARRY, \
+  U8_CARRY, \
+  U8_CARRY | U8_TOO_LARGE, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, \
+  U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000
+
+/* Indexed by the high nibble of the current byte */
+#define U8_BYTE_2_HIGH \
+  U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, \
+  U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, \
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4, \
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE, \
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE, \
+  U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE, \
+  U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT
 
-#ifndef COLLECTION_SIZE_IN_BYTES
 /*
- * With COLLECTION_SIZE_IN_BYTES, this would need to do memoization of entry
- * sizes to keep linear running time, else it would be quadratic in the nesting
- * depth.
+ * Bytes greater than these at the end of a block start a sequence that is
+ * continued in the next block.
  */
-size_t hsdt_encoding_len(HSDT_Value val) {
-  size_t size; /* The size of a collection, counted in contained items. */
-  size_t inner_size; /* Summend size in bytes of the encodings of all contained items. */
+#define U8_INCOMPLETE \
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, \
+  0xF0 - 1, 0xE0 - 1, 0xC0 - 1
 
-  raxIterator iter;
+/* The tables, repeated for both 128 bit lanes of AVX2 registers */
+static const uint8_t u8_byte_1_high[32] = {U8_BYTE_1_HIGH, U8_BYTE_1_HIGH};
+static const uint8_t u8_byte_1_low[32] = {U8_BYTE_1_LOW, U8_BYTE_1_LOW};
+static const uint8_t u8_byte_2_high[32] = {U8_BYTE_2_HIGH, U8_BYTE_2_HIGH};
+static const uint8_t u8_incomplete[32] = {
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  U8_INCOMPLETE
+};
 
-  switch (val.tag) {
-    case HSDT_NULL:
-      return 1;
-    case HSDT_TRUE:
-      return 1;
-    case HSDT_FALSE:
-      return 1;
-    case HSDT_BYTE_STRING:
-      size = sdslen(val.byte_string);
-      inner_size = size;
-      return 1 + len_enc(size) + inner_size;
-    case HSDT_UTF8_STRING:
-      size = sdslen(val.utf8_string);
-      inner_size = size;
-      return 1 + len_enc(size) + inner_size;
-    case HSDT_FP:
-      return 1 + 8;
-    case HSDT_ARRAY:
-      size = val.array.len;
+__attribute__((target("sse4.2")))
+static bool validate_utf8_sse42(uint8_t *str, size_t len) {
+  const __m128i byte_1_high_table = _mm_loadu_si128((const __m128i *) u8_byte_1_high);
+  const __m128i byte_1_low_table = _mm_loadu_si128((const __m128i *) u8_byte_1_low);
+  const __m128i byte_2_high_table = _mm_loadu_si128((const __m128i *) u8_byte_2_high);
+  const __m128i incomplete_max = _mm_loadu_si128((const __m128i *) (u8_incomplete + 16));
+  const __m128i nibble = _mm_set1_epi8(0x0F);
 
-      inner_size = 0;
-      for (size_t i = 0; i < val.array.len; i++) {
-        inner_size += hsdt_encoding_len(val.array.elems[i]); // XXX recursion
-      }
+  __m128i error = _mm_setzero_si128();
+  __m128i prev_input = _mm_setzero_si128();
+  __m128i prev_incomplete = _mm_setzero_si128();
+  uint8_t tail[16];
 
-      return 1 + len_enc(size) + inner_size;
-    case HSDT_MAP:
-      size = raxSize(val.map);
+  for (size_t i = 0; i < len; i += 16) {
+    __m128i input;
+    if (len - i >= 16) {
+      input = _mm_loadu_si128((const __m128i *) (str + i));
+    } else {
+      /* Pad the last block with zeros, which are ascii and thus complete it. */
+      memset(tail, 0, 16);
+      memcpy(tail, str + i, len - i);
+      input = _mm_loadu_si128((const __m128i *) tail);
+    }
 
-      inner_size = 0;
-      raxStart(&iter, val.map);
-      raxSeek(&iter, "^", (unsigned char*) "", 0); // XXX OOM
+    if (_mm_movemask_epi8(input) == 0) {
+      /* All ascii, only a sequence from the previous block can be broken. */
+      error = _mm_or_si128(error, prev_incomplete);
+    } else {
+      __m128i prev1 = _mm_alignr_epi8(input, prev_input, 16 - 1);
+      __m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+      __m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, nibble));
+      __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+      __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
 
-      while (raxNext(&iter)) { // OOM
-        inner_size += len_enc(iter.key_len) + 1;
-        inner_size += iter.key_len;
-        inner_size += hsdt_encoding_len(*(HSDT_Value *) iter.data); // XXX recursion
-      }
+      __m128i prev2 = _mm_alignr_epi8(input, prev_input, 16 - 2);
+      __m128i prev3 = _mm_alignr_epi8(input, prev_input, 16 - 3);
+      __m128i is_third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8((char) (0xE0 - 0x80)));
+      __m128i is_fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8((char) (0xF0 - 0x80)));
+      __m128i must23_80 = _mm_and_si128(_mm_or_si128(is_third_byte, is_fourth_byte), _mm_set1_epi8((char) 0x80));
 
-      raxStop(&iter);
-      return 1 + len_enc(size) + inner_size;
-    default:
-      return 0; /* unreachable if tags are valid */
+      error = _mm_or_si128(error, _mm_xor_si128(must23_80, special_cases));
+      prev_incomplete = _mm_subs_epu8(input, incomplete_max);
+    }
+    prev_input = input;
+  }
+
+  error = _mm_or_si128(error, prev_incomplete);
+  return _mm_testz_si128(error, error);
+}
+
+__attribute__((target("avx2")))
+static bool validate_utf8_avx2(uint8_t *str, size_t len) {
+  const __m256i byte_1_high_table = _mm256_loadu_si256((const __m256i *) u8_byte_1_high);
+  const __m256i byte_1_low_table = _mm256_loadu_si256((const __m256i *) u8_byte_1_low);
+  const __m256i byte_2_high_table = _mm256_loadu_si256((const __m256i *) u8_byte_2_high);
+  const __m256i incomplete_max = _mm256_loadu_si256((const __m256i *) u8_incomplete);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+  __m256i error = _mm256_setzero_si256();
+  __m256i prev_input = _mm256_setzero_si256();
+  __m256i prev_incomplete = _mm256_setzero_si256();
+  uint8_t tail[32];
+
+  for (size_t i = 0; i < len; i += 32) {
+    __m256i input;
+    if (len - i >= 32) {
+      input = _mm256_loadu_si256((const __m256i *) (str + i));
+    } else {
+      /* Pad the last block with zeros, which are ascii and thus complete it. */
+      memset(tail, 0, 32);
+      memcpy(tail, str + i, len - i);
+      input = _mm256_loadu_si256((const __m256i *) tail);
+    }
+
+    if (_mm256_movemask_epi8(input) == 0) {
+      /* All ascii, only a sequence from the previous block can be broken. */
+      error = _mm256_or_si256(error, prev_incomplete);
+    } else {
+      /* The upper half of `prev_input` followed by the lower half of `input` */
+      __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+      __m256i prev1 = _mm256_alignr_epi8(input, shifted, 16 - 1);
+      __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+      __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, nibble));
+      __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+      __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+      __m256i prev2 = _mm256_alignr_epi8(input, shifted, 16 - 2);
+      __m256i prev3 = _mm256_alignr_epi8(input, shifted, 16 - 3);
+      __m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char) (0xE0 - 0x80)));
+      __m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char) (0xF0 - 0x80)));
+      __m256i must23_80 = _mm256_and_si256(_mm256_or_si256(is_third_byte, is_fourth_byte), _mm256_set1_epi8((char) 0x80));
+
+      error = _mm256_or_si256(error, _mm256_xor_si256(must23_80, special_cases));
+      prev_incomplete = _mm256_subs_epu8(input, incomplete_max);
+    }
+    prev_input = input;
   }
+
+  error = _mm256_or_si256(error, prev_incomplete);
+  return _mm256_testz_si256(error, error);
 }
 #endif
 
-/* Encode `in` into the buffer `buf`, which must be large enough. Return how many bytes were written. */
-static size_t do_encode(HSDT_Value in, uint8_t *buf);
+static bool validate_utf8_scalar(uint8_t *str, size_t len) {
+  uint32_t state = UTF8_ACCEPT;
+  return validate_utf8(&state, str, len) == UTF8_ACCEPT;
+}
+
+/* Strings shorter than this are not worth setting up vector registers for. */
+#define SIMD_UTF8_MIN_LEN 32
 
-uint8_t *hsdt_encode(HSDT_Value in, size_t *out_len) {
-  size_t enc_len = hsdt_encoding_len(in);
-  *out_len = enc_len;
-  uint8_t *enc = malloc(enc_len); // XXX OOM
+static HSDT_UTF8_IMPL utf8_impl = HSDT_UTF8_AUTO;
+static bool (*utf8_long)(uint8_t *str, size_t len) = validate_utf8_scalar;
+static pthread_once_t utf8_once = PTHREAD_ONCE_INIT;
+
+/* Make `impl` the utf8 validation in use, if the CPU supports it. */
+static bool select_utf8_impl(HSDT_UTF8_IMPL impl) {
+  switch (impl) {
+    case HSDT_UTF8_AUTO:
+#ifdef HSDT_HAVE_SIMD_UTF8
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2")) {
+        return select_utf8_impl(HSDT_UTF8_AVX2);
+      } else if (__builtin_cpu_supports("sse4.2")) {
+        return select_utf8_impl(HSDT_UTF8_SSE42);
+      }
+#endif
+      return select_utf8_impl(HSDT_UTF8_SCALAR);
+    case HSDT_UTF8_SCALAR:
+      utf8_long = validate_utf8_scalar;
+      break;
+#ifdef HSDT_HAVE_SIMD_UTF8
+    case HSDT_UTF8_SSE42:
+      __builtin_cpu_init();
+      if (!__builtin_cpu_supports("sse4.2")) {
+        return false;
+      }
+      utf8_long = validate_utf8_sse42;
+      break;
+    case HSDT_UTF8_AVX2:
+      __builtin_cpu_init();
+      if (!__builtin_cpu_supports("avx2")) {
+        return false;
+      }
+      utf8_long = validate_utf8_avx2;
+      break;
+#endif
+    default:
+      return false;
+  }
 
-  do_encode(in, enc);
-  return enc;
+  utf8_impl = impl;
+  return true;
 }
 
-static size_t encode_len(size_t size, uint8_t major, uint8_t *buf) {
-  if (size <= 23) {
-    buf[0] = major | size;
-    return 1;
-  } else if (size <= 255) {
+/* Pick the fastest utf8 validation the CPU supports, run exactly once per process. */
+static void utf8_init(void) {
+  select_utf8_impl(HSDT_UTF8_AUTO);
+}
+
+bool hsdt_set_utf8_impl(HSDT_UTF8_IMPL impl) {
+  /* Detect first, so that the detection can not overwrite the choice later on. */
+  pthread_once(&utf8_once, utf8_init);
+  return select_utf8_impl(impl);
+}
+
+HSDT_UTF8_IMPL hsdt_get_utf8_impl(void) {
+  pthread_once(&utf8_once, utf8_init);
+  return utf8_impl;
+}
+
+/* Return whether the given string is valid utf8. */
+static bool utf8_valid(uint8_t *str, size_t len) {
+  size_t i = 0;
+
+  /* Skip ascii eight bytes at a time. */
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, str + i, 8);
+    if ((word & 0x8080808080808080) != 0) {
+      break;
+    }
+  }
+  while (i < len && str[i] < 0x80) {
+    i += 1;
+  }
+
+  /* All bytes before `i` are ascii, so a sequence can not start before it. */
+  if (i == len) {
+    return true;
+  } else if (len - i < SIMD_UTF8_MIN_LEN) {
+    return validate_utf8_scalar(str + i, len - i);
+  } else {
+    pthread_once(&utf8_once, utf8_init);
+    return utf8_long(str + i, len - i);
+  }
+}
+
+/* Return how many bytes are needed to encode the length of a collection of the given size. */
+/* Works independent of whether `size` is in bytes or in entries. */
+static size_t len_enc(size_t size) {
+  if (size <= 23) {
+    return 0;
+  } else if (size <= 255) {
+    return 1;
+  } else if (size <= 65535) {
+    return 2;
+  } else if (size <= 4294967295) {
+    return 4;
+  } else {
+    return 8;
+  }
+}
+
+/* Return the encoded size of a value that is not a collection. */
+static size_t scalar_len(HSDT_Value *val) {
+  switch (val->tag) {
+    case HSDT_BYTE_STRING:
+      return 1 + len_enc(sdslen(val->byte_string)) + sdslen(val->byte_string);
+    case HSDT_UTF8_STRING:
+      return 1 + len_enc(sdslen(val->utf8_string)) + sdslen(val->utf8_string);
+    case HSDT_SHORT_BYTE_STRING:
+      return 1 + len_enc(val->short_byte_string.len) + val->short_byte_string.len;
+    case HSDT_SHORT_UTF8_STRING:
+      return 1 + len_enc(val->short_utf8_string.len) + val->short_utf8_string.len;
+    case HSDT_LAZY:
+      return val->lazy.len;
+    case HSDT_FP:
+      return 1 + 8;
+    default:
+      return 1;
+  }
+}
+
+#ifdef COLLECTION_SIZE_IN_BYTES
+/*
+ * Start computing the size of `val`. A collection gets the next slot in
+ * `walk->sizes`, and its entries are visited if it has any. Returns the
+ * encoded size of `val`, or 0 if that is only known once its entries are done.
+ */
+static size_t size_enter(Walk *walk, HSDT_Value *val) {
+  if (!is_collection(val)) {
+    return scalar_len(val);
+  }
+
+  if (walk->sizes_len == walk->sizes_cap) {
+    walk->sizes_cap = walk->sizes_cap == 0 ? 16 : 2 * walk->sizes_cap;
+    walk->sizes = realloc(walk->sizes, walk->sizes_cap * sizeof(size_t)); // XXX OOM
+  }
+  size_t slot = walk->sizes_len;
+  walk->sizes[slot] = 0;
+  walk->sizes_len += 1;
+
+  if (!walk_enter(walk, val)) {
+    return 1;
+  }
+  Walk_Frame *frame = walk->frames[walk->depth - 1];
+  frame->size_slot = slot;
+  frame->size = 0;
+  return 0;
+}
+
+/*
+ * Compute the encoded size of `val`, and memoize the content size of every
+ * collection inside of it in `walk->sizes`, in the order in which a traversal
+ * visits them. Each collection is sized once when its last entry is done, so
+ * this takes linear time regardless of the nesting depth.
+ */
+static size_t walk_sizes(Walk *walk, HSDT_Value *val) {
+  walk->sizes_len = 0;
+  walk->next_size = 0;
+  size_t size = size_enter(walk, val);
+
+  while (walk->depth > 0) {
+    Walk_Frame *top = walk->frames[walk->depth - 1];
+    uint8_t *key;
+    size_t key_len;
+    HSDT_Value *entry;
+
+    if (walk_next(walk, &key, &key_len, &entry)) {
+      if (key != NULL) {
+        top->size += 1 + len_enc(key_len) + key_len;
+      }
+      top->size += size_enter(walk, entry);
+    } else {
+      /* `top` has been left, so its size is complete. */
+      size_t len = 1 + len_enc(top->size) + top->size;
+      walk->sizes[top->size_slot] = top->size;
+      if (walk->depth > 0) {
+        walk->frames[walk->depth - 1]->size += len;
+      } else {
+        size = len;
+      }
+    }
+  }
+
+  return size;
+}
+
+size_t hsdt_encoding_len(HSDT_Value val) {
+  Walk walk;
+  walk_init(&walk);
+  size_t len = walk_sizes(&walk, &val);
+  walk_free(&walk);
+  return len;
+}
+#else
+/* The header of a collection only holds its entry count, so every item contributes a size of its own. */
+static size_t item_len(HSDT_Value *val) {
+  return is_collection(val) ? 1 + len_enc(collection_len(val)) : scalar_len(val);
+}
+
+size_t hsdt_encoding_len(HSDT_Value val) {
+  Walk walk;
+  walk_init(&walk);
+  size_t len = item_len(&val);
+  walk_enter(&walk, &val);
+
+  while (walk.depth > 0) {
+    uint8_t *key;
+    size_t key_len;
+    HSDT_Value *entry;
+
+    if (walk_next(&walk, &key, &key_len, &entry)) {
+      if (key != NULL) {
+        len += 1 + len_enc(key_len) + key_len;
+      }
+      len += item_len(entry);
+      walk_enter(&walk, entry);
+    }
+  }
+
+  walk_free(&walk);
+  return len;
+}
+#endif
+
+static size_t encode_len(size_t size, uint8_t major, uint8_t *buf) {
+  if (size <= 23) {
+    buf[0] = major | size;
+    return 1;
+  } else if (size <= 255) {
     buf[0] = major | 24;
     buf[1] = (uint8_t) size;
     return 2;
@@ -374,91 +1051,224 @@ static size_t encode_len(size_t size, uint8_t major, uint8_t *buf) {
   }
 }
 
-static size_t do_encode(HSDT_Value val, uint8_t *buf) {
-  size_t col_len;
-  size_t len_len;
-  size_t total_written;
-  raxIterator iter;
-  switch (val.tag) {
+/* Where a Writer puts the bytes it does not have room for. */
+typedef enum {
+  WRITER_GROW, /* Grow the buffer. */
+  WRITER_FIXED, /* Drop them, but keep counting. */
+  WRITER_FLUSH /* Hand the full buffer to a callback, then start over. */
+} Writer_Mode;
+
+/* An output buffer for the encoder. */
+typedef struct Writer {
+  uint8_t *buf;
+  size_t len; /* Number of bytes written, may exceed `cap` in WRITER_FIXED mode. */
+  size_t cap;
+  Writer_Mode mode;
+  HSDT_Write write;
+  void *ctx;
+  bool aborted;
+} Writer;
+
+/* Slow path of writer_push, for when `data` does not fit into the buffer. */
+static void writer_overflow(Writer *w, const uint8_t *data, size_t len) {
+  size_t fit;
+  switch (w->mode) {
+    case WRITER_GROW:
+      w->cap = 2 * w->cap < w->len + len ? w->len + len : 2 * w->cap;
+      w->buf = realloc(w->buf, w->cap); // XXX OOM
+      memcpy(w->buf + w->len, data, len);
+      w->len += len;
+      return;
+    case WRITER_FIXED:
+      /* The buffer is too small anyways, no need to write anything anymore. */
+      w->len += len;
+      return;
+    case WRITER_FLUSH:
+      while (!w->aborted && w->len + len > w->cap) {
+        fit = w->cap - w->len;
+        memcpy(w->buf + w->len, data, fit);
+        data += fit;
+        len -= fit;
+        w->aborted = !w->write(w->ctx, w->buf, w->cap);
+        w->len = 0;
+      }
+      if (!w->aborted) {
+        memcpy(w->buf, data, len);
+        w->len = len;
+      }
+      return;
+  }
+}
+
+static void writer_push(Writer *w, const void *data, size_t len) {
+  if (w->len <= w->cap && w->cap - w->len >= len) {
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+  } else {
+    writer_overflow(w, data, len);
+  }
+}
+
+static void writer_push_header(Writer *w, size_t size, uint8_t major) {
+  uint8_t header[9];
+  writer_push(w, header, encode_len(size, major, header));
+}
+
+/*
+ * Return the length that goes into the header of the collection `val`: the
+ * number of its entries, or with COLLECTION_SIZE_IN_BYTES the size of its
+ * content, as memoized by `walk_sizes`.
+ */
+static size_t collection_header(Walk *walk, HSDT_Value *val) {
+#ifdef COLLECTION_SIZE_IN_BYTES
+  (void) val;
+  walk->next_size += 1;
+  return walk->sizes[walk->next_size - 1];
+#else
+  (void) walk;
+  return collection_len(val);
+#endif
+}
+
+/*
+ * Write the encoding of a scalar, or the header of a collection. Collection
+ * headers contain the number of entries, or with COLLECTION_SIZE_IN_BYTES
+ * their memoized size, so they can be written before the entries themselves.
+ */
+static void encode_item(Writer *w, Walk *walk, HSDT_Value *val) {
+  uint8_t buf[9];
+  switch (val->tag) {
     case HSDT_NULL:
-      buf[0] = 0xF6;
-      return 1;
+      writer_push(w, "\xF6", 1);
+      return;
     case HSDT_TRUE:
-      buf[0] = 0xF5;
-      return 1;
+      writer_push(w, "\xF5", 1);
+      return;
     case HSDT_FALSE:
-      buf[0] = 0xF4;
-      return 1;
+      writer_push(w, "\xF4", 1);
+      return;
     case HSDT_BYTE_STRING:
-      col_len = sdslen(val.byte_string);
-      len_len = encode_len(col_len, 0x40, buf);
-      memcpy(buf + len_len, val.byte_string, col_len);
-      return len_len + col_len;
+      writer_push_header(w, sdslen(val->byte_string), 0x40);
+      writer_push(w, val->byte_string, sdslen(val->byte_string));
+      return;
     case HSDT_UTF8_STRING:
-      col_len = sdslen(val.utf8_string);
-      len_len = encode_len(col_len, 0x60, buf);
-      memcpy(buf + len_len, val.utf8_string, col_len);
-      return len_len + col_len;
+      writer_push_header(w, sdslen(val->utf8_string), 0x60);
+      writer_push(w, val->utf8_string, sdslen(val->utf8_string));
+      return;
+    case HSDT_SHORT_BYTE_STRING:
+      writer_push_header(w, val->short_byte_string.len, 0x40);
+      writer_push(w, val->short_byte_string.data, val->short_byte_string.len);
+      return;
+    case HSDT_SHORT_UTF8_STRING:
+      writer_push_header(w, val->short_utf8_string.len, 0x60);
+      writer_push(w, val->short_utf8_string.data, val->short_utf8_string.len);
+      return;
+    case HSDT_LAZY:
+      writer_push(w, val->lazy.enc, val->lazy.len);
+      return;
     case HSDT_FP:
       buf[0] = 0xfb;
-      if (isnan(val.fp)) {
-        buf[1] = 0x7f;
-        buf[2] = 0xf8;
-        buf[3] = 0x00;
-        buf[4] = 0x00;
-        buf[5] = 0x00;
-        buf[6] = 0x00;
-        buf[7] = 0x00;
-        buf[8] = 0x00;
-        return 9;
+      if (isnan(val->fp)) {
+        memcpy(buf + 1, "\x7f\xf8\x00\x00\x00\x00\x00\x00", 8);
       } else {
         DoubleAsInt convert;
-        convert.d = val.fp;
+        convert.d = val->fp;
         convert.i = htonll(convert.i);
-
-        for (size_t i = 0; i < 8; i++) {
-          buf[1 + i] = ((uint8_t *)&convert.i)[i];
-        }
-        return 9;
+        memcpy(buf + 1, &convert.i, 8);
       }
+      writer_push(w, buf, 9);
+      return;
     case HSDT_ARRAY:
-      col_len = val.array.len;
-      len_len = encode_len(col_len, 0x80, buf);
-      total_written = len_len;
-
-      for (size_t i = 0; i < col_len; i++) {
-        total_written += do_encode(val.array.elems[i], buf + total_written); // XXX recursion
-      }
-
-      return total_written;
+      writer_push_header(w, collection_header(walk, val), 0x80);
+      return;
     case HSDT_MAP:
-      col_len = raxSize(val.map);
-      len_len = encode_len(col_len, 0xA0, buf);
-      size_t total_written = len_len;
-
-      raxStart(&iter, val.map);
-      raxSeek(&iter, "^", (unsigned char*) "", 0); // XXX OOM
-      while (raxNext(&iter)) { // XXX OOM
-        /* handle key */
-        total_written += encode_len(iter.key_len, 0x60, buf + total_written);
-        memcpy(buf + total_written, iter.key, iter.key_len);
-        total_written += iter.key_len;
-        /* handle value */
-        total_written += do_encode(*(HSDT_Value *) iter.data, buf + total_written); // XXX recursion
-      }
-
-      raxStop(&iter);
-      return total_written;
+    case HSDT_SORTED_MAP:
+      writer_push_header(w, collection_header(walk, val), 0xA0);
+      return;
     default:
-      return 0; /* unreachable if tags are valid */
+      return; /* unreachable if tags are valid */
+  }
+}
+
+/*
+ * Append the encoding of `val` to `w`, in a single traversal of the value that
+ * uses `walk`, which must not be visiting anything. Unless the writer aborts,
+ * it is ready to be used again afterwards.
+ */
+static void encode_walk(Writer *w, Walk *walk, HSDT_Value *val) {
+#ifdef COLLECTION_SIZE_IN_BYTES
+  walk_sizes(walk, val);
+#endif
+  encode_item(w, walk, val);
+  walk_enter(walk, val);
+
+  while (walk->depth > 0 && !w->aborted) {
+    uint8_t *key;
+    size_t key_len;
+    HSDT_Value *entry;
+
+    if (walk_next(walk, &key, &key_len, &entry)) {
+      if (key != NULL) {
+        writer_push_header(w, key_len, 0x60);
+        writer_push(w, key, key_len);
+      }
+      encode_item(w, walk, entry);
+      walk_enter(walk, entry);
+    }
   }
 }
 
-static HSDT_ERR do_decode(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed);
+/* Append the encoding of `val` to `w`. */
+static void encode_value(Writer *w, HSDT_Value *val) {
+  Walk walk;
+  walk_init(&walk);
+  encode_walk(w, &walk, val);
+  walk_free(&walk);
+}
 
-HSDT_ERR hsdt_decode(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed) {
-  *consumed = 0;
-  return do_decode(in, in_len, out, consumed);
+/* Initial output buffer size, the buffer doubles whenever it is full. */
+#define ENCODE_INITIAL_CAP 256
+
+static void writer_init(Writer *w, uint8_t *buf, size_t cap, Writer_Mode mode) {
+  w->buf = buf;
+  w->len = 0;
+  w->cap = cap;
+  w->mode = mode;
+  w->write = NULL;
+  w->ctx = NULL;
+  w->aborted = false;
+}
+
+uint8_t *hsdt_encode(HSDT_Value in, size_t *out_len) {
+  Writer w;
+  writer_init(&w, malloc(ENCODE_INITIAL_CAP), ENCODE_INITIAL_CAP, WRITER_GROW); // XXX OOM
+
+  encode_value(&w, &in);
+
+  *out_len = w.len;
+  /* Give back the unused space, this does not copy with common allocators. */
+  return w.len == 0 ? w.buf : realloc(w.buf, w.len);
+}
+
+size_t hsdt_encode_into(HSDT_Value in, uint8_t *out, size_t out_cap) {
+  Writer w;
+  writer_init(&w, out, out_cap, WRITER_FIXED);
+
+  encode_value(&w, &in);
+  return w.len;
+}
+
+bool hsdt_encode_stream(HSDT_Value in, uint8_t *chunk, size_t chunk_len, HSDT_Write write, void *ctx) {
+  Writer w;
+  writer_init(&w, chunk, chunk_len, WRITER_FLUSH);
+  w.write = write;
+  w.ctx = ctx;
+
+  encode_value(&w, &in);
+  if (!w.aborted && w.len > 0) {
+    w.aborted = !write(ctx, chunk, w.len);
+  }
+  return !w.aborted;
 }
 
 /*
@@ -540,216 +1350,3343 @@ static HSDT_ERR tag_and_val(uint8_t *in, size_t in_len, size_t *consumed, uint8_
 
 /* Return `true` iff if the first string is lexicogrpahically strictly greater than the second string */
 static bool is_lexicographically_greater(uint8_t *s1, size_t len1, uint8_t *s2, size_t len2) {
-  if (len1 > 0 && len2 > 0) {
-    if (s1[0] < s2[0]) {
-      return false;
-    } else if (s1[0] > s2[0]) {
-      return true;
-    } else {
-      return is_lexicographically_greater(s1 + 1, len1 - 1, s2 + 1, len2 - 1); // XXX recursion
+  size_t min_len = len1 < len2 ? len1 : len2;
+  if (min_len > 0) {
+    int cmp = memcmp(s1, s2, min_len);
+    if (cmp != 0) {
+      return cmp > 0;
     }
-  } else {
-    return len1 > 0;
   }
+  return len1 > len2;
 }
 
-static HSDT_ERR do_decode(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed) {
-  if (in_len == 0) {
+/*
+ * A single item as read from an encoded value: either a complete scalar, or
+ * the header of a collection.
+ */
+typedef struct Item {
+  HSDT_TYPE_TAG tag;
+  double fp;
+  uint8_t *str; /* The content of a string, points into the input */
+  uint64_t len; /* The length of a string, or the number of entries of a collection (also with COLLECTION_SIZE_IN_BYTES) */
+} Item;
+
+#ifdef COLLECTION_SIZE_IN_BYTES
+/*
+ * Count the entries of a collection whose `size` bytes of content start at
+ * `in[pos]`. Only the headers of the items directly inside are read, nested
+ * collections are skipped by their size, so counting the entries of all
+ * collections of a value takes linear time. The content must consist of whole
+ * items (pairs of them for maps) that fit exactly into `size` bytes.
+ */
+static HSDT_ERR count_entries(uint8_t *in, size_t in_len, size_t pos, uint64_t size, bool is_map, uint64_t *entries) {
+  if (in_len - pos < size) {
     return HSDT_ERR_EOF;
-  } else {
-    if (in[0] == 0xF6) {
-      out->tag = HSDT_NULL;
-      *consumed += 1;
-      return HSDT_ERR_NONE;
-    } else if (in[0] == 0xF5) {
-      out->tag = HSDT_TRUE;
-      *consumed += 1;
-      return HSDT_ERR_NONE;
-    } else if (in[0] == 0xF4) {
-      out->tag = HSDT_FALSE;
-      *consumed += 1;
-      return HSDT_ERR_NONE;
-    } else  if (in[0] == 0xFB) { /* 64 bit float */
-      if (in_len < 9) {
-        return HSDT_ERR_EOF;
-      } else {
-        DoubleAsInt convert;
-        for (size_t i = 0; i < 8; i++) {
-          ((uint8_t *)&convert.i)[i] = in[1 + i];
-        }
-        *consumed += 9;
-        convert.i = ntohll(convert.i);
+  }
 
-        if (isnan(convert.d) && (convert.i != 0x7ff8000000000000)) {
-          return HSDT_ERR_INVALID_NAN;
-        } else {
-          out->tag = HSDT_FP;
-          out->fp = convert.d;
-        }
+  size_t end = pos + size;
+  uint64_t items = 0;
+  while (pos < end) {
+    items += 1;
+    if (in[pos] == 0xF4 || in[pos] == 0xF5 || in[pos] == 0xF6) {
+      pos += 1;
+      continue;
+    } else if (in[pos] == 0xFB) {
+      pos += 9;
+      continue;
+    }
 
-        return HSDT_ERR_NONE;
-      }
+    uint8_t major;
+    uint8_t additional;
+    uint64_t val;
+    HSDT_ERR err = tag_and_val(in + pos, end - pos, &pos, &major, &additional, &val);
+    if (err != HSDT_ERR_NONE) {
+      return err == HSDT_ERR_EOF ? HSDT_ERR_CANONIC_LENGTH : err;
+    } else if (major < 2 || major > 5) {
+      return HSDT_ERR_TAG;
+    } else if (val > end - pos) {
+      return HSDT_ERR_CANONIC_LENGTH;
+    }
+    pos += val;
+  }
+
+  if (pos > end || (is_map && items % 2 != 0)) {
+    return HSDT_ERR_CANONIC_LENGTH;
+  }
+  *entries = is_map ? items / 2 : items;
+  return HSDT_ERR_NONE;
+}
+#endif
+
+/*
+ * Read the item starting at `in[*pos]`, advancing `*pos` by the number of bytes
+ * read. Performs all checks on the item (canonic lengths and NaNs, valid utf8),
+ * but does not allocate anything. The entries of collections are not read.
+ */
+static HSDT_ERR read_item(uint8_t *in, size_t in_len, size_t *pos, Item *item) {
+  in += *pos;
+  in_len -= *pos;
+
+  if (in_len == 0) {
+    return HSDT_ERR_EOF;
+  } else if (in[0] == 0xF6) {
+    item->tag = HSDT_NULL;
+    *pos += 1;
+    return HSDT_ERR_NONE;
+  } else if (in[0] == 0xF5) {
+    item->tag = HSDT_TRUE;
+    *pos += 1;
+    return HSDT_ERR_NONE;
+  } else if (in[0] == 0xF4) {
+    item->tag = HSDT_FALSE;
+    *pos += 1;
+    return HSDT_ERR_NONE;
+  } else if (in[0] == 0xFB) { /* 64 bit float */
+    if (in_len < 9) {
+      return HSDT_ERR_EOF;
     } else {
-      uint8_t major;
-      uint8_t additional;
-      uint64_t val;
-      HSDT_ERR err;
-      size_t tag_and_val_consumed = 0;
-      err = tag_and_val(in, in_len, &tag_and_val_consumed, &major, &additional, &val);
-      *consumed += tag_and_val_consumed;
-      if (err != HSDT_ERR_NONE) {
-        return err;
+      DoubleAsInt convert;
+      for (size_t i = 0; i < 8; i++) {
+        ((uint8_t *)&convert.i)[i] = in[1 + i];
       }
+      *pos += 9;
+      convert.i = ntohll(convert.i);
 
-      uint32_t utf8_state;
-      uint8_t *last_key = NULL;
-      size_t last_key_len = 0;
-      switch (major) {
-        case 2:
-          if ((SIZE_MAX - in_len < *consumed) || (in_len - *consumed < val)) {
-            return HSDT_ERR_EOF;
-          } else {
-            *consumed += val;
-            out->tag = HSDT_BYTE_STRING;
-            out->byte_string = sdsnewlen(in + tag_and_val_consumed, val); // XXX OOM
+      if (isnan(convert.d) && (convert.i != 0x7ff8000000000000)) {
+        return HSDT_ERR_INVALID_NAN;
+      } else {
+        item->tag = HSDT_FP;
+        item->fp = convert.d;
+        return HSDT_ERR_NONE;
+      }
+    }
+  } else {
+    uint8_t major;
+    uint8_t additional;
+    uint64_t val;
+    size_t header_len = 0;
+    HSDT_ERR err = tag_and_val(in, in_len, &header_len, &major, &additional, &val);
+    *pos += header_len;
+    if (err != HSDT_ERR_NONE) {
+      return err;
+    }
+
+    item->len = val;
+    switch (major) {
+      case 2:
+        if (in_len - header_len < val) {
+          return HSDT_ERR_EOF;
+        } else {
+          *pos += val;
+          item->tag = HSDT_BYTE_STRING;
+          item->str = in + header_len;
+          return HSDT_ERR_NONE;
+        }
+      case 3:
+        if (in_len - header_len < val) {
+          return HSDT_ERR_EOF;
+        } else {
+          *pos += val;
+          item->tag = HSDT_UTF8_STRING;
+          item->str = in + header_len;
+          if (utf8_valid(in + header_len, val)) {
             return HSDT_ERR_NONE;
-          }
-        case 3:
-          if ((SIZE_MAX - in_len < *consumed) || (in_len - *consumed < val)) {
-            return HSDT_ERR_EOF;
           } else {
-            *consumed += val;
-            out->tag = HSDT_UTF8_STRING;
-            out->utf8_string = sdsnewlen(in + tag_and_val_consumed, val); // XXX OOM
-
-            utf8_state = UTF8_ACCEPT;
-            if (validate_utf8(&utf8_state, in + tag_and_val_consumed, val) == UTF8_ACCEPT) {
-              return HSDT_ERR_NONE;
-            } else {
-              return HSDT_ERR_UTF8;
-            }
-          }
-        case 4:
-          if ((SIZE_MAX - in_len < *consumed) || (in_len - *consumed < val)) {
-            /*
-             * This is not a precise check to ensure that there is enough data.
-             * But it protects against malicious payloads causing large memory
-             * allocations.
-             */
-            return HSDT_ERR_EOF;
+            return HSDT_ERR_UTF8;
           }
+        }
+#ifdef COLLECTION_SIZE_IN_BYTES
+      case 4:
+      case 5:
+        item->tag = major == 4 ? HSDT_ARRAY : HSDT_MAP;
+        return count_entries(in, in_len, header_len, val, major == 5, &item->len);
+#else
+      case 4:
+        if (in_len - header_len < val) {
+          /*
+           * This is not a precise check to ensure that there is enough data.
+           * But it protects against malicious payloads causing large memory
+           * allocations.
+           */
+          return HSDT_ERR_EOF;
+        }
 
-          out->tag = HSDT_ARRAY;
-          out->array.len = val;
-          out->array.elems = malloc(val * sizeof(HSDT_Value)); // XXX oom
-
-          for (size_t i = 0; i < val; i++) {
-            size_t inner_consumed = 0;
-            HSDT_ERR e = do_decode(in + *consumed, in_len - *consumed, out->array.elems + i, &inner_consumed); // XXX recursion
-            *consumed += inner_consumed;
-            if (e != HSDT_ERR_NONE) {
-              out->array.len = i;
-              return e;
-            }
-          }
+        item->tag = HSDT_ARRAY;
+        return HSDT_ERR_NONE;
+      case 5:
+        item->tag = HSDT_MAP;
+        return HSDT_ERR_NONE;
+#endif
+      default:
+        return HSDT_ERR_TAG;
+    }
+  }
+}
 
-          return HSDT_ERR_NONE;
-        case 5:
-          out->map = raxNew(); // XXX OOM
-          out->tag = HSDT_MAP;
-
-          for (size_t i = 0; i < val; i++) {
-            /* handle the key */
-            uint8_t key_major;
-            uint8_t key_additional;
-            uint64_t key_val;
-            size_t inner_consumed = 0;
-
-            if (SIZE_MAX - in_len < *consumed) {
-              return HSDT_ERR_EOF;
-            }
-
-            HSDT_ERR err;
-            err = tag_and_val(in + *consumed, in_len - *consumed, &inner_consumed, &key_major, &key_additional, &key_val);
-            if (err != HSDT_ERR_NONE) {
-              return err;
-            }
-            *consumed += inner_consumed;
-
-            if (key_major != 3) {
-              return HSDT_ERR_UTF8_KEY;
-            }
-            if ((SIZE_MAX - in_len < *consumed) || (in_len - *consumed < key_val)) {
-              return HSDT_ERR_EOF;
-            }
-            utf8_state = UTF8_ACCEPT;
-            if (validate_utf8(&utf8_state, in + *consumed, key_val) != UTF8_ACCEPT) {
-              return HSDT_ERR_UTF8;
-            }
-            if (!is_lexicographically_greater(in + *consumed, key_val, last_key, last_key_len)) {
-              return HSDT_ERR_CANONIC_ORDER;
-            }
-
-            HSDT_Value *map_val = malloc(sizeof(HSDT_Value)); // XXX OOM
-            size_t key_consumed = *consumed;
-            last_key = in + *consumed;
-            last_key_len = key_val;
-            *consumed += key_val;
-
-            /* handle the value */
-            inner_consumed = 0;
-            HSDT_ERR e = do_decode(in + *consumed, in_len - *consumed, map_val, &inner_consumed); // XXX recursion
-            *consumed += inner_consumed;
-            if (e != HSDT_ERR_NONE) {
-              return e;
-            }
-
-            raxInsert(out->map, in + key_consumed, key_val, (void *) map_val, NULL); // XXX OOM
-          }
+/*
+ * Read the key of a map entry starting at `in[*pos]` and check that it is
+ * greater than the previous key `last_key` (`NULL` for the first key). On
+ * success, `key` and `key_len` are set to the content of the key, pointing
+ * into the input.
+ */
+static HSDT_ERR read_key(uint8_t *in, size_t in_len, size_t *pos, uint8_t *last_key, size_t last_key_len, uint8_t **key, size_t *key_len) {
+  uint8_t key_major;
+  uint8_t key_additional;
+  uint64_t len;
+  size_t header_len = 0;
 
-          return HSDT_ERR_NONE;
-        default:
-          return HSDT_ERR_TAG;
-      }
-    }
-  }
-}
-
-// HSDT_ERR hsdt_decode(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *read) {
-//   size_t consumed = 0; /* How many bytes have we read already? */
-//   HSDT_Value *current = out; /* Where to put the decoded data */
-//
-//   while (consumed < in_len) {
-//     /* Start decoding the next item at `in[consumed]` into `current` */
-//     switch (in[consumed]) {
-//       case 0xF6: /* null value */
-//         current->tag = HSDT_NULL;
-//         consumed += 1;
-//         goto done;
-//       case 0xF5: /* true value */
-//         current->tag = HSDT_TRUE;
-//         consumed += 1;
-//         goto done;
-//       case 0xF4: /* false value */
-//         current->tag = HSDT_FALSE;
-//         consumed += 1;
-//         goto done;
-//     }
-//   }
-//
-//   /* Ran out of input before finishing to decode. */
-//   return HSDT_ERR_EOF;
-//
-//   /*
-//    * Succeeded in decoding, `consumed` holds the total number of decoded bytes,
-//    * `out` has been fully initialized.
-//    */
-//   done:
-//     *read = consumed;
-//     return HSDT_ERR_NONE;
-// }
-//
-// /* State for a stateful decryptor that can work with partial input. */
-// typedef struct HSDT_Dec_State {
-//
-// } HSDT_Dec_State;
+  if (*pos == in_len) {
+    return HSDT_ERR_EOF;
+  }
+
+  HSDT_ERR err = tag_and_val(in + *pos, in_len - *pos, &header_len, &key_major, &key_additional, &len);
+  if (err != HSDT_ERR_NONE) {
+    return err;
+  }
+  *pos += header_len;
+
+  if (key_major != 3) {
+    return HSDT_ERR_UTF8_KEY;
+  }
+  if (in_len - *pos < len) {
+    return HSDT_ERR_EOF;
+  }
+  if (!utf8_valid(in + *pos, len)) {
+    return HSDT_ERR_UTF8;
+  }
+  if (!is_lexicographically_greater(in + *pos, len, last_key, last_key_len)) {
+    return HSDT_ERR_CANONIC_ORDER;
+  }
+
+  *key = in + *pos;
+  *key_len = len;
+  *pos += len;
+  return HSDT_ERR_NONE;
+}
+
+/* The 64 bit FNV-1a hash. */
+static uint64_t hash_key(uint8_t *key, size_t key_len) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < key_len; i++) {
+    hash = (hash ^ key[i]) * 0x100000001b3;
+  }
+  return hash;
+}
+
+/* Allocate a key with the given content. Interned keys do not belong to any value, so they bypass `hsdt_malloc`. */
+static HSDT_Key *key_new(uint8_t *key, size_t key_len, bool interned) {
+  HSDT_Key *k = interned ? malloc(sizeof(HSDT_Key) + key_len) : hsdt_malloc(sizeof(HSDT_Key) + key_len); // XXX OOM
+  k->len = key_len;
+  k->hash = 0;
+  k->interned = interned;
+  if (key_len > 0) {
+    memcpy(k->bytes, key, key_len);
+  }
+  return k;
+}
+
+void hsdt_intern_init(HSDT_Intern_Table *table, size_t max_keys) {
+  table->slots = NULL;
+  table->cap = 0;
+  table->len = 0;
+  table->max_keys = max_keys;
+}
+
+void hsdt_intern_free(HSDT_Intern_Table *table) {
+  for (size_t i = 0; i < table->cap; i++) {
+    free(table->slots[i]);
+  }
+  free(table->slots);
+  hsdt_intern_init(table, table->max_keys);
+}
+
+/* Return the slot that holds the given key, or the free slot where it belongs. */
+static HSDT_Key **intern_slot(HSDT_Intern_Table *table, uint8_t *key, size_t key_len, uint64_t hash) {
+  size_t i = hash & (table->cap - 1);
+  while (true) {
+    HSDT_Key *k = table->slots[i];
+    if (k == NULL || (k->hash == hash && k->len == key_len && (key_len == 0 || memcmp(k->bytes, key, key_len) == 0))) {
+      return table->slots + i;
+    }
+    i = (i + 1) & (table->cap - 1);
+  }
+}
+
+HSDT_Key *hsdt_intern_find(HSDT_Intern_Table *table, uint8_t *key, size_t key_len) {
+  if (table->len == 0) {
+    return NULL;
+  }
+  return *intern_slot(table, key, key_len, hash_key(key, key_len));
+}
+
+HSDT_Key *hsdt_intern(HSDT_Intern_Table *table, uint8_t *key, size_t key_len) {
+  uint64_t hash = hash_key(key, key_len);
+
+  if (table->cap > 0) {
+    HSDT_Key **slot = intern_slot(table, key, key_len, hash);
+    if (*slot != NULL) {
+      return *slot;
+    }
+  }
+  if (table->len == table->max_keys) {
+    return NULL;
+  }
+
+  /* Keep the load factor at most one half, the stored hashes make growing cheap. */
+  if (2 * (table->len + 1) > table->cap) {
+    HSDT_Key **old_slots = table->slots;
+    size_t old_cap = table->cap;
+    table->cap = old_cap == 0 ? 64 : 2 * old_cap;
+    table->slots = calloc(table->cap, sizeof(HSDT_Key *)); // XXX OOM
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old_slots[i] != NULL) {
+        *intern_slot(table, old_slots[i]->bytes, old_slots[i]->len, old_slots[i]->hash) = old_slots[i];
+      }
+    }
+    free(old_slots);
+  }
+
+  HSDT_Key *k = key_new(key, key_len, true);
+  k->hash = hash;
+  *intern_slot(table, key, key_len, hash) = k;
+  table->len += 1;
+  return k;
+}
+
+/*
+ * Map representations. Decoders create maps with `map_init` and add entries
+ * with `map_append`, in the ascending key order of the encoding.
+ */
+
+/* Initialize `out` as an empty map in the representation `opts` select. A sorted map gets room for `cap` entries. */
+static void map_init(HSDT_Value *out, size_t cap, const HSDT_Dec_Options *opts) {
+  if (opts->map_repr == HSDT_MAP_SORTED) {
+    out->tag = HSDT_SORTED_MAP;
+    out->sorted_map.len = 0;
+    out->sorted_map.entries = cap == 0 ? NULL : hsdt_malloc(cap * sizeof(HSDT_Map_Entry)); // XXX OOM
+  } else {
+    out->tag = HSDT_MAP;
+    out->map = raxNew(); // XXX OOM
+  }
+}
+
+/*
+ * Add an entry for `key`, which must be greater than all keys of the map, and
+ * return its value, initialized to `HSDT_NULL`. A sorted map must have room
+ * for the entry, its key is interned if `opts` select a table.
+ */
+static HSDT_Value *map_append(HSDT_Value *map, uint8_t *key, size_t key_len, const HSDT_Dec_Options *opts) {
+  HSDT_Value *val;
+  if (map->tag == HSDT_SORTED_MAP) {
+    HSDT_Map_Entry *entry = map->sorted_map.entries + map->sorted_map.len;
+    entry->key = opts->intern == NULL ? NULL : hsdt_intern(opts->intern, key, key_len);
+    if (entry->key == NULL) {
+      entry->key = key_new(key, key_len, false);
+    }
+    map->sorted_map.len += 1;
+    val = &entry->val;
+  } else {
+    val = hsdt_malloc(sizeof(HSDT_Value)); // XXX OOM
+    raxInsert(map->map, key, key_len, (void *) val, NULL); // XXX OOM
+  }
+  val->tag = HSDT_NULL;
+  return val;
+}
+
+HSDT_Value *hsdt_map_get(HSDT_Value *map, uint8_t *key, size_t key_len) {
+  if (hsdt_lazy_load(map) != HSDT_ERR_NONE) {
+    return NULL;
+  }
+
+  if (map->tag == HSDT_MAP) {
+    void *val = raxFind(map->map, key, key_len);
+    return val == raxNotFound ? NULL : val;
+  }
+
+  size_t lo = 0;
+  size_t hi = map->sorted_map.len;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    HSDT_Key *mid_key = map->sorted_map.entries[mid].key;
+
+    if (is_lexicographically_greater(key, key_len, mid_key->bytes, mid_key->len)) {
+      lo = mid + 1;
+    } else if (is_lexicographically_greater(mid_key->bytes, mid_key->len, key, key_len)) {
+      hi = mid;
+    } else {
+      return &map->sorted_map.entries[mid].val;
+    }
+  }
+
+  return NULL;
+}
+
+/* Maps up to this size are searched linearly by `hsdt_map_get_interned`. */
+#define INTERNED_LINEAR_MAX 16
+
+HSDT_Value *hsdt_map_get_interned(HSDT_Value *map, HSDT_Key *key) {
+  if (hsdt_lazy_load(map) != HSDT_ERR_NONE) {
+    return NULL;
+  }
+  if (map->tag != HSDT_SORTED_MAP || map->sorted_map.len > INTERNED_LINEAR_MAX) {
+    return hsdt_map_get(map, key->bytes, key->len);
+  }
+
+  for (size_t i = 0; i < map->sorted_map.len; i++) {
+    HSDT_Key *k = map->sorted_map.entries[i].key;
+    /* Interned keys are unique per table, so only other keys need comparing bytes. */
+    if (k == key || (!k->interned && k->len == key->len && (k->len == 0 || memcmp(k->bytes, key->bytes, k->len) == 0))) {
+      return &map->sorted_map.entries[i].val;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Decode the item starting at `in[*pos]` into `out`, advancing `*pos` by the
+ * number of bytes read. Scalars are decoded completely. Collections are
+ * initialized as empty and `*entries` is set to the number of entries the
+ * caller still has to decode into them, for scalars it is set to 0.
+ *
+ * On error, `out` is left in a state that can be passed to `hsdt_value_free`.
+ */
+static HSDT_ERR decode_item(uint8_t *in, size_t in_len, size_t *pos, HSDT_Value *out, size_t *entries, const HSDT_Dec_Options *opts) {
+  Item item;
+  HSDT_ERR err = read_item(in, in_len, pos, &item);
+  *entries = 0;
+  if (err != HSDT_ERR_NONE) {
+    return err;
+  }
+
+  out->tag = item.tag;
+  switch (item.tag) {
+    case HSDT_BYTE_STRING:
+    case HSDT_UTF8_STRING:
+      str_init(out, item.tag, item.str, item.len, opts);
+      break;
+    case HSDT_FP:
+      out->fp = item.fp;
+      break;
+    case HSDT_ARRAY:
+      out->array.len = 0; /* Counts the initialized entries until the array is complete. */
+      out->array.elems = hsdt_malloc(item.len * sizeof(HSDT_Value)); // XXX oom
+      *entries = item.len;
+      break;
+    case HSDT_MAP:
+      /*
+       * The length of a map has not been checked against the input. But every
+       * entry takes at least two bytes, so if there is no room for more than
+       * this many entries, decoding fails before the map would overflow.
+       */
+      map_init(out, item.len < (in_len - *pos + 1) / 2 ? item.len : (in_len - *pos + 1) / 2, opts);
+      *entries = item.len;
+      break;
+    default:
+      break;
+  }
+  return HSDT_ERR_NONE;
+}
+
+/*
+ * Read and check the next key of the map in `frame`, then insert a fresh value
+ * for it into the map. `*out` is set to that value, which is initialized to
+ * `HSDT_NULL` so that the map can be freed even if decoding the value fails.
+ */
+static HSDT_ERR decode_key(uint8_t *in, size_t in_len, size_t *pos, HSDT_Dec_Frame *frame, HSDT_Value **out, const HSDT_Dec_Options *opts) {
+  uint8_t *key;
+  size_t key_len;
+  HSDT_ERR err = read_key(in, in_len, pos, frame->last_key, frame->last_key_len, &key, &key_len);
+  if (err != HSDT_ERR_NONE) {
+    return err;
+  }
+
+  frame->last_key = key;
+  frame->last_key_len = key_len;
+
+  *out = map_append(frame->val, key, key_len, opts);
+  return HSDT_ERR_NONE;
+}
+
+HSDT_ERR hsdt_decode(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed) {
+  return hsdt_decode_stack(in, in_len, out, consumed, NULL, HSDT_DEFAULT_MAX_DEPTH);
+}
+
+/* `hsdt_decode_stack`, with the values represented as `opts` select. */
+static HSDT_ERR decode_stack(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed, HSDT_Dec_Frame *stack, size_t max_depth, const HSDT_Dec_Options *opts) {
+  HSDT_Dec_Frame *frames = stack;
+  size_t frames_cap = stack == NULL ? 0 : max_depth;
+  size_t depth = 0; /* Number of collections that are currently open. */
+  size_t pos = 0;
+  HSDT_Value *current = out; /* Where to put the next decoded item */
+  HSDT_ERR err;
+
+  out->tag = HSDT_NULL;
+
+  while (true) {
+    size_t entries;
+    err = decode_item(in, in_len, &pos, current, &entries, opts);
+    if (err != HSDT_ERR_NONE) {
+      goto fail;
+    }
+
+    if (is_collection(current)) {
+      if (depth == max_depth) {
+        err = HSDT_ERR_DEPTH;
+        goto fail;
+      }
+
+      if (depth == frames_cap) {
+        frames_cap = frames_cap == 0 ? 16 : 2 * frames_cap;
+        if (frames_cap > max_depth) {
+          frames_cap = max_depth;
+        }
+        frames = realloc(frames, frames_cap * sizeof(HSDT_Dec_Frame)); // XXX OOM
+      }
+
+      frames[depth].val = current;
+      frames[depth].remaining = entries;
+      frames[depth].last_key = NULL;
+      frames[depth].last_key_len = 0;
+      depth += 1;
+    }
+
+    /* Close all completed collections, then find the place for the next item. */
+    while (depth > 0 && frames[depth - 1].remaining == 0) {
+      depth -= 1;
+    }
+    if (depth == 0) {
+      break;
+    }
+
+    HSDT_Dec_Frame *top = frames + depth - 1;
+    top->remaining -= 1;
+    if (top->val->tag == HSDT_ARRAY) {
+      current = top->val->array.elems + top->val->array.len;
+      current->tag = HSDT_NULL;
+      top->val->array.len += 1;
+    } else {
+      err = decode_key(in, in_len, &pos, top, &current, opts);
+      if (err != HSDT_ERR_NONE) {
+        goto fail;
+      }
+    }
+  }
+
+  if (stack == NULL) {
+    free(frames);
+  }
+  *consumed = pos;
+  return HSDT_ERR_NONE;
+
+  fail:
+    if (stack == NULL) {
+      free(frames);
+    }
+    hsdt_value_free(*out);
+    out->tag = HSDT_NULL;
+    *consumed = pos;
+    return err;
+}
+
+HSDT_ERR hsdt_decode_stack(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed, HSDT_Dec_Frame *stack, size_t max_depth) {
+  return decode_stack(in, in_len, out, consumed, stack, max_depth, &default_dec_options);
+}
+
+HSDT_ERR hsdt_decode_with(const HSDT_Dec_Options *opts, uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed) {
+  return decode_stack(in, in_len, out, consumed, NULL, HSDT_DEFAULT_MAX_DEPTH, opts == NULL ? &default_dec_options : opts);
+}
+
+size_t hsdt_decode_batch(HSDT_Arena *arena, uint8_t *in, size_t in_len, HSDT_Batch_Result *results, size_t max_results, size_t *consumed) {
+  HSDT_Arena *prev_arena = current_arena;
+  HSDT_Dec_Frame *stack = malloc(HSDT_DEFAULT_MAX_DEPTH * sizeof(HSDT_Dec_Frame)); // XXX OOM
+  size_t pos = 0;
+  size_t n = 0;
+  current_arena = arena;
+
+  while (pos < in_len && n < max_results) {
+    HSDT_Batch_Result *result = results + n;
+    n += 1;
+    result->offset = pos;
+    result->err = hsdt_decode_stack(in + pos, in_len - pos, &result->val, &result->len, stack, HSDT_DEFAULT_MAX_DEPTH);
+    if (result->err != HSDT_ERR_NONE) {
+      break;
+    }
+    pos += result->len;
+  }
+
+  current_arena = prev_arena;
+  free(stack);
+  *consumed = pos;
+  return n;
+}
+
+/*
+ * Find the end of the value starting at `in[*pos]` by reading only headers,
+ * and advance `*pos` past it. Checks that all lengths are canonical and fit
+ * into the input, but not the content of strings, floats or keys. Needs no
+ * stack, only the number of items that are still to be skipped. With
+ * COLLECTION_SIZE_IN_BYTES, collections are skipped without looking inside.
+ */
+static HSDT_ERR skip_value(uint8_t *in, size_t in_len, size_t *pos) {
+  uint64_t pending = 1;
+
+  while (pending > 0) {
+    if (*pos == in_len) {
+      return HSDT_ERR_EOF;
+    }
+    pending -= 1;
+
+    if (in[*pos] == 0xF4 || in[*pos] == 0xF5 || in[*pos] == 0xF6) {
+      *pos += 1;
+      continue;
+    } else if (in[*pos] == 0xFB) {
+      if (in_len - *pos < 9) {
+        return HSDT_ERR_EOF;
+      }
+      *pos += 9;
+      continue;
+    }
+
+    uint8_t major;
+    uint8_t additional;
+    uint64_t val;
+    size_t header_len = 0;
+    HSDT_ERR err = tag_and_val(in + *pos, in_len - *pos, &header_len, &major, &additional, &val);
+    if (err != HSDT_ERR_NONE) {
+      return err;
+    }
+    *pos += header_len;
+
+    switch (major) {
+      case 2:
+      case 3:
+        if (in_len - *pos < val) {
+          return HSDT_ERR_EOF;
+        }
+        *pos += val;
+        break;
+      case 4:
+      case 5:
+#ifdef COLLECTION_SIZE_IN_BYTES
+        /* The header gives the size of the content, which is skipped at once. */
+        if (in_len - *pos < val) {
+          return HSDT_ERR_EOF;
+        }
+        *pos += val;
+#else
+        /* Every item takes at least one byte, so larger counts can not fit (and can not overflow). */
+        if (val > in_len - *pos || (major == 5 && 2 * val > in_len - *pos)) {
+          return HSDT_ERR_EOF;
+        }
+        pending += major == 4 ? val : 2 * val;
+#endif
+        break;
+      default:
+        return HSDT_ERR_TAG;
+    }
+  }
+
+  return HSDT_ERR_NONE;
+}
+
+/* Compare floats, all NaNs are equal (there is only one canonical NaN). */
+static bool fp_eq(double a, double b) {
+  if (isnan(a) && isnan(b)) {
+    return true;
+  } else {
+    return a == b;
+  }
+}
+
+/* Compare a decoded scalar or collection header with an item read from an encoding. */
+static bool value_item_eq(HSDT_Value *val, Item *item) {
+  size_t len;
+  uint8_t *str;
+
+  if (logical_tag(val->tag) != item->tag) {
+    return false;
+  }
+  switch (item->tag) {
+    case HSDT_BYTE_STRING:
+    case HSDT_UTF8_STRING:
+      str = hsdt_value_str(val, &len);
+      return len == item->len && (len == 0 || memcmp(str, item->str, len) == 0);
+    case HSDT_FP:
+      return fp_eq(val->fp, item->fp);
+    case HSDT_ARRAY:
+    case HSDT_MAP:
+      return collection_len(val) == item->len;
+    default:
+      return true;
+  }
+}
+
+/*
+ * Compare two encoded values. Canonical encodings are equal if the values are,
+ * but not the other way around (0.0 and -0.0 are equal values), so unequal
+ * encodings are compared item by item, in a single pass over both.
+ */
+static bool enc_eq(uint8_t *a, size_t a_len, uint8_t *b, size_t b_len) {
+  if (a_len == b_len && memcmp(a, b, a_len) == 0) {
+    return true;
+  }
+
+  size_t pos_a = 0;
+  size_t pos_b = 0;
+  while (pos_a < a_len && pos_b < b_len) {
+    Item item_a;
+    Item item_b;
+    if (read_item(a, a_len, &pos_a, &item_a) != HSDT_ERR_NONE || read_item(b, b_len, &pos_b, &item_b) != HSDT_ERR_NONE) {
+      return false;
+    } else if (item_a.tag != item_b.tag) {
+      return false;
+    }
+
+    switch (item_a.tag) {
+      case HSDT_BYTE_STRING:
+      case HSDT_UTF8_STRING:
+        if (item_a.len != item_b.len || (item_a.len > 0 && memcmp(item_a.str, item_b.str, item_a.len) != 0)) {
+          return false;
+        }
+        break;
+      case HSDT_FP:
+        if (!fp_eq(item_a.fp, item_b.fp)) {
+          return false;
+        }
+        break;
+      case HSDT_ARRAY:
+      case HSDT_MAP:
+        if (item_a.len != item_b.len) {
+          return false;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  return pos_a == a_len && pos_b == b_len;
+}
+
+/*
+ * Compare the decoded `val` with the encoded value `enc`, by traversing `val`
+ * and reading the items of `enc` in the same order, in which the encoder
+ * would have written them. Lazy values inside of `val` are compared with the
+ * part of `enc` they correspond to.
+ */
+static bool value_enc_eq(HSDT_Value *val, uint8_t *enc, size_t enc_len) {
+  Walk walk;
+  Item item;
+  size_t pos = 0;
+  bool eq = read_item(enc, enc_len, &pos, &item) == HSDT_ERR_NONE && value_item_eq(val, &item);
+
+  walk_init(&walk);
+  if (eq) {
+    walk_enter(&walk, val);
+  }
+
+  while (eq && walk.depth > 0) {
+    uint8_t *key;
+    size_t key_len;
+    HSDT_Value *entry;
+
+    if (walk_next(&walk, &key, &key_len, &entry)) {
+      if (key != NULL) {
+        eq = read_item(enc, enc_len, &pos, &item) == HSDT_ERR_NONE && item.tag == HSDT_UTF8_STRING &&
+          item.len == key_len && (key_len == 0 || memcmp(item.str, key, key_len) == 0);
+        if (!eq) {
+          break;
+        }
+      }
+
+      if (entry->tag == HSDT_LAZY) {
+        size_t start = pos;
+        eq = skip_value(enc, enc_len, &pos) == HSDT_ERR_NONE && enc_eq(entry->lazy.enc, entry->lazy.len, enc + start, pos - start);
+      } else {
+        eq = read_item(enc, enc_len, &pos, &item) == HSDT_ERR_NONE && value_item_eq(entry, &item);
+        if (eq) {
+          walk_enter(&walk, entry);
+        }
+      }
+    }
+  }
+
+  walk_free(&walk);
+  return eq && pos == enc_len;
+}
+
+/* Compare a lazy value with any other value, without decoding or encoding anything. */
+static bool lazy_eq(HSDT_Value *lazy, HSDT_Value *other) {
+  if (other->tag == HSDT_LAZY) {
+    return enc_eq(lazy->lazy.enc, lazy->lazy.len, other->lazy.enc, other->lazy.len);
+  } else {
+    return value_enc_eq(other, lazy->lazy.enc, lazy->lazy.len);
+  }
+}
+
+/*
+ * Compare scalars, and the tags and number of entries of collections. Lazy
+ * values are compared completely.
+ */
+static bool item_eq(HSDT_Value *a, HSDT_Value *b) {
+  size_t len_a, len_b;
+  uint8_t *str_a, *str_b;
+
+  if (a->tag == HSDT_LAZY) {
+    return lazy_eq(a, b);
+  } else if (b->tag == HSDT_LAZY) {
+    return lazy_eq(b, a);
+  } else if (logical_tag(a->tag) != logical_tag(b->tag)) {
+    return false;
+  } else {
+    switch (logical_tag(a->tag)) {
+      case HSDT_NULL:
+        return true;
+      case HSDT_TRUE:
+        return true;
+      case HSDT_FALSE:
+        return true;
+      case HSDT_BYTE_STRING:
+      case HSDT_UTF8_STRING:
+        str_a = hsdt_value_str(a, &len_a);
+        str_b = hsdt_value_str(b, &len_b);
+        return len_a == len_b && (len_a == 0 || memcmp(str_a, str_b, len_a) == 0);
+      case HSDT_FP:
+        return fp_eq(a->fp, b->fp);
+      case HSDT_ARRAY:
+        return a->array.len == b->array.len;
+      case HSDT_MAP:
+        return collection_len(a) == collection_len(b);
+      default:
+        return false; /* unreachable if tags are valid */
+    }
+  }
+}
+
+bool hsdt_value_eq(HSDT_Value a, HSDT_Value b) {
+  if (!item_eq(&a, &b)) {
+    return false;
+  } else if (a.tag == HSDT_LAZY || b.tag == HSDT_LAZY) {
+    return true;
+  }
+
+  /* Walk both values in lockstep, the walks stay in sync as long as all visited items are equal. */
+  Walk walk_a;
+  Walk walk_b;
+  walk_init(&walk_a);
+  walk_init(&walk_b);
+  walk_enter(&walk_a, &a);
+  walk_enter(&walk_b, &b);
+
+  bool eq = true;
+  while (eq && walk_a.depth > 0) {
+    uint8_t *key_a, *key_b;
+    size_t key_len_a, key_len_b;
+    HSDT_Value *entry_a, *entry_b;
+
+    if (walk_next(&walk_a, &key_a, &key_len_a, &entry_a)) {
+      walk_next(&walk_b, &key_b, &key_len_b, &entry_b);
+
+      if (key_len_a != key_len_b || (key_a != NULL && memcmp(key_a, key_b, key_len_a) != 0)) {
+        eq = false;
+      } else if (!item_eq(entry_a, entry_b)) {
+        eq = false;
+      } else if (entry_a->tag != HSDT_LAZY && entry_b->tag != HSDT_LAZY) {
+        walk_enter(&walk_a, entry_a);
+        walk_enter(&walk_b, entry_b);
+      }
+    } else {
+      walk_next(&walk_b, &key_b, &key_len_b, &entry_b);
+    }
+  }
+
+  walk_free(&walk_a);
+  walk_free(&walk_b);
+  return eq;
+}
+
+/*
+ * Decode the value at the start of `in`, but keep all collections inside of it
+ * as lazy values. Performs all checks on the items it decodes.
+ */
+static HSDT_ERR decode_shallow(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed) {
+  size_t pos = 0;
+  HSDT_Dec_Frame frame;
+  HSDT_ERR err;
+
+  out->tag = HSDT_NULL;
+  frame.val = out;
+  frame.last_key = NULL;
+  frame.last_key_len = 0;
+  err = decode_item(in, in_len, &pos, out, &frame.remaining, &default_dec_options);
+  if (err != HSDT_ERR_NONE) {
+    goto fail;
+  }
+
+  while (frame.remaining > 0) {
+    HSDT_Value *current;
+    frame.remaining -= 1;
+    if (out->tag == HSDT_ARRAY) {
+      current = out->array.elems + out->array.len;
+      current->tag = HSDT_NULL;
+      out->array.len += 1;
+    } else {
+      err = decode_key(in, in_len, &pos, &frame, &current, &default_dec_options);
+      if (err != HSDT_ERR_NONE) {
+        goto fail;
+      }
+    }
+
+    if (pos < in_len && (in[pos] >> 5 == 4 || in[pos] >> 5 == 5)) {
+      size_t start = pos;
+      err = skip_value(in, in_len, &pos);
+      if (err != HSDT_ERR_NONE) {
+        goto fail;
+      }
+      current->tag = HSDT_LAZY;
+      current->lazy.enc = in + start;
+      current->lazy.len = pos - start;
+    } else {
+      size_t entries;
+      err = decode_item(in, in_len, &pos, current, &entries, &default_dec_options);
+      if (err != HSDT_ERR_NONE) {
+        goto fail;
+      }
+    }
+  }
+
+  *consumed = pos;
+  return HSDT_ERR_NONE;
+
+  fail:
+    hsdt_value_free(*out);
+    out->tag = HSDT_NULL;
+    *consumed = pos;
+    return err;
+}
+
+HSDT_ERR hsdt_decode_lazy(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed, bool validate) {
+  if (validate) {
+    HSDT_ERR err = hsdt_validate(in, in_len, consumed);
+    if (err != HSDT_ERR_NONE) {
+      out->tag = HSDT_NULL;
+      return err;
+    }
+  }
+  return decode_shallow(in, in_len, out, consumed);
+}
+
+HSDT_ERR hsdt_lazy_load(HSDT_Value *val) {
+  if (val->tag != HSDT_LAZY) {
+    return HSDT_ERR_NONE;
+  }
+
+  HSDT_Value loaded;
+  size_t consumed;
+  HSDT_ERR err = decode_shallow(val->lazy.enc, val->lazy.len, &loaded, &consumed);
+  if (err == HSDT_ERR_NONE) {
+    *val = loaded;
+  }
+  return err;
+}
+
+HSDT_Value *hsdt_array_get(HSDT_Value *array, size_t n) {
+  if (hsdt_lazy_load(array) != HSDT_ERR_NONE || n >= array->array.len) {
+    return NULL;
+  }
+  return array->array.elems + n;
+}
+
+/* A collection directly inside of a value passed to `hsdt_encode_lazy`, and where its encoding went. */
+typedef struct Reencoded {
+  HSDT_Value *val;
+  size_t offset;
+  size_t len;
+} Reencoded;
+
+/* Remember that the encoding of `val` starts at `offset` and ends at the current end of `w`. */
+static void reencoded_push(Reencoded **re, size_t *len, size_t *cap, HSDT_Value *val, size_t offset, Writer *w) {
+  if (*len == *cap) {
+    *cap = *cap == 0 ? 8 : 2 * *cap;
+    *re = realloc(*re, *cap * sizeof(Reencoded)); // XXX OOM
+  }
+  (*re)[*len].val = val;
+  (*re)[*len].offset = offset;
+  (*re)[*len].len = w->len - offset;
+  *len += 1;
+}
+
+uint8_t *hsdt_encode_lazy(HSDT_Value *val, size_t *out_len) {
+  Writer w;
+  Walk walk;
+  Walk entry_walk;
+  Reencoded *re = NULL;
+  size_t re_len = 0;
+  size_t re_cap = 0;
+  writer_init(&w, malloc(ENCODE_INITIAL_CAP), ENCODE_INITIAL_CAP, WRITER_GROW); // XXX OOM
+  walk_init(&walk);
+  walk_init(&entry_walk);
+
+  if (!is_collection(val)) {
+    encode_walk(&w, &walk, val);
+    if (val->tag == HSDT_LAZY) {
+      reencoded_push(&re, &re_len, &re_cap, val, 0, &w);
+    }
+  } else {
+    /*
+     * Encode the entries one by one rather than in a single traversal, so that
+     * the position of each of them is known.
+     */
+#ifdef COLLECTION_SIZE_IN_BYTES
+    walk_sizes(&walk, val);
+#endif
+    encode_item(&w, &walk, val);
+    walk_enter(&walk, val);
+
+    while (walk.depth > 0) {
+      uint8_t *key;
+      size_t key_len;
+      HSDT_Value *entry;
+
+      if (walk_next(&walk, &key, &key_len, &entry)) {
+        if (key != NULL) {
+          writer_push_header(&w, key_len, 0x60);
+          writer_push(&w, key, key_len);
+        }
+        size_t offset = w.len;
+        encode_walk(&w, &entry_walk, entry);
+        if (is_collection(entry) || entry->tag == HSDT_LAZY) {
+          reencoded_push(&re, &re_len, &re_cap, entry, offset, &w);
+        }
+      }
+    }
+  }
+  walk_free(&walk);
+  walk_free(&entry_walk);
+
+  /* Give back the unused space, this does not copy with common allocators. */
+  uint8_t *out = realloc(w.buf, w.len);
+
+  /* Only now that the encoding does not move anymore, point into it. */
+  for (size_t i = 0; i < re_len; i++) {
+    HSDT_Value *entry = re[i].val;
+    if (entry->tag != HSDT_LAZY) {
+      hsdt_value_free(*entry);
+    }
+    entry->tag = HSDT_LAZY;
+    entry->lazy.enc = out + re[i].offset;
+    entry->lazy.len = re[i].len;
+  }
+  free(re);
+
+  *out_len = w.len;
+  return out;
+}
+
+/* How many bytes of a string the streaming decoder allocates before any of them arrived. */
+#define STREAM_STR_PREALLOC 65536
+
+/* Return how many bytes the header (tag and length) starting with the given tag byte takes up. */
+static size_t header_size(uint8_t tag) {
+  switch (tag & 0x1F) {
+    case 24:
+      return 2;
+    case 25:
+      return 3;
+    case 26:
+      return 5;
+    case 27:
+      return 9;
+    default:
+      return 1;
+  }
+}
+
+void hsdt_dec_init(HSDT_Dec_State *state, HSDT_Value *out, size_t max_depth) {
+  state->out = out;
+  state->max_depth = max_depth;
+  state->opts = default_dec_options;
+  state->frames = NULL;
+  state->frames_cap = 0;
+  state->depth = 0;
+  state->current = out;
+  state->phase = HSDT_DEC_HEADER;
+  state->in_key = false;
+  state->header_len = 0;
+  state->str = NULL;
+  state->err = HSDT_ERR_EOF;
+#ifdef COLLECTION_SIZE_IN_BYTES
+  state->offset = 0;
+#endif
+
+  out->tag = HSDT_NULL;
+}
+
+void hsdt_dec_init_with(const HSDT_Dec_Options *opts, HSDT_Dec_State *state, HSDT_Value *out, size_t max_depth) {
+  hsdt_dec_init(state, out, max_depth);
+  if (opts != NULL) {
+    state->opts = *opts;
+  }
+}
+
+void hsdt_dec_free(HSDT_Dec_State *state) {
+  for (size_t i = 0; i < state->depth; i++) {
+    sdsfree(state->frames[i].last_key);
+  }
+  free(state->frames);
+  sdsfree(state->str);
+
+  if (state->err != HSDT_ERR_NONE) {
+    hsdt_value_free(*state->out);
+    state->out->tag = HSDT_NULL;
+  }
+
+  state->frames = NULL;
+  state->frames_cap = 0;
+  state->depth = 0;
+  state->str = NULL;
+}
+
+/*
+ * Return how many more entries the collection of `frame` can have. With
+ * COLLECTION_SIZE_IN_BYTES this is a bound, since every entry takes at least
+ * one byte.
+ */
+static uint64_t stream_remaining(HSDT_Dec_State *state, HSDT_Stream_Frame *frame) {
+#ifdef COLLECTION_SIZE_IN_BYTES
+  return frame->end - state->offset;
+#else
+  (void) state;
+  return frame->remaining;
+#endif
+}
+
+/*
+ * Array (and sorted map) storage grows with the entries that actually arrive,
+ * not with the announced length. Must be called before `remaining` is
+ * decremented for the new entry.
+ */
+static void stream_reserve(HSDT_Dec_State *state, HSDT_Stream_Frame *frame) {
+  size_t len = collection_len(frame->val);
+  if (len == frame->cap) {
+    frame->cap = frame->cap == 0 ? 4 : 2 * frame->cap;
+    if (frame->cap > len + stream_remaining(state, frame)) {
+      frame->cap = len + stream_remaining(state, frame);
+    }
+    if (frame->val->tag == HSDT_ARRAY) {
+      frame->val->array.elems = hsdt_realloc(frame->val->array.elems, frame->cap * sizeof(HSDT_Value)); // XXX OOM
+    } else {
+      frame->val->sorted_map.entries = hsdt_realloc(frame->val->sorted_map.entries, frame->cap * sizeof(HSDT_Map_Entry)); // XXX OOM
+    }
+  }
+}
+
+/*
+ * Open the collection in `state->current`, which expects `entries` many
+ * entries, or with COLLECTION_SIZE_IN_BYTES that many bytes of content.
+ */
+static HSDT_ERR stream_open(HSDT_Dec_State *state, size_t entries) {
+  if (state->depth == state->max_depth) {
+    return HSDT_ERR_DEPTH;
+  }
+
+  if (state->depth == state->frames_cap) {
+    state->frames_cap = state->frames_cap == 0 ? 16 : 2 * state->frames_cap;
+    state->frames = realloc(state->frames, state->frames_cap * sizeof(HSDT_Stream_Frame)); // XXX OOM
+  }
+
+  HSDT_Stream_Frame *frame = state->frames + state->depth;
+  frame->val = state->current;
+  frame->remaining = entries;
+  frame->cap = 0;
+  frame->last_key = NULL;
+#ifdef COLLECTION_SIZE_IN_BYTES
+  frame->end = state->offset + entries;
+#endif
+  state->depth += 1;
+  return HSDT_ERR_NONE;
+}
+
+/*
+ * Called whenever an item has been completed. Closes all completed collections
+ * and prepares for the next item, or marks the value as done.
+ */
+static void stream_advance(HSDT_Dec_State *state) {
+  while (state->depth > 0 && stream_remaining(state, state->frames + state->depth - 1) == 0) {
+    state->depth -= 1;
+    sdsfree(state->frames[state->depth].last_key);
+  }
+
+  state->phase = HSDT_DEC_HEADER;
+  state->header_len = 0;
+
+  if (state->depth == 0) {
+    state->phase = HSDT_DEC_DONE;
+    return;
+  }
+
+  HSDT_Stream_Frame *top = state->frames + state->depth - 1;
+  if (top->val->tag == HSDT_ARRAY) {
+    stream_reserve(state, top);
+    top->remaining -= 1;
+    state->current = top->val->array.elems + top->val->array.len;
+    state->current->tag = HSDT_NULL;
+    top->val->array.len += 1;
+    state->in_key = false;
+  } else {
+    if (top->val->tag == HSDT_SORTED_MAP) {
+      stream_reserve(state, top);
+    }
+    top->remaining -= 1;
+    state->in_key = true;
+  }
+}
+
+#ifdef COLLECTION_SIZE_IN_BYTES
+/* Return whether the item whose header has just been read, and `len` more bytes, fit into the innermost collection. */
+static bool stream_fits(HSDT_Dec_State *state, uint64_t len) {
+  if (state->depth == 0) {
+    return true;
+  }
+  uint64_t end = state->frames[state->depth - 1].end;
+  return state->offset <= end && end - state->offset >= len;
+}
+#endif
+
+/* Handle a complete header in `state->header`. */
+static HSDT_ERR stream_header(HSDT_Dec_State *state) {
+  uint8_t major;
+  uint8_t additional;
+  uint64_t val;
+  size_t header_len = 0;
+  HSDT_ERR err;
+
+  if (!state->in_key && (state->header[0] == 0xF4 || state->header[0] == 0xF5 || state->header[0] == 0xF6 || state->header[0] == 0xFB)) {
+#ifdef COLLECTION_SIZE_IN_BYTES
+    if (!stream_fits(state, 0)) {
+      return HSDT_ERR_CANONIC_LENGTH;
+    }
+#endif
+    size_t entries;
+    err = decode_item(state->header, state->header_len, &header_len, state->current, &entries, &state->opts);
+    if (err == HSDT_ERR_NONE) {
+      stream_advance(state);
+    }
+    return err;
+  }
+
+  err = tag_and_val(state->header, state->header_len, &header_len, &major, &additional, &val);
+  if (err != HSDT_ERR_NONE) {
+    return err;
+  }
+#ifdef COLLECTION_SIZE_IN_BYTES
+  if (major >= 2 && major <= 5 && !stream_fits(state, val)) {
+    return HSDT_ERR_CANONIC_LENGTH;
+  }
+#endif
+
+  if (state->in_key && major != 3) {
+    return HSDT_ERR_UTF8_KEY;
+  }
+
+  switch (major) {
+    case 2:
+    case 3:
+      state->phase = HSDT_DEC_BODY;
+      state->str_major = major;
+      state->str_remaining = val;
+      state->str_filled = 0;
+      state->utf8_state = UTF8_ACCEPT;
+      /* Preallocate, but do not trust huge lengths before the data arrives. */
+      state->str = sdsnewlen(NULL, val < STREAM_STR_PREALLOC ? val : STREAM_STR_PREALLOC); // XXX OOM
+      return HSDT_ERR_NONE;
+    case 4:
+      state->current->tag = HSDT_ARRAY;
+      state->current->array.len = 0;
+      state->current->array.elems = NULL;
+      err = stream_open(state, val);
+      if (err == HSDT_ERR_NONE) {
+        stream_advance(state);
+      }
+      return err;
+    case 5:
+      map_init(state->current, 0, &state->opts);
+      err = stream_open(state, val);
+      if (err == HSDT_ERR_NONE) {
+        stream_advance(state);
+      }
+      return err;
+    default:
+      return HSDT_ERR_TAG;
+  }
+}
+
+/* Handle a complete string in `state->str`. */
+static HSDT_ERR stream_string(HSDT_Dec_State *state) {
+  if (state->in_key) {
+    HSDT_Stream_Frame *top = state->frames + state->depth - 1;
+    sds last_key = top->last_key;
+
+    if (!is_lexicographically_greater((uint8_t *) state->str, sdslen(state->str), (uint8_t *) last_key, last_key == NULL ? 0 : sdslen(last_key))) {
+      return HSDT_ERR_CANONIC_ORDER;
+    }
+
+    sdsfree(last_key);
+    top->last_key = state->str;
+    state->str = NULL;
+#ifdef COLLECTION_SIZE_IN_BYTES
+    /* The value must fit after the key. */
+    if (stream_remaining(state, top) == 0) {
+      return HSDT_ERR_CANONIC_LENGTH;
+    }
+#endif
+
+    state->current = map_append(top->val, (uint8_t *) top->last_key, sdslen(top->last_key), &state->opts);
+
+    state->in_key = false;
+    state->phase = HSDT_DEC_HEADER;
+    state->header_len = 0;
+  } else {
+    HSDT_TYPE_TAG tag = state->str_major == 2 ? HSDT_BYTE_STRING : HSDT_UTF8_STRING;
+    if (state->opts.short_strings && sdslen(state->str) <= HSDT_SHORT_STRING_MAX) {
+      str_init(state->current, tag, (uint8_t *) state->str, sdslen(state->str), &state->opts);
+      sdsfree(state->str);
+    } else {
+      state->current->tag = tag;
+      state->current->byte_string = state->str;
+    }
+    state->str = NULL;
+    stream_advance(state);
+  }
+
+  return HSDT_ERR_NONE;
+}
+
+HSDT_ERR hsdt_dec_feed(HSDT_Dec_State *state, uint8_t *in, size_t in_len, size_t *consumed) {
+  size_t pos = 0;
+  HSDT_ERR err = HSDT_ERR_NONE;
+
+  if (state->err != HSDT_ERR_EOF) {
+    *consumed = 0;
+    return state->err;
+  }
+
+  while (state->phase != HSDT_DEC_DONE) {
+    if (state->phase == HSDT_DEC_HEADER) {
+      if (pos == in_len) {
+        *consumed = pos;
+        return HSDT_ERR_EOF;
+      }
+
+      size_t needed = header_size(state->header_len == 0 ? in[pos] : state->header[0]) - state->header_len;
+      size_t available = in_len - pos < needed ? in_len - pos : needed;
+      memcpy(state->header + state->header_len, in + pos, available);
+      state->header_len += available;
+      pos += available;
+#ifdef COLLECTION_SIZE_IN_BYTES
+      state->offset += available;
+#endif
+
+      if (available == needed) {
+        err = stream_header(state);
+      }
+    } else {
+      size_t available = in_len - pos < state->str_remaining ? in_len - pos : state->str_remaining;
+
+      /* A string that arrives in one piece is validated in one go, else byte by byte. */
+      bool valid = true;
+      if (state->str_major == 3) {
+        if (state->utf8_state == UTF8_ACCEPT && available == state->str_remaining) {
+          valid = utf8_valid(in + pos, available);
+        } else {
+          valid = validate_utf8(&state->utf8_state, in + pos, available) != UTF8_REJECT;
+        }
+      }
+
+      if (!valid) {
+        err = HSDT_ERR_UTF8;
+      } else {
+        if (state->str_filled + available > sdslen(state->str)) {
+          size_t grown = 2 * sdslen(state->str);
+          if (grown < state->str_filled + available) {
+            grown = state->str_filled + available;
+          }
+          if (grown > state->str_filled + state->str_remaining) {
+            grown = state->str_filled + state->str_remaining;
+          }
+          state->str = sdsgrowzero(state->str, grown); // XXX OOM
+        }
+        memcpy(state->str + state->str_filled, in + pos, available);
+        state->str_filled += available;
+        state->str_remaining -= available;
+        pos += available;
+#ifdef COLLECTION_SIZE_IN_BYTES
+        state->offset += available;
+#endif
+
+        if (state->str_remaining == 0) {
+          if (state->str_major == 3 && state->utf8_state != UTF8_ACCEPT) {
+            err = HSDT_ERR_UTF8;
+          } else {
+            err = stream_string(state);
+          }
+        } else {
+          *consumed = pos;
+          return HSDT_ERR_EOF;
+        }
+      }
+    }
+
+    if (err != HSDT_ERR_NONE) {
+      state->err = err;
+      hsdt_value_free(*state->out);
+      state->out->tag = HSDT_NULL;
+      *consumed = pos;
+      return err;
+    }
+  }
+
+  state->err = HSDT_ERR_NONE;
+  *consumed = pos;
+  return HSDT_ERR_NONE;
+}
+
+/* The decoding stack for views. */
+typedef struct View_Frame {
+  HSDT_View *val;
+  size_t remaining;
+  size_t cap; /* How many entries of a map have been allocated */
+  uint8_t *last_key;
+  size_t last_key_len;
+} View_Frame;
+
+/*
+ * Map entries are allocated as they arrive, since the announced number of
+ * entries has not been checked against the input length.
+ */
+static void view_map_reserve(View_Frame *frame) {
+  HSDT_View_Map *map = &frame->val->map;
+  if (map->len == frame->cap) {
+    frame->cap = frame->cap == 0 ? 4 : 2 * frame->cap;
+    if (frame->cap > map->len + frame->remaining) {
+      frame->cap = map->len + frame->remaining;
+    }
+    map->entries = realloc(map->entries, frame->cap * sizeof(HSDT_View_Entry)); // XXX OOM
+  }
+}
+
+HSDT_ERR hsdt_decode_view(uint8_t *in, size_t in_len, HSDT_View *out, size_t *consumed, size_t max_depth) {
+  View_Frame *frames = NULL;
+  size_t frames_cap = 0;
+  size_t depth = 0;
+  size_t pos = 0;
+  HSDT_View *current = out;
+  HSDT_ERR err;
+  Item item;
+
+  out->tag = HSDT_NULL;
+
+  while (true) {
+    err = read_item(in, in_len, &pos, &item);
+    if (err != HSDT_ERR_NONE) {
+      goto fail;
+    }
+
+    current->tag = item.tag;
+    switch (item.tag) {
+      case HSDT_BYTE_STRING:
+        current->byte_string.ptr = item.str;
+        current->byte_string.len = item.len;
+        break;
+      case HSDT_UTF8_STRING:
+        current->utf8_string.ptr = item.str;
+        current->utf8_string.len = item.len;
+        break;
+      case HSDT_FP:
+        current->fp = item.fp;
+        break;
+      case HSDT_ARRAY:
+      case HSDT_MAP:
+        if (item.tag == HSDT_ARRAY) {
+          current->array.len = 0; /* Counts the initialized entries until the array is complete. */
+          current->array.elems = malloc(item.len * sizeof(HSDT_View)); // XXX OOM
+        } else {
+          current->map.len = 0;
+          current->map.entries = NULL;
+        }
+
+        if (depth == max_depth) {
+          err = HSDT_ERR_DEPTH;
+          goto fail;
+        }
+        if (depth == frames_cap) {
+          frames_cap = frames_cap == 0 ? 16 : 2 * frames_cap;
+          frames = realloc(frames, frames_cap * sizeof(View_Frame)); // XXX OOM
+        }
+
+        frames[depth].val = current;
+        frames[depth].remaining = item.len;
+        frames[depth].cap = 0;
+        frames[depth].last_key = NULL;
+        frames[depth].last_key_len = 0;
+        depth += 1;
+        break;
+      default:
+        break;
+    }
+
+    while (depth > 0 && frames[depth - 1].remaining == 0) {
+      depth -= 1;
+    }
+    if (depth == 0) {
+      break;
+    }
+
+    View_Frame *top = frames + depth - 1;
+    if (top->val->tag == HSDT_ARRAY) {
+      current = top->val->array.elems + top->val->array.len;
+      current->tag = HSDT_NULL;
+      top->val->array.len += 1;
+    } else {
+      uint8_t *key;
+      size_t key_len;
+      err = read_key(in, in_len, &pos, top->last_key, top->last_key_len, &key, &key_len);
+      if (err != HSDT_ERR_NONE) {
+        goto fail;
+      }
+      top->last_key = key;
+      top->last_key_len = key_len;
+
+      view_map_reserve(top);
+      HSDT_View_Entry *entry = top->val->map.entries + top->val->map.len;
+      entry->key.ptr = key;
+      entry->key.len = key_len;
+      current = &entry->val;
+      current->tag = HSDT_NULL;
+      top->val->map.len += 1;
+    }
+    top->remaining -= 1;
+  }
+
+  free(frames);
+  *consumed = pos;
+  return HSDT_ERR_NONE;
+
+  fail:
+    free(frames);
+    hsdt_view_free(*out);
+    out->tag = HSDT_NULL;
+    *consumed = pos;
+    return err;
+}
+
+/* The collections of a view that still need to be freed. */
+typedef struct View_Free_List {
+  HSDT_View *views;
+  size_t len;
+  size_t cap;
+} View_Free_List;
+
+/* Remember `view` for freeing later if it is a collection. */
+static void view_free_list_push(View_Free_List *list, HSDT_View view) {
+  if (view.tag != HSDT_ARRAY && view.tag != HSDT_MAP) {
+    return;
+  }
+  if (list->len == list->cap) {
+    list->cap = list->cap == 0 ? 16 : 2 * list->cap;
+    list->views = realloc(list->views, list->cap * sizeof(HSDT_View)); // XXX OOM
+  }
+  list->views[list->len] = view;
+  list->len += 1;
+}
+
+void hsdt_view_free(HSDT_View view) {
+  /* Remember nested collections instead of recursing into them. */
+  View_Free_List list = {NULL, 0, 0};
+  view_free_list_push(&list, view);
+
+  while (list.len > 0) {
+    list.len -= 1;
+    view = list.views[list.len];
+
+    if (view.tag == HSDT_ARRAY) {
+      for (size_t i = 0; i < view.array.len; i++) {
+        view_free_list_push(&list, view.array.elems[i]);
+      }
+      free(view.array.elems);
+    } else {
+      for (size_t i = 0; i < view.map.len; i++) {
+        view_free_list_push(&list, view.map.entries[i].val);
+      }
+      free(view.map.entries);
+    }
+  }
+
+  free(list.views);
+}
+
+HSDT_View *hsdt_view_map_get(HSDT_View_Map map, uint8_t *key, size_t key_len) {
+  size_t lo = 0;
+  size_t hi = map.len;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    HSDT_View_Str mid_key = map.entries[mid].key;
+
+    if (is_lexicographically_greater(key, key_len, mid_key.ptr, mid_key.len)) {
+      lo = mid + 1;
+    } else if (is_lexicographically_greater(mid_key.ptr, mid_key.len, key, key_len)) {
+      hi = mid;
+    } else {
+      return &map.entries[mid].val;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Copy a scalar of a view into `val`, or initialize `val` as a collection
+ * with room for all entries of the view, which the caller copies afterwards.
+ */
+static void view_item_to_value(HSDT_View *view, HSDT_Value *val) {
+  val->tag = view->tag;
+
+  switch (view->tag) {
+    case HSDT_BYTE_STRING:
+    case HSDT_UTF8_STRING:
+      str_init(val, view->tag, view->byte_string.ptr, view->byte_string.len, &default_dec_options);
+      break;
+    case HSDT_FP:
+      val->fp = view->fp;
+      break;
+    case HSDT_ARRAY:
+      val->array.len = view->array.len;
+      val->array.elems = hsdt_malloc(view->array.len * sizeof(HSDT_Value)); // XXX OOM
+      break;
+    case HSDT_MAP:
+      map_init(val, view->map.len, &default_dec_options);
+      break;
+    default:
+      break;
+  }
+}
+
+/* Return the number of entries of an array or map of a view. */
+static size_t view_len(HSDT_View *view) {
+  return view->tag == HSDT_ARRAY ? view->array.len : view->map.len;
+}
+
+/* A collection of a view whose entries are being copied by `hsdt_view_to_value`. */
+typedef struct View_Copy_Frame {
+  HSDT_View *view;
+  HSDT_Value *val;
+  size_t next; /* The index of the next entry to copy */
+} View_Copy_Frame;
+
+HSDT_Value hsdt_view_to_value(HSDT_View view) {
+  View_Copy_Frame *frames = NULL;
+  size_t frames_cap = 0;
+  size_t depth = 0;
+  HSDT_Value out;
+  HSDT_View *src = &view; /* The item that was copied last */
+  HSDT_Value *dst = &out;
+
+  while (true) {
+    view_item_to_value(src, dst);
+
+    if (src->tag == HSDT_ARRAY || src->tag == HSDT_MAP) {
+      if (depth == frames_cap) {
+        frames_cap = frames_cap == 0 ? 16 : 2 * frames_cap;
+        frames = realloc(frames, frames_cap * sizeof(View_Copy_Frame)); // XXX OOM
+      }
+      frames[depth].view = src;
+      frames[depth].val = dst;
+      frames[depth].next = 0;
+      depth += 1;
+    }
+
+    /* Leave all completed collections, then find the next entry to copy. */
+    while (depth > 0 && frames[depth - 1].next == view_len(frames[depth - 1].view)) {
+      depth -= 1;
+    }
+    if (depth == 0) {
+      break;
+    }
+
+    View_Copy_Frame *top = frames + depth - 1;
+    if (top->view->tag == HSDT_ARRAY) {
+      src = top->view->array.elems + top->next;
+      dst = top->val->array.elems + top->next;
+    } else {
+      HSDT_View_Entry *entry = top->view->map.entries + top->next;
+      src = &entry->val;
+      dst = map_append(top->val, entry->key.ptr, entry->key.len, &default_dec_options);
+    }
+    top->next += 1;
+  }
+
+  free(frames);
+  return out;
+}
+
+void hsdt_tape_init(HSDT_Tape *tape) {
+  tape->entries = NULL;
+  tape->len = 0;
+  tape->cap = 0;
+  tape->strings = NULL;
+  tape->strings_len = 0;
+  tape->strings_cap = 0;
+}
+
+void hsdt_tape_free(HSDT_Tape *tape) {
+  free(tape->entries);
+  free(tape->strings);
+  hsdt_tape_init(tape);
+}
+
+/* Append an entry to the tape and return it. */
+static HSDT_Tape_Entry *tape_push(HSDT_Tape *tape) {
+  if (tape->len == tape->cap) {
+    tape->cap = tape->cap == 0 ? 64 : 2 * tape->cap;
+    tape->entries = realloc(tape->entries, tape->cap * sizeof(HSDT_Tape_Entry)); // XXX OOM
+  }
+  tape->len += 1;
+  return tape->entries + tape->len - 1;
+}
+
+/* Append a string entry, copying its content into the string arena. */
+static void tape_push_str(HSDT_Tape *tape, uint8_t *str, size_t len) {
+  if (tape->strings_cap - tape->strings_len < len) {
+    tape->strings_cap = 2 * tape->strings_cap < tape->strings_len + len ? tape->strings_len + len : 2 * tape->strings_cap;
+    tape->strings = realloc(tape->strings, tape->strings_cap); // XXX OOM
+  }
+
+  HSDT_Tape_Entry *entry = tape_push(tape);
+  entry->tag = HSDT_UTF8_STRING;
+  entry->len = len;
+  entry->str = tape->strings_len;
+  if (len > 0) {
+    memcpy(tape->strings + tape->strings_len, str, len);
+  }
+  tape->strings_len += len;
+}
+
+/* The decoding stack for tapes. */
+typedef struct Tape_Frame {
+  size_t index; /* Where the collection is on the tape */
+  uint64_t remaining;
+  bool is_map;
+  uint8_t *last_key;
+  size_t last_key_len;
+} Tape_Frame;
+
+HSDT_ERR hsdt_decode_tape(HSDT_Tape *tape, uint8_t *in, size_t in_len, size_t *consumed, size_t max_depth) {
+  Tape_Frame *frames = NULL;
+  size_t frames_cap = 0;
+  size_t depth = 0;
+  size_t pos = 0;
+  HSDT_ERR err;
+  Item item;
+
+  tape->len = 0;
+  tape->strings_len = 0;
+
+  while (true) {
+    err = read_item(in, in_len, &pos, &item);
+    if (err != HSDT_ERR_NONE) {
+      goto fail;
+    }
+
+    if (item.tag == HSDT_BYTE_STRING || item.tag == HSDT_UTF8_STRING) {
+      tape_push_str(tape, item.str, item.len);
+      tape->entries[tape->len - 1].tag = item.tag;
+    } else {
+      HSDT_Tape_Entry *entry = tape_push(tape);
+      entry->tag = item.tag;
+      entry->len = 0;
+
+      if (item.tag == HSDT_FP) {
+        entry->fp = item.fp;
+      } else if (item.tag == HSDT_ARRAY || item.tag == HSDT_MAP) {
+        entry->len = item.len;
+        entry->end = tape->len;
+
+        if (depth == max_depth) {
+          err = HSDT_ERR_DEPTH;
+          goto fail;
+        }
+        if (depth == frames_cap) {
+          frames_cap = frames_cap == 0 ? 16 : 2 * frames_cap;
+          frames = realloc(frames, frames_cap * sizeof(Tape_Frame)); // XXX OOM
+        }
+
+        frames[depth].index = tape->len - 1;
+        frames[depth].remaining = item.len;
+        frames[depth].is_map = item.tag == HSDT_MAP;
+        frames[depth].last_key = NULL;
+        frames[depth].last_key_len = 0;
+        depth += 1;
+      }
+    }
+
+    /* Close all completed collections, now that their end is known. */
+    while (depth > 0 && frames[depth - 1].remaining == 0) {
+      depth -= 1;
+      tape->entries[frames[depth].index].end = tape->len;
+    }
+    if (depth == 0) {
+      break;
+    }
+
+    Tape_Frame *top = frames + depth - 1;
+    top->remaining -= 1;
+    if (top->is_map) {
+      uint8_t *key;
+      size_t key_len;
+      err = read_key(in, in_len, &pos, top->last_key, top->last_key_len, &key, &key_len);
+      if (err != HSDT_ERR_NONE) {
+        goto fail;
+      }
+      top->last_key = key;
+      top->last_key_len = key_len;
+      tape_push_str(tape, key, key_len);
+    }
+  }
+
+  free(frames);
+  *consumed = pos;
+  return HSDT_ERR_NONE;
+
+  fail:
+    free(frames);
+    tape->len = 0;
+    tape->strings_len = 0;
+    *consumed = pos;
+    return err;
+}
+
+size_t hsdt_tape_skip(const HSDT_Tape *tape, size_t i) {
+  HSDT_Tape_Entry *entry = tape->entries + i;
+  if (entry->tag == HSDT_ARRAY || entry->tag == HSDT_MAP) {
+    return entry->end;
+  } else {
+    return i + 1;
+  }
+}
+
+uint8_t *hsdt_tape_str(const HSDT_Tape *tape, size_t i) {
+  return tape->strings + tape->entries[i].str;
+}
+
+size_t hsdt_tape_array_get(const HSDT_Tape *tape, size_t array, size_t n) {
+  if (n >= tape->entries[array].len) {
+    return SIZE_MAX;
+  }
+
+  size_t i = array + 1;
+  for (size_t j = 0; j < n; j++) {
+    i = hsdt_tape_skip(tape, i);
+  }
+  return i;
+}
+
+size_t hsdt_tape_map_get(const HSDT_Tape *tape, size_t map, uint8_t *key, size_t key_len) {
+  size_t end = tape->entries[map].end;
+  size_t i = map + 1;
+
+  while (i < end) {
+    HSDT_Tape_Entry *entry = tape->entries + i;
+    uint8_t *entry_key = hsdt_tape_str(tape, i);
+
+    if (is_lexicographically_greater(entry_key, entry->len, key, key_len)) {
+      return SIZE_MAX; /* Keys are sorted, so all following keys are greater as well. */
+    } else if (entry->len == key_len && (key_len == 0 || memcmp(entry_key, key, key_len) == 0)) {
+      return i + 1;
+    }
+    i = hsdt_tape_skip(tape, i + 1);
+  }
+
+  return SIZE_MAX;
+}
+
+/*
+ * Copy the scalar at index `i` of the tape into `val`, or initialize `val` as
+ * a collection with room for all its entries, which the caller copies
+ * afterwards.
+ */
+static void tape_item_to_value(const HSDT_Tape *tape, size_t i, HSDT_Value *val) {
+  HSDT_Tape_Entry *entry = tape->entries + i;
+  val->tag = entry->tag;
+
+  switch (entry->tag) {
+    case HSDT_BYTE_STRING:
+    case HSDT_UTF8_STRING:
+      str_init(val, entry->tag, hsdt_tape_str(tape, i), entry->len, &default_dec_options);
+      break;
+    case HSDT_FP:
+      val->fp = entry->fp;
+      break;
+    case HSDT_ARRAY:
+      val->array.len = entry->len;
+      val->array.elems = hsdt_malloc(entry->len * sizeof(HSDT_Value)); // XXX OOM
+      break;
+    case HSDT_MAP:
+      map_init(val, entry->len, &default_dec_options);
+      break;
+    default:
+      break;
+  }
+}
+
+/* A collection whose entries are being copied by `hsdt_tape_to_value`. */
+typedef struct Tape_Copy_Frame {
+  HSDT_Value *val;
+  size_t next; /* The index of the next entry to copy */
+  size_t len;
+} Tape_Copy_Frame;
+
+HSDT_Value hsdt_tape_to_value(const HSDT_Tape *tape, size_t i) {
+  Tape_Copy_Frame *frames = NULL;
+  size_t frames_cap = 0;
+  size_t depth = 0;
+  HSDT_Value out;
+  HSDT_Value *dst = &out;
+
+  /* The tape is in the order of the encoding, so it is read front to back. */
+  while (true) {
+    tape_item_to_value(tape, i, dst);
+
+    if (dst->tag == HSDT_ARRAY || dst->tag == HSDT_MAP || dst->tag == HSDT_SORTED_MAP) {
+      if (depth == frames_cap) {
+        frames_cap = frames_cap == 0 ? 16 : 2 * frames_cap;
+        frames = realloc(frames, frames_cap * sizeof(Tape_Copy_Frame)); // XXX OOM
+      }
+      frames[depth].val = dst;
+      frames[depth].next = 0;
+      frames[depth].len = tape->entries[i].len;
+      depth += 1;
+    }
+    i += 1;
+
+    /* Leave all completed collections, then find the next entry to copy. */
+    while (depth > 0 && frames[depth - 1].next == frames[depth - 1].len) {
+      depth -= 1;
+    }
+    if (depth == 0) {
+      break;
+    }
+
+    Tape_Copy_Frame *top = frames + depth - 1;
+    if (top->val->tag == HSDT_ARRAY) {
+      dst = top->val->array.elems + top->next;
+    } else {
+      dst = map_append(top->val, hsdt_tape_str(tape, i), tape->entries[i].len, &default_dec_options);
+      i += 1;
+    }
+    top->next += 1;
+  }
+
+  free(frames);
+  return out;
+}
+
+/* Report `item` to the callbacks. Return false if parsing should stop. */
+static bool parse_emit(const HSDT_Callbacks *cb, void *ctx, Item *item) {
+  switch (item->tag) {
+    case HSDT_NULL:
+      return cb->null == NULL || cb->null(ctx);
+    case HSDT_TRUE:
+      return cb->boolean == NULL || cb->boolean(ctx, true);
+    case HSDT_FALSE:
+      return cb->boolean == NULL || cb->boolean(ctx, false);
+    case HSDT_BYTE_STRING:
+      return cb->byte_string == NULL || cb->byte_string(ctx, item->str, item->len);
+    case HSDT_UTF8_STRING:
+      return cb->utf8_string == NULL || cb->utf8_string(ctx, item->str, item->len);
+    case HSDT_FP:
+      return cb->fp == NULL || cb->fp(ctx, item->fp);
+    case HSDT_ARRAY:
+      return cb->start_array == NULL || cb->start_array(ctx, item->len);
+    case HSDT_MAP:
+      return cb->start_map == NULL || cb->start_map(ctx, item->len);
+    default:
+      return true; /* unreachable if tags are valid */
+  }
+}
+
+HSDT_ERR hsdt_parse(uint8_t *in, size_t in_len, const HSDT_Callbacks *callbacks, void *ctx, size_t *consumed, HSDT_Parse_Frame *stack, size_t max_depth) {
+  HSDT_Parse_Frame *frames = stack;
+  size_t frames_cap = stack == NULL ? 0 : max_depth;
+  size_t depth = 0;
+  size_t pos = 0;
+  HSDT_ERR err = HSDT_ERR_NONE;
+  Item item;
+
+  while (true) {
+    err = read_item(in, in_len, &pos, &item);
+    if (err != HSDT_ERR_NONE) {
+      break;
+    }
+
+    if (item.tag == HSDT_ARRAY || item.tag == HSDT_MAP) {
+      if (depth == max_depth) {
+        err = HSDT_ERR_DEPTH;
+        break;
+      }
+      if (depth == frames_cap) {
+        frames_cap = frames_cap == 0 ? 16 : 2 * frames_cap;
+        if (frames_cap > max_depth) {
+          frames_cap = max_depth;
+        }
+        frames = realloc(frames, frames_cap * sizeof(HSDT_Parse_Frame)); // XXX OOM
+      }
+
+      frames[depth].remaining = item.len;
+      frames[depth].is_map = item.tag == HSDT_MAP;
+      frames[depth].last_key = NULL;
+      frames[depth].last_key_len = 0;
+      depth += 1;
+    }
+
+    if (!parse_emit(callbacks, ctx, &item)) {
+      err = HSDT_ERR_ABORTED;
+      break;
+    }
+
+    while (depth > 0 && frames[depth - 1].remaining == 0) {
+      depth -= 1;
+      if (callbacks->end != NULL && !callbacks->end(ctx)) {
+        err = HSDT_ERR_ABORTED;
+        goto done;
+      }
+    }
+    if (depth == 0) {
+      break;
+    }
+
+    HSDT_Parse_Frame *top = frames + depth - 1;
+    top->remaining -= 1;
+    if (top->is_map) {
+      uint8_t *key;
+      size_t key_len;
+      err = read_key(in, in_len, &pos, top->last_key, top->last_key_len, &key, &key_len);
+      if (err != HSDT_ERR_NONE) {
+        break;
+      }
+      top->last_key = key;
+      top->last_key_len = key_len;
+
+      if (callbacks->key != NULL && !callbacks->key(ctx, key, key_len)) {
+        err = HSDT_ERR_ABORTED;
+        break;
+      }
+    }
+  }
+
+  done:
+    if (stack == NULL) {
+      free(frames);
+    }
+    *consumed = pos;
+    return err;
+}
+
+/* The stack of `hsdt_validate`. Arrays are marked by a `last_key_len` of SIZE_MAX. */
+typedef struct Validate_Frame {
+  uint64_t remaining;
+  uint8_t *last_key;
+  size_t last_key_len;
+} Validate_Frame;
+
+/*
+ * Validate the value starting at `in[*pos]` like `hsdt_validate`, with at most
+ * `max_depth` nested collections, and advance `*pos` to where validation
+ * stopped.
+ */
+static HSDT_ERR validate_value(uint8_t *in, size_t in_len, size_t *pos_out, size_t max_depth) {
+  Validate_Frame *frames = NULL;
+  size_t frames_cap = 0;
+  size_t depth = 0;
+  size_t pos = *pos_out;
+  HSDT_ERR err = HSDT_ERR_NONE;
+  Item item;
+
+  while (true) {
+    /* Primitives are common enough to skip the general item reading. */
+    if (pos < in_len && (in[pos] == 0xF4 || in[pos] == 0xF5 || in[pos] == 0xF6)) {
+      pos += 1;
+    } else {
+      err = read_item(in, in_len, &pos, &item);
+      if (err != HSDT_ERR_NONE) {
+        break;
+      }
+
+      if (item.tag == HSDT_ARRAY || item.tag == HSDT_MAP) {
+        if (depth == max_depth) {
+          err = HSDT_ERR_DEPTH;
+          break;
+        }
+        if (depth == frames_cap) {
+          frames_cap = frames_cap == 0 ? 16 : 2 * frames_cap;
+          if (frames_cap > max_depth) {
+            frames_cap = max_depth;
+          }
+          frames = realloc(frames, frames_cap * sizeof(Validate_Frame)); // XXX OOM
+        }
+        frames[depth].remaining = item.len;
+        frames[depth].last_key = NULL;
+        frames[depth].last_key_len = item.tag == HSDT_MAP ? 0 : SIZE_MAX;
+        depth += 1;
+      }
+    }
+
+    while (depth > 0 && frames[depth - 1].remaining == 0) {
+      depth -= 1;
+    }
+    if (depth == 0) {
+      break;
+    }
+
+    Validate_Frame *top = frames + depth - 1;
+    top->remaining -= 1;
+    if (top->last_key_len != SIZE_MAX) {
+      err = read_key(in, in_len, &pos, top->last_key, top->last_key_len, &top->last_key, &top->last_key_len);
+      if (err != HSDT_ERR_NONE) {
+        break;
+      }
+    }
+  }
+
+  free(frames);
+  *pos_out = pos;
+  return err;
+}
+
+HSDT_ERR hsdt_validate(uint8_t *in, size_t in_len, size_t *consumed) {
+  *consumed = 0;
+  return validate_value(in, in_len, consumed, HSDT_DEFAULT_MAX_DEPTH);
+}
+
+void hsdt_cursor_init(HSDT_Cursor *cur, uint8_t *in, size_t in_len) {
+  cur->in = in;
+  cur->in_len = in_len;
+  cur->pos = 0;
+  cur->remaining = 1;
+  cur->in_map = false;
+  cur->key = NULL;
+  cur->key_len = 0;
+}
+
+HSDT_ERR hsdt_cursor_read(const HSDT_Cursor *cur, HSDT_Cursor_Item *item) {
+  if (cur->remaining == 0) {
+    return HSDT_ERR_EOF;
+  }
+
+  size_t pos = cur->pos;
+  Item read;
+  HSDT_ERR err = read_item(cur->in, cur->in_len, &pos, &read);
+  if (err != HSDT_ERR_NONE) {
+    return err;
+  }
+
+  item->tag = read.tag;
+  switch (read.tag) {
+    case HSDT_FP:
+      item->fp = read.fp;
+      break;
+    case HSDT_BYTE_STRING:
+    case HSDT_UTF8_STRING:
+      item->str.ptr = read.str;
+      item->str.len = read.len;
+      break;
+    case HSDT_ARRAY:
+    case HSDT_MAP:
+      item->len = read.len;
+      break;
+    default:
+      break;
+  }
+  return HSDT_ERR_NONE;
+}
+
+HSDT_ERR hsdt_cursor_encoding(const HSDT_Cursor *cur, uint8_t **enc, size_t *enc_len) {
+  if (cur->remaining == 0) {
+    return HSDT_ERR_EOF;
+  }
+
+  size_t pos = cur->pos;
+  HSDT_ERR err = skip_value(cur->in, cur->in_len, &pos);
+  if (err != HSDT_ERR_NONE) {
+    return err;
+  }
+  *enc = cur->in + cur->pos;
+  *enc_len = pos - cur->pos;
+  return HSDT_ERR_NONE;
+}
+
+HSDT_ERR hsdt_cursor_enter(HSDT_Cursor *cur) {
+  if (cur->remaining == 0) {
+    return HSDT_ERR_EOF;
+  }
+
+  size_t pos = cur->pos;
+  Item item;
+  HSDT_ERR err = read_item(cur->in, cur->in_len, &pos, &item);
+  if (err != HSDT_ERR_NONE) {
+    return err;
+  }
+
+  uint8_t *key = NULL;
+  size_t key_len = 0;
+  bool is_map = item.tag == HSDT_MAP;
+  uint64_t entries = (is_map || item.tag == HSDT_ARRAY) ? item.len : 0;
+  if (is_map && entries > 0) {
+    err = read_key(cur->in, cur->in_len, &pos, NULL, 0, &key, &key_len);
+    if (err != HSDT_ERR_NONE) {
+      return err;
+    }
+  }
+
+  cur->pos = pos;
+  cur->remaining = entries;
+  cur->in_map = is_map;
+  cur->key = key;
+  cur->key_len = key_len;
+  return HSDT_ERR_NONE;
+}
+
+/* Move to the next entry, given that the current value ends at offset `end`. On error, the cursor does not move. */
+static HSDT_ERR cursor_advance(HSDT_Cursor *cur, size_t end) {
+  if (cur->in_map && cur->remaining > 1) {
+    uint8_t *key;
+    size_t key_len;
+    HSDT_ERR err = read_key(cur->in, cur->in_len, &end, cur->key, cur->key_len, &key, &key_len);
+    if (err != HSDT_ERR_NONE) {
+      return err;
+    }
+    cur->key = key;
+    cur->key_len = key_len;
+  }
+
+  cur->pos = end;
+  cur->remaining -= 1;
+  return HSDT_ERR_NONE;
+}
+
+HSDT_ERR hsdt_cursor_next(HSDT_Cursor *cur) {
+  if (cur->remaining == 0) {
+    return HSDT_ERR_EOF;
+  }
+
+  size_t end = cur->pos;
+  HSDT_ERR err = skip_value(cur->in, cur->in_len, &end);
+  if (err != HSDT_ERR_NONE) {
+    return err;
+  }
+  return cursor_advance(cur, end);
+}
+
+HSDT_ERR hsdt_cursor_find(HSDT_Cursor *cur, uint8_t *key, size_t key_len, bool *found) {
+  HSDT_Cursor entry = *cur;
+  HSDT_ERR err = hsdt_cursor_enter(&entry);
+  *found = false;
+  if (err != HSDT_ERR_NONE || !entry.in_map) {
+    return err;
+  }
+
+  while (entry.remaining > 0 && is_lexicographically_greater(key, key_len, entry.key, entry.key_len)) {
+    err = hsdt_cursor_next(&entry);
+    if (err != HSDT_ERR_NONE) {
+      return err;
+    }
+  }
+
+  if (entry.remaining > 0 && !is_lexicographically_greater(entry.key, entry.key_len, key, key_len)) {
+    *cur = entry;
+    *found = true;
+  }
+  return HSDT_ERR_NONE;
+}
+
+HSDT_ERR hsdt_cursor_index(HSDT_Cursor *cur, size_t n, bool *found) {
+  HSDT_Cursor entry = *cur;
+  HSDT_ERR err = hsdt_cursor_enter(&entry);
+  *found = false;
+  if (err != HSDT_ERR_NONE || entry.in_map || entry.remaining <= n) {
+    return err;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    err = hsdt_cursor_next(&entry);
+    if (err != HSDT_ERR_NONE) {
+      return err;
+    }
+  }
+
+  *cur = entry;
+  *found = true;
+  return HSDT_ERR_NONE;
+}
+
+bool hsdt_path_compile(HSDT_Path *path, const char *expr) {
+  size_t expr_len = strlen(expr);
+  size_t cap = 1;
+  for (size_t i = 0; i < expr_len; i++) {
+    cap += expr[i] == '.' || expr[i] == '[';
+  }
+
+  path->len = 0;
+  path->steps = malloc(cap * sizeof(HSDT_Path_Step)); // XXX OOM
+  path->keys = malloc(expr_len + 1); // XXX OOM
+  memcpy(path->keys, expr, expr_len);
+
+  size_t i = 0;
+  while (i < expr_len) {
+    HSDT_Path_Step *step = path->steps + path->len;
+    if (expr[i] == '[') {
+      size_t start = i + 1;
+      size_t index = 0;
+      for (i = start; i < expr_len && expr[i] >= '0' && expr[i] <= '9'; i++) {
+        size_t digit = expr[i] - '0';
+        if (index > (SIZE_MAX - digit) / 10) {
+          goto fail;
+        }
+        index = 10 * index + digit;
+      }
+      if (i == start || i == expr_len || expr[i] != ']') {
+        goto fail;
+      }
+      i += 1;
+
+      step->key = NULL;
+      step->key_len = 0;
+      step->index = index;
+    } else {
+      if (path->len > 0) {
+        if (expr[i] != '.') {
+          goto fail;
+        }
+        i += 1;
+      }
+      size_t start = i;
+      while (i < expr_len && expr[i] != '.' && expr[i] != '[') {
+        i += 1;
+      }
+      if (i == start) {
+        goto fail;
+      }
+
+      step->key = path->keys + start;
+      step->key_len = i - start;
+      step->index = 0;
+    }
+    path->len += 1;
+  }
+  return true;
+
+  fail:
+    hsdt_path_free(path);
+    return false;
+}
+
+void hsdt_path_free(HSDT_Path *path) {
+  free(path->steps);
+  free(path->keys);
+  path->len = 0;
+  path->steps = NULL;
+  path->keys = NULL;
+}
+
+HSDT_ERR hsdt_path_query(const HSDT_Path *path, HSDT_Cursor *cur, bool *found) {
+  HSDT_Cursor target = *cur;
+  *found = true;
+
+  for (size_t i = 0; i < path->len && *found; i++) {
+    HSDT_Path_Step *step = path->steps + i;
+    HSDT_ERR err;
+    if (step->key == NULL) {
+      err = hsdt_cursor_index(&target, step->index, found);
+    } else {
+      err = hsdt_cursor_find(&target, step->key, step->key_len, found);
+    }
+    if (err != HSDT_ERR_NONE) {
+      *found = false;
+      return err;
+    }
+  }
+
+  if (*found) {
+    *cur = target;
+  }
+  return HSDT_ERR_NONE;
+}
+
+/* Orders paths by their steps, key steps before index steps, and prefixes before their extensions. */
+typedef struct Sorted_Path {
+  const HSDT_Path *path;
+  size_t i;
+} Sorted_Path;
+
+static int step_cmp(const HSDT_Path_Step *a, const HSDT_Path_Step *b) {
+  if (a->key != NULL && b->key != NULL) {
+    if (is_lexicographically_greater(a->key, a->key_len, b->key, b->key_len)) {
+      return 1;
+    }
+    return is_lexicographically_greater(b->key, b->key_len, a->key, a->key_len) ? -1 : 0;
+  } else if (a->key == NULL && b->key == NULL) {
+    return a->index > b->index ? 1 : (a->index < b->index ? -1 : 0);
+  } else {
+    return a->key == NULL ? 1 : -1;
+  }
+}
+
+static int sorted_path_cmp(const void *a_, const void *b_) {
+  const HSDT_Path *a = ((const Sorted_Path *) a_)->path;
+  const HSDT_Path *b = ((const Sorted_Path *) b_)->path;
+  for (size_t i = 0; i < a->len && i < b->len; i++) {
+    int cmp = step_cmp(a->steps + i, b->steps + i);
+    if (cmp != 0) {
+      return cmp;
+    }
+  }
+  return a->len > b->len ? 1 : (a->len < b->len ? -1 : 0);
+}
+
+/*
+ * Add the node for the paths in `sorted[0..len)`, which all share their first
+ * `depth` steps, and return its index. The recursion is bounded by the length
+ * of the longest path.
+ */
+static size_t path_set_build(HSDT_Path_Set *set, Sorted_Path *sorted, size_t len, size_t depth, size_t *nodes_len, size_t *edges_len) {
+  size_t node = *nodes_len;
+  *nodes_len += 1;
+
+  /* The paths that end here come first. */
+  size_t ending = 0;
+  set->nodes[node].first_path = SIZE_MAX;
+  while (ending < len && sorted[ending].path->len == depth) {
+    set->next_path[sorted[ending].i] = set->nodes[node].first_path;
+    set->nodes[node].first_path = sorted[ending].i;
+    ending += 1;
+  }
+
+  /* One edge per distinct next step, the edges of a node are contiguous. */
+  size_t edges = *edges_len;
+  set->nodes[node].edges = edges;
+  set->nodes[node].key_edges = 0;
+  set->nodes[node].index_edges = 0;
+  for (size_t i = ending; i < len; i++) {
+    const HSDT_Path_Step *step = sorted[i].path->steps + depth;
+    if (i == ending || step_cmp(step, sorted[i - 1].path->steps + depth) != 0) {
+      set->edges[*edges_len].step = *step;
+      *edges_len += 1;
+      if (step->key == NULL) {
+        set->nodes[node].index_edges += 1;
+      } else {
+        set->nodes[node].key_edges += 1;
+      }
+    }
+  }
+
+  size_t edges_end = *edges_len;
+  size_t start = ending;
+  for (size_t e = edges; e < edges_end; e++) {
+    size_t end = start;
+    while (end < len && step_cmp(&set->edges[e].step, sorted[end].path->steps + depth) == 0) {
+      end += 1;
+    }
+    size_t child = path_set_build(set, sorted + start, end - start, depth + 1, nodes_len, edges_len);
+    set->edges[e].child = child;
+    start = end;
+  }
+  return node;
+}
+
+bool hsdt_path_set_compile(HSDT_Path_Set *set, const char **exprs, size_t len) {
+  set->len = 0;
+  set->paths = malloc((len + 1) * sizeof(HSDT_Path)); // XXX OOM
+  set->next_path = NULL;
+  set->nodes = NULL;
+  set->edges = NULL;
+  size_t steps = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (!hsdt_path_compile(set->paths + i, exprs[i])) {
+      hsdt_path_set_free(set);
+      return false;
+    }
+    set->len += 1;
+    steps += set->paths[i].len;
+  }
+
+  Sorted_Path *sorted = malloc((len + 1) * sizeof(Sorted_Path)); // XXX OOM
+  for (size_t i = 0; i < len; i++) {
+    sorted[i].path = set->paths + i;
+    sorted[i].i = i;
+  }
+  qsort(sorted, len, sizeof(Sorted_Path), sorted_path_cmp);
+
+  set->next_path = malloc((len + 1) * sizeof(size_t)); // XXX OOM
+  set->nodes = malloc((steps + 1) * sizeof(HSDT_Path_Node)); // XXX OOM
+  set->edges = malloc((steps + 1) * sizeof(HSDT_Path_Edge)); // XXX OOM
+  size_t nodes_len = 0;
+  size_t edges_len = 0;
+  path_set_build(set, sorted, len, 0, &nodes_len, &edges_len);
+  free(sorted);
+  return true;
+}
+
+void hsdt_path_set_free(HSDT_Path_Set *set) {
+  for (size_t i = 0; i < set->len; i++) {
+    hsdt_path_free(set->paths + i);
+  }
+  free(set->paths);
+  free(set->next_path);
+  free(set->nodes);
+  free(set->edges);
+  set->len = 0;
+  set->paths = NULL;
+  set->next_path = NULL;
+  set->nodes = NULL;
+  set->edges = NULL;
+}
+
+/*
+ * Extract the paths below `node` from the current value of `cur`. If `need_end`
+ * is set, `end` is set to the offset right after the value. Else, this stops
+ * as soon as no path below `node` can match anymore, and `end` is not set.
+ * The recursion is bounded by the length of the longest path.
+ */
+static HSDT_ERR path_set_extract(const HSDT_Path_Set *set, size_t node, const HSDT_Cursor *cur, HSDT_Cursor *results, bool *found, bool need_end, size_t *end) {
+  const HSDT_Path_Node *n = set->nodes + node;
+  for (size_t p = n->first_path; p != SIZE_MAX; p = set->next_path[p]) {
+    results[p] = *cur;
+    found[p] = true;
+  }
+
+  if (n->key_edges + n->index_edges == 0) {
+    if (need_end) {
+      *end = cur->pos;
+      return skip_value(cur->in, cur->in_len, end);
+    }
+    return HSDT_ERR_NONE;
+  }
+
+  HSDT_Cursor entry = *cur;
+  HSDT_ERR err = hsdt_cursor_enter(&entry);
+  if (err != HSDT_ERR_NONE) {
+    return err;
+  }
+
+  /* Walk the entries and the edges for their type side by side, both are sorted. */
+  size_t e = n->edges;
+  size_t e_end = n->edges + n->key_edges;
+  if (!entry.in_map) {
+    e = e_end;
+    e_end += n->index_edges;
+  }
+  size_t index = 0;
+
+  while (entry.remaining > 0 && (e < e_end || need_end)) {
+    bool match = false;
+    if (entry.in_map) {
+      while (e < e_end && is_lexicographically_greater(entry.key, entry.key_len, set->edges[e].step.key, set->edges[e].step.key_len)) {
+        e += 1;
+      }
+      match = e < e_end && !is_lexicographically_greater(set->edges[e].step.key, set->edges[e].step.key_len, entry.key, entry.key_len);
+    } else {
+      match = e < e_end && set->edges[e].step.index == index;
+    }
+
+    size_t value_end = entry.pos;
+    if (match) {
+      e += 1;
+      err = path_set_extract(set, set->edges[e - 1].child, &entry, results, found, need_end || e < e_end, &value_end);
+      if (err != HSDT_ERR_NONE || (!need_end && e == e_end)) {
+        return err;
+      }
+    } else {
+      err = skip_value(entry.in, entry.in_len, &value_end);
+      if (err != HSDT_ERR_NONE) {
+        return err;
+      }
+    }
+
+    err = cursor_advance(&entry, value_end);
+    if (err != HSDT_ERR_NONE) {
+      return err;
+    }
+    index += 1;
+  }
+
+  if (need_end) {
+    *end = entry.pos;
+  }
+  return HSDT_ERR_NONE;
+}
+
+HSDT_ERR hsdt_path_set_extract(const HSDT_Path_Set *set, const HSDT_Cursor *cur, HSDT_Cursor *results, bool *found) {
+  for (size_t i = 0; i < set->len; i++) {
+    found[i] = false;
+  }
+  if (cur->remaining == 0) {
+    return HSDT_ERR_EOF;
+  }
+
+  size_t end;
+  return path_set_extract(set, 0, cur, results, found, false, &end);
+}
+
+void hsdt_index_init(HSDT_Index *index) {
+  index->collections = NULL;
+  index->collections_len = 0;
+  index->collections_cap = 0;
+  index->offsets = NULL;
+  index->offsets_len = 0;
+  index->offsets_cap = 0;
+}
+
+void hsdt_index_free(HSDT_Index *index) {
+  free(index->collections);
+  free(index->offsets);
+  hsdt_index_init(index);
+}
+
+/* Make room for `collections` more collections and `offsets` more offsets. */
+static void index_reserve(HSDT_Index *index, size_t collections, size_t offsets) {
+  if (index->collections_cap - index->collections_len < collections) {
+    index->collections_cap = 2 * index->collections_cap < index->collections_len + collections ? index->collections_len + collections : 2 * index->collections_cap;
+    index->collections = realloc(index->collections, index->collections_cap * sizeof(HSDT_Index_Collection)); // XXX OOM
+  }
+  if (index->offsets_cap - index->offsets_len < offsets) {
+    index->offsets_cap = 2 * index->offsets_cap < index->offsets_len + offsets ? index->offsets_len + offsets : 2 * index->offsets_cap;
+    index->offsets = realloc(index->offsets, index->offsets_cap * sizeof(uint64_t)); // XXX OOM
+  }
+}
+
+/* The stack of `hsdt_index_build`. */
+typedef struct Index_Frame {
+  uint64_t remaining;
+  size_t next; /* Where to store the offset of the next entry, SIZE_MAX if the collection is not indexed */
+  bool is_map;
+  uint8_t *last_key;
+  size_t last_key_len;
+} Index_Frame;
+
+HSDT_ERR hsdt_index_build(HSDT_Index *index, uint8_t *in, size_t in_len, size_t min_len, size_t *consumed) {
+  Index_Frame *frames = NULL;
+  size_t frames_cap = 0;
+  size_t depth = 0;
+  size_t pos = 0;
+  HSDT_ERR err = HSDT_ERR_NONE;
+
+  index->collections_len = 0;
+  index->offsets_len = 0;
+
+  while (true) {
+    if (pos == in_len) {
+      err = HSDT_ERR_EOF;
+      break;
+    } else if (in[pos] == 0xF4 || in[pos] == 0xF5 || in[pos] == 0xF6) {
+      pos += 1;
+    } else if (in[pos] == 0xFB) {
+      if (in_len - pos < 9) {
+        err = HSDT_ERR_EOF;
+        break;
+      }
+      pos += 9;
+    } else {
+      size_t start = pos;
+      uint8_t major;
+      uint8_t additional;
+      uint64_t val;
+      err = tag_and_val(in + pos, in_len - pos, &pos, &major, &additional, &val);
+      if (err != HSDT_ERR_NONE) {
+        break;
+      }
+
+      if (major == 2 || major == 3) {
+        if (in_len - pos < val) {
+          err = HSDT_ERR_EOF;
+          break;
+        }
+        pos += val;
+      } else if (major == 4 || major == 5) {
+#ifdef COLLECTION_SIZE_IN_BYTES
+        err = count_entries(in, in_len, pos, val, major == 5, &val);
+        if (err != HSDT_ERR_NONE) {
+          break;
+        }
+#else
+        /* Every item takes at least one byte, so larger counts can not fit. */
+        if (val > in_len - pos || (major == 5 && 2 * val > in_len - pos)) {
+          err = HSDT_ERR_EOF;
+          break;
+        }
+#endif
+        if (depth == HSDT_DEFAULT_MAX_DEPTH) {
+          err = HSDT_ERR_DEPTH;
+          break;
+        }
+        if (depth == frames_cap) {
+          frames_cap = frames_cap == 0 ? 16 : 2 * frames_cap;
+          if (frames_cap > HSDT_DEFAULT_MAX_DEPTH) {
+            frames_cap = HSDT_DEFAULT_MAX_DEPTH;
+          }
+          frames = realloc(frames, frames_cap * sizeof(Index_Frame)); // XXX OOM
+        }
+
+        Index_Frame *frame = frames + depth;
+        depth += 1;
+        frame->remaining = val;
+        frame->is_map = major == 5;
+        frame->last_key = NULL;
+        frame->last_key_len = 0;
+        frame->next = SIZE_MAX;
+        if (val >= min_len) {
+          index_reserve(index, 1, val);
+          HSDT_Index_Collection *collection = index->collections + index->collections_len;
+          collection->offset = start;
+          collection->first = index->offsets_len;
+          collection->len = val;
+          frame->next = index->offsets_len;
+          index->collections_len += 1;
+          index->offsets_len += val;
+        }
+      } else {
+        err = HSDT_ERR_TAG;
+        break;
+      }
+    }
+
+    while (depth > 0 && frames[depth - 1].remaining == 0) {
+      depth -= 1;
+    }
+    if (depth == 0) {
+      break;
+    }
+
+    Index_Frame *top = frames + depth - 1;
+    top->remaining -= 1;
+    if (top->next != SIZE_MAX) {
+      index->offsets[top->next] = pos;
+      top->next += 1;
+    }
+    if (top->is_map) {
+      err = read_key(in, in_len, &pos, top->last_key, top->last_key_len, &top->last_key, &top->last_key_len);
+      if (err != HSDT_ERR_NONE) {
+        break;
+      }
+    }
+  }
+
+  free(frames);
+  if (err != HSDT_ERR_NONE) {
+    index->collections_len = 0;
+    index->offsets_len = 0;
+  }
+  *consumed = pos;
+  return err;
+}
+
+/* Return the indexed collection at the current value of `cur`, or NULL if it is no indexed collection of the given major type. */
+static const HSDT_Index_Collection *index_find(const HSDT_Index *index, const HSDT_Cursor *cur, uint8_t major) {
+  if (cur->remaining == 0 || cur->pos >= cur->in_len || cur->in[cur->pos] >> 5 != major) {
+    return NULL;
+  }
+
+  size_t lo = 0;
+  size_t hi = index->collections_len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->collections[mid].offset < cur->pos) {
+      lo = mid + 1;
+    } else if (index->collections[mid].offset > cur->pos) {
+      hi = mid;
+    } else {
+      return index->collections + mid;
+    }
+  }
+  return NULL;
+}
+
+HSDT_ERR hsdt_index_array_get(const HSDT_Index *index, HSDT_Cursor *cur, size_t n, bool *found) {
+  const HSDT_Index_Collection *collection = index_find(index, cur, 4);
+  if (collection == NULL) {
+    return hsdt_cursor_index(cur, n, found);
+  }
+
+  *found = false;
+  if (n >= collection->len) {
+    return HSDT_ERR_NONE;
+  }
+  uint64_t offset = index->offsets[collection->first + n];
+  if (offset >= cur->in_len) {
+    return HSDT_ERR_EOF;
+  }
+
+  cur->pos = offset;
+  cur->remaining = collection->len - n;
+  cur->in_map = false;
+  cur->key = NULL;
+  cur->key_len = 0;
+  *found = true;
+  return HSDT_ERR_NONE;
+}
+
+HSDT_ERR hsdt_index_map_get(const HSDT_Index *index, HSDT_Cursor *cur, uint8_t *key, size_t key_len, bool *found) {
+  const HSDT_Index_Collection *collection = index_find(index, cur, 5);
+  if (collection == NULL) {
+    return hsdt_cursor_find(cur, key, key_len, found);
+  }
+
+  *found = false;
+  size_t lo = 0;
+  size_t hi = collection->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    size_t pos = index->offsets[collection->first + mid];
+    if (pos >= cur->in_len) {
+      return HSDT_ERR_EOF;
+    }
+
+    uint8_t *entry_key;
+    size_t entry_key_len;
+    HSDT_ERR err = read_key(cur->in, cur->in_len, &pos, NULL, 0, &entry_key, &entry_key_len);
+    if (err != HSDT_ERR_NONE) {
+      return err;
+    }
+
+    if (is_lexicographically_greater(key, key_len, entry_key, entry_key_len)) {
+      lo = mid + 1;
+    } else if (is_lexicographically_greater(entry_key, entry_key_len, key, key_len)) {
+      hi = mid;
+    } else {
+      cur->pos = pos;
+      cur->remaining = collection->len - mid;
+      cur->in_map = true;
+      cur->key = entry_key;
+      cur->key_len = entry_key_len;
+      *found = true;
+      return HSDT_ERR_NONE;
+    }
+  }
+  return HSDT_ERR_NONE;
+}
+
+/* Append `val` to `out` in network byte order. */
+static uint8_t *put_u64(uint8_t *out, uint64_t val) {
+  val = htonll(val);
+  memcpy(out, &val, 8);
+  return out + 8;
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+  uint64_t val;
+  memcpy(&val, in, 8);
+  return ntohll(val);
+}
+
+/*
+ * The serialization consists of the number of collections and of offsets,
+ * followed by offset, first and len of each collection, followed by the
+ * offsets. All numbers are 64 bit big endian.
+ */
+uint8_t *hsdt_index_serialize(const HSDT_Index *index, size_t *out_len) {
+  *out_len = 8 * (2 + 3 * index->collections_len + index->offsets_len);
+  uint8_t *out = malloc(*out_len); // XXX OOM
+  uint8_t *o = put_u64(out, index->collections_len);
+  o = put_u64(o, index->offsets_len);
+  for (size_t i = 0; i < index->collections_len; i++) {
+    o = put_u64(o, index->collections[i].offset);
+    o = put_u64(o, index->collections[i].first);
+    o = put_u64(o, index->collections[i].len);
+  }
+  for (size_t i = 0; i < index->offsets_len; i++) {
+    o = put_u64(o, index->offsets[i]);
+  }
+  return out;
+}
+
+bool hsdt_index_deserialize(HSDT_Index *index, const uint8_t *in, size_t in_len) {
+  index->collections_len = 0;
+  index->offsets_len = 0;
+  if (in_len < 16) {
+    return false;
+  }
+
+  uint64_t collections = get_u64(in);
+  uint64_t offsets = get_u64(in + 8);
+  /* Checked one at a time, so that the multiplications can not overflow. */
+  if (collections > (in_len - 16) / 24 || offsets > (in_len - 16 - 24 * collections) / 8 || in_len != 16 + 24 * collections + 8 * offsets) {
+    return false;
+  }
+
+  index_reserve(index, collections, offsets);
+  const uint8_t *i = in + 16;
+  for (size_t c = 0; c < collections; c++) {
+    HSDT_Index_Collection *collection = index->collections + c;
+    collection->offset = get_u64(i);
+    collection->first = get_u64(i + 8);
+    collection->len = get_u64(i + 16);
+    i += 24;
+    if ((c > 0 && collection->offset <= collection[-1].offset) || collection->first > offsets || collection->len > offsets - collection->first) {
+      return false;
+    }
+  }
+  for (size_t o = 0; o < offsets; o++) {
+    index->offsets[o] = get_u64(i);
+    i += 8;
+  }
+
+  index->collections_len = collections;
+  index->offsets_len = offsets;
+  return true;
+}
+
+/*
+ * The thread pool. Work is split into tasks, which the workers and the calling
+ * thread take from a shared counter until none are left.
+ */
+typedef void (*Pool_Task)(void *ctx, size_t task, size_t thread);
+
+struct HSDT_Pool {
+  size_t threads;
+  pthread_t *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t start; /* Signalled when tasks are available, or when stopping */
+  pthread_cond_t done; /* Signalled when the last task has finished */
+  Pool_Task run;
+  void *ctx;
+  size_t tasks;
+  size_t next_task;
+  size_t finished;
+  bool stop;
+};
+
+typedef struct Pool_Worker {
+  HSDT_Pool *pool;
+  size_t thread;
+} Pool_Worker;
+
+/* Take and run tasks until there are none left, with the lock held on entry and exit. */
+static void pool_work(HSDT_Pool *pool, size_t thread) {
+  while (pool->next_task < pool->tasks) {
+    size_t task = pool->next_task;
+    pool->next_task += 1;
+    pthread_mutex_unlock(&pool->lock);
+    pool->run(pool->ctx, task, thread);
+    pthread_mutex_lock(&pool->lock);
+    pool->finished += 1;
+    if (pool->finished == pool->tasks) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+}
+
+static void *pool_worker(void *arg) {
+  Pool_Worker *worker = arg;
+  HSDT_Pool *pool = worker->pool;
+  size_t thread = worker->thread;
+  free(worker);
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (!pool->stop && pool->next_task == pool->tasks) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->stop) {
+      break;
+    }
+    pool_work(pool, thread);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+HSDT_Pool *hsdt_pool_new(size_t threads) {
+  HSDT_Pool *pool = malloc(sizeof(HSDT_Pool)); // XXX OOM
+  pool->threads = threads == 0 ? 1 : threads;
+  pool->workers = malloc(pool->threads * sizeof(pthread_t)); // XXX OOM
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->tasks = 0;
+  pool->next_task = 0;
+  pool->finished = 0;
+  pool->stop = false;
+
+  for (size_t i = 1; i < pool->threads; i++) {
+    Pool_Worker *worker = malloc(sizeof(Pool_Worker)); // XXX OOM
+    worker->pool = pool;
+    worker->thread = i;
+    if (pthread_create(pool->workers + i, NULL, pool_worker, worker) != 0) {
+      free(worker);
+      pool->threads = i;
+      hsdt_pool_free(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+void hsdt_pool_free(HSDT_Pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 1; i < pool->threads; i++) {
+    pthread_join(pool->workers[i], NULL);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  free(pool->workers);
+  free(pool);
+}
+
+size_t hsdt_pool_threads(const HSDT_Pool *pool) {
+  return pool->threads;
+}
+
+/* Run `tasks` many tasks on all threads of the pool, return once all of them have finished. The calling thread is thread 0. */
+static void pool_run(HSDT_Pool *pool, Pool_Task run, void *ctx, size_t tasks) {
+  pthread_mutex_lock(&pool->lock);
+  pool->run = run;
+  pool->ctx = ctx;
+  pool->tasks = tasks;
+  pool->next_task = 0;
+  pool->finished = 0;
+  pthread_cond_broadcast(&pool->start);
+
+  pool_work(pool, 0);
+  while (pool->finished < pool->tasks) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pool->tasks = 0;
+  pool->next_task = 0;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* How many tasks per thread the parallel functions aim for, so that threads that finish early can help out. */
+#define TASKS_PER_THREAD 4
+
+typedef struct Batch_Job {
+  uint8_t *in;
+  size_t in_len;
+  HSDT_Batch_Result *results;
+  size_t *task_starts; /* The first result of each task, followed by the number of results */
+  HSDT_Arena *arenas;
+} Batch_Job;
+
+static void batch_task(void *ctx, size_t task, size_t thread) {
+  Batch_Job *job = ctx;
+  HSDT_Dec_Frame *stack = malloc(HSDT_DEFAULT_MAX_DEPTH * sizeof(HSDT_Dec_Frame)); // XXX OOM
+  HSDT_Arena *prev_arena = current_arena;
+  current_arena = job->arenas == NULL ? NULL : job->arenas + thread;
+
+  for (size_t i = job->task_starts[task]; i < job->task_starts[task + 1]; i++) {
+    HSDT_Batch_Result *result = job->results + i;
+    /* Values whose end is unknown get the whole rest of the input, as in the serial batch. */
+    size_t available = result->len == 0 ? job->in_len - result->offset : result->len;
+    result->err = hsdt_decode_stack(job->in + result->offset, available, &result->val, &result->len, stack, HSDT_DEFAULT_MAX_DEPTH);
+  }
+
+  current_arena = prev_arena;
+  free(stack);
+}
+
+size_t hsdt_decode_batch_parallel(HSDT_Pool *pool, HSDT_Arena *arenas, uint8_t *in, size_t in_len, HSDT_Batch_Result *results, size_t max_results, size_t *consumed) {
+  /* Find the values, a value that can not be skipped is the last one. */
+  size_t pos = 0;
+  size_t n = 0;
+  while (pos < in_len && n < max_results) {
+    size_t start = pos;
+    HSDT_ERR err = skip_value(in, in_len, &pos);
+    results[n].offset = start;
+    results[n].len = err == HSDT_ERR_NONE ? pos - start : 0;
+    n += 1;
+    if (err != HSDT_ERR_NONE) {
+      break;
+    }
+  }
+
+  /* Split the values into tasks of about the same number of bytes. */
+  size_t max_tasks = TASKS_PER_THREAD * pool->threads;
+  size_t task_bytes = pos / max_tasks + 1;
+  size_t *task_starts = malloc((max_tasks + n + 1) * sizeof(size_t)); // XXX OOM
+  size_t tasks = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (tasks == 0 || results[i].offset >= tasks * task_bytes) {
+      task_starts[tasks] = i;
+      tasks += 1;
+    }
+  }
+  task_starts[tasks] = n;
+
+  Batch_Job job = {in, in_len, results, task_starts, arenas};
+  pool_run(pool, batch_task, &job, tasks);
+  free(task_starts);
+
+  /* As in the serial batch, nothing after the first failure counts. */
+  *consumed = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (results[i].err != HSDT_ERR_NONE) {
+      for (size_t j = i + 1; j < n && arenas == NULL; j++) {
+        if (results[j].err == HSDT_ERR_NONE) {
+          hsdt_value_free(results[j].val);
+        }
+      }
+      return i + 1;
+    }
+    *consumed += results[i].len;
+  }
+  return n;
+}
+
+/* Collections with fewer entries than this are not worth encoding in parallel. */
+#define PARALLEL_ENCODE_MIN 1024
+
+/* An entry of a collection that is encoded in parallel. `key` is NULL for array elements. */
+typedef struct Encode_Entry {
+  uint8_t *key;
+  size_t key_len;
+  HSDT_Value *val;
+} Encode_Entry;
+
+/* The entries are split into `tasks` contiguous chunks, each task encodes one chunk. */
+typedef struct Encode_Job {
+  Encode_Entry *entries;
+  size_t len;
+  size_t tasks;
+  size_t *offsets; /* Where the encoding of each chunk starts, relative to the first entry, and where the last one ends */
+  uint8_t *out; /* Where the first entry goes */
+} Encode_Job;
+
+static void encode_chunk(Writer *w, Encode_Job *job, size_t task) {
+  Walk walk;
+  walk_init(&walk);
+  for (size_t i = task * job->len / job->tasks; i < (task + 1) * job->len / job->tasks; i++) {
+    Encode_Entry *entry = job->entries + i;
+    if (entry->key != NULL) {
+      writer_push_header(w, entry->key_len, 0x60);
+      writer_push(w, entry->key, entry->key_len);
+    }
+    encode_walk(w, &walk, entry->val);
+  }
+  walk_free(&walk);
+}
+
+/* Compute the encoded size of a chunk, and store it where its offset will go. */
+static void encode_size_task(void *ctx, size_t task, size_t thread) {
+  Encode_Job *job = ctx;
+  uint8_t none;
+  Writer w;
+  (void) thread;
+
+  /* A writer without room only counts. */
+  writer_init(&w, &none, 0, WRITER_FIXED);
+  encode_chunk(&w, job, task);
+  job->offsets[task + 1] = w.len;
+}
+
+static void encode_write_task(void *ctx, size_t task, size_t thread) {
+  Encode_Job *job = ctx;
+  Writer w;
+  (void) thread;
+
+  writer_init(&w, job->out + job->offsets[task], job->offsets[task + 1] - job->offsets[task], WRITER_FIXED);
+  encode_chunk(&w, job, task);
+}
+
+uint8_t *hsdt_encode_parallel(HSDT_Pool *pool, HSDT_Value in, size_t *out_len) {
+  size_t len = is_collection(&in) ? collection_len(&in) : 0;
+  if (pool->threads == 1 || len < PARALLEL_ENCODE_MIN) {
+    return hsdt_encode(in, out_len);
+  }
+
+  /* Gather the entries, rax keys are copied since the iterator reuses its key buffer. */
+  Encode_Entry *entries = malloc(len * sizeof(Encode_Entry)); // XXX OOM
+  uint8_t *keys = NULL;
+  if (in.tag == HSDT_ARRAY) {
+    for (size_t i = 0; i < len; i++) {
+      entries[i].key = NULL;
+      entries[i].val = in.array.elems + i;
+    }
+  } else if (in.tag == HSDT_SORTED_MAP) {
+    for (size_t i = 0; i < len; i++) {
+      entries[i].key = in.sorted_map.entries[i].key->bytes;
+      entries[i].key_len = in.sorted_map.entries[i].key->len;
+      entries[i].val = &in.sorted_map.entries[i].val;
+    }
+  } else {
+    size_t keys_len = 0;
+    size_t keys_cap = 0;
+    raxIterator iter;
+    raxStart(&iter, in.map);
+    raxSeek(&iter, "^", (unsigned char*) "", 0); // XXX OOM
+    for (size_t i = 0; raxNext(&iter); i++) {
+      if (keys_cap - keys_len < iter.key_len) {
+        keys_cap = 2 * keys_cap < keys_len + iter.key_len ? keys_len + iter.key_len : 2 * keys_cap;
+        keys = realloc(keys, keys_cap); // XXX OOM
+      }
+      memcpy(keys + keys_len, iter.key, iter.key_len);
+      entries[i].key_len = iter.key_len;
+      entries[i].val = iter.data;
+      keys_len += iter.key_len;
+    }
+    raxStop(&iter);
+
+    /* The keys are stored back to back, point to them once `keys` does not move anymore. */
+    keys_len = 0;
+    for (size_t i = 0; i < len; i++) {
+      entries[i].key = keys + keys_len;
+      keys_len += entries[i].key_len;
+    }
+  }
+
+  Encode_Job job = {entries, len, TASKS_PER_THREAD * pool->threads, NULL, NULL};
+  job.offsets = malloc((job.tasks + 1) * sizeof(size_t)); // XXX OOM
+  pool_run(pool, encode_size_task, &job, job.tasks);
+
+  /* Turn the sizes into offsets. */
+  job.offsets[0] = 0;
+  for (size_t i = 1; i <= job.tasks; i++) {
+    job.offsets[i] += job.offsets[i - 1];
+  }
+
+  uint8_t header[9];
+#ifdef COLLECTION_SIZE_IN_BYTES
+  size_t header_len = encode_len(job.offsets[job.tasks], in.tag == HSDT_ARRAY ? 0x80 : 0xA0, header);
+#else
+  size_t header_len = encode_len(len, in.tag == HSDT_ARRAY ? 0x80 : 0xA0, header);
+#endif
+  *out_len = header_len + job.offsets[job.tasks];
+  uint8_t *out = malloc(*out_len); // XXX OOM
+  memcpy(out, header, header_len);
+  job.out = out + header_len;
+  pool_run(pool, encode_write_task, &job, job.tasks);
+
+  free(job.offsets);
+  free(entries);
+  free(keys);
+  return out;
+}
+
+/* Documents shorter than this are not worth validating in parallel. */
+#define PARALLEL_VALIDATE_MIN 65536
+
+/* A contiguous run of entries of the top-level collection, validated by one task. */
+typedef struct Validate_Chunk {
+  size_t start; /* Where the first entry begins */
+  size_t prev_key; /* Where the key before the first entry begins, SIZE_MAX if there is none */
+  size_t len; /* The number of entries */
+  HSDT_ERR err;
+  size_t pos; /* Where validation stopped */
+} Validate_Chunk;
+
+typedef struct Validate_Job {
+  uint8_t *in;
+  size_t in_len;
+  bool map;
+  Validate_Chunk *chunks;
+} Validate_Job;
+
+static void validate_task(void *ctx, size_t task, size_t thread) {
+  Validate_Job *job = ctx;
+  Validate_Chunk *chunk = job->chunks + task;
+  uint8_t *last_key = NULL;
+  size_t last_key_len = 0;
+  (void) thread;
+
+  /*
+   * The skip pass checked that the previous key fits into the input. If it is
+   * not a string, an earlier entry fails anyway and this result is ignored.
+   */
+  if (job->map && chunk->prev_key != SIZE_MAX) {
+    uint8_t major;
+    uint8_t additional;
+    uint64_t len;
+    size_t header_len = 0;
+    if (tag_and_val(job->in + chunk->prev_key, job->in_len - chunk->prev_key, &header_len, &major, &additional, &len) == HSDT_ERR_NONE) {
+      last_key = job->in + chunk->prev_key + header_len;
+      last_key_len = len;
+    }
+  }
+
+  chunk->err = HSDT_ERR_NONE;
+  chunk->pos = chunk->start;
+  for (size_t i = 0; i < chunk->len && chunk->err == HSDT_ERR_NONE; i++) {
+    if (job->map) {
+      chunk->err = read_key(job->in, job->in_len, &chunk->pos, last_key, last_key_len, &last_key, &last_key_len);
+      if (chunk->err != HSDT_ERR_NONE) {
+        break;
+      }
+    }
+    /* The top-level collection takes up one level. */
+    chunk->err = validate_value(job->in, job->in_len, &chunk->pos, HSDT_DEFAULT_MAX_DEPTH - 1);
+  }
+}
+
+HSDT_ERR hsdt_validate_parallel(HSDT_Pool *pool, uint8_t *in, size_t in_len, size_t *consumed) {
+  if (pool->threads == 1 || in_len < PARALLEL_VALIDATE_MIN) {
+    return hsdt_validate(in, in_len, consumed);
+  }
+
+  size_t pos = 0;
+  Item root;
+  HSDT_ERR err = read_item(in, in_len, &pos, &root);
+  if (err != HSDT_ERR_NONE || (root.tag != HSDT_ARRAY && root.tag != HSDT_MAP)) {
+    *consumed = pos;
+    return err;
+  }
+
+  /*
+   * Split the entries into chunks of about the same number of bytes, reading
+   * only headers. An entry that can not be skipped ends the last chunk, its
+   * task then finds the same error as the serial validator.
+   */
+  bool map = root.tag == HSDT_MAP;
+  size_t max_tasks = TASKS_PER_THREAD * pool->threads;
+  size_t task_bytes = in_len / max_tasks + 1;
+  Validate_Chunk *chunks = malloc(max_tasks * sizeof(Validate_Chunk)); // XXX OOM
+  size_t tasks = 0;
+  size_t prev_key = SIZE_MAX;
+  for (uint64_t i = 0; i < root.len; i++) {
+    if (tasks == 0 || (pos >= tasks * task_bytes && tasks < max_tasks)) {
+      chunks[tasks].start = pos;
+      chunks[tasks].prev_key = prev_key;
+      chunks[tasks].len = 0;
+      tasks += 1;
+    }
+    chunks[tasks - 1].len += 1;
+
+    size_t key = pos;
+    err = map ? skip_value(in, in_len, &pos) : HSDT_ERR_NONE;
+    if (err == HSDT_ERR_NONE) {
+      err = skip_value(in, in_len, &pos);
+    }
+    if (err != HSDT_ERR_NONE) {
+      break;
+    }
+    prev_key = key;
+  }
+
+  Validate_Job job = {in, in_len, map, chunks};
+  pool_run(pool, validate_task, &job, tasks);
+
+  /* The first failing chunk has the first error in the document. */
+  *consumed = pos;
+  err = HSDT_ERR_NONE;
+  for (size_t i = 0; i < tasks; i++) {
+    if (chunks[i].err != HSDT_ERR_NONE) {
+      *consumed = chunks[i].pos;
+      err = chunks[i].err;
+      break;
+    }
+  }
+
+  free(chunks);
+  return err;
+}
@@ -23,16 +23,51 @@ typedef enum {
   HSDT_UTF8_STRING,
   HSDT_FP,
   HSDT_ARRAY,
-  HSDT_MAP
+  HSDT_MAP,
+  HSDT_SORTED_MAP, /* A map in a different representation, see `HSDT_Sorted_Map` */
+  HSDT_SHORT_BYTE_STRING, /* A byte string stored inline, see `HSDT_Short_String` */
+  HSDT_SHORT_UTF8_STRING, /* A utf8 string stored inline, see `HSDT_Short_String` */
+  HSDT_LAZY /* An array or map that has not been decoded yet, see `hsdt_decode_lazy` */
 } HSDT_TYPE_TAG;
 
 typedef struct HSDT_Value HSDT_Value;
+typedef struct HSDT_Map_Entry HSDT_Map_Entry;
 
 typedef struct HSDT_Array {
   size_t len;
   HSDT_Value *elems;
 } HSDT_Array;
 
+/*
+ * A map can be stored as an array of its entries, sorted by key, instead of as
+ * a rax. Since canonical encodings list keys in that order, decoding only
+ * appends, and encoding and iteration are plain scans. Lookups use binary
+ * search. An `HSDT_SORTED_MAP` is equal to an `HSDT_MAP` with the same entries.
+ */
+typedef struct HSDT_Sorted_Map {
+  size_t len;
+  HSDT_Map_Entry *entries;
+} HSDT_Sorted_Map;
+
+/* The longest string that fits into an `HSDT_Short_String`. */
+#define HSDT_SHORT_STRING_MAX 15
+
+/*
+ * A string can be stored inside the value itself instead of in an sds, if it
+ * is at most `HSDT_SHORT_STRING_MAX` bytes long. Such strings are equal to the
+ * corresponding sds strings with the same content.
+ */
+typedef struct HSDT_Short_String {
+  uint8_t len;
+  uint8_t data[HSDT_SHORT_STRING_MAX];
+} HSDT_Short_String;
+
+/* The encoding of a collection that has not been decoded yet, pointing into the decoded buffer. */
+typedef struct HSDT_Lazy {
+  uint8_t *enc;
+  size_t len;
+} HSDT_Lazy;
+
 typedef struct HSDT_Value {
   HSDT_TYPE_TAG tag;
   union {
@@ -41,12 +76,84 @@ typedef struct HSDT_Value {
     double fp;
     HSDT_Array array;
     rax *map;
+    HSDT_Sorted_Map sorted_map;
+    HSDT_Short_String short_byte_string;
+    HSDT_Short_String short_utf8_string;
+    HSDT_Lazy lazy;
   };
 } HSDT_Value;
 
+/*
+ * The key of a sorted map entry. Keys from an `HSDT_Intern_Table` are shared
+ * by all maps decoded with that table, all other keys belong to their entry.
+ */
+typedef struct HSDT_Key {
+  size_t len;
+  uint64_t hash; /* Only computed for interned keys */
+  bool interned;
+  uint8_t bytes[];
+} HSDT_Key;
+
+struct HSDT_Map_Entry {
+  HSDT_Key *key;
+  HSDT_Value val;
+};
+
 /* Return whether the two given values are equal. */
 bool hsdt_value_eq(HSDT_Value a, HSDT_Value b);
 
+/* The ways of representing maps that the decoders can produce. */
+typedef enum {
+  HSDT_MAP_RAX, /* `HSDT_MAP`, the default */
+  HSDT_MAP_SORTED /* `HSDT_SORTED_MAP` */
+} HSDT_MAP_REPR;
+
+/*
+ * How `hsdt_decode_with` and the streaming decoder represent the values they
+ * decode. Zero-initialized options select the defaults, which all other
+ * decoding functions (and the `to_value` conversions) use.
+ */
+typedef struct HSDT_Dec_Options {
+  HSDT_MAP_REPR map_repr;
+  /*
+   * Store strings of at most `HSDT_SHORT_STRING_MAX` bytes inline, as
+   * `HSDT_SHORT_BYTE_STRING` and `HSDT_SHORT_UTF8_STRING`. Disabled by default.
+   */
+  bool short_strings;
+  /*
+   * Intern the keys of sorted maps in this table (see `hsdt_intern_init`), or
+   * NULL to copy them into every map. Maps of other representations always
+   * copy their keys.
+   */
+  struct HSDT_Intern_Table *intern;
+} HSDT_Dec_Options;
+
+/*
+ * Return the value for `key` in `map`, which is an `HSDT_MAP`, an
+ * `HSDT_SORTED_MAP` or a lazy map, or NULL if there is none. A lazy map is
+ * decoded first, if that fails this returns NULL as well.
+ */
+HSDT_Value *hsdt_map_get(HSDT_Value *map, uint8_t *key, size_t key_len);
+
+/*
+ * Return element `n` of `array`, which is an `HSDT_ARRAY` or a lazy array, or
+ * NULL if there is none. A lazy array is decoded first, if that fails this
+ * returns NULL as well.
+ */
+HSDT_Value *hsdt_array_get(HSDT_Value *array, size_t n);
+
+/*
+ * Return the type of the value in the logical data model (one of `HSDT_NULL`
+ * to `HSDT_MAP`), whatever its representation. Does not decode lazy values.
+ */
+HSDT_TYPE_TAG hsdt_value_type(HSDT_Value *val);
+
+/*
+ * Return the content of a byte string or utf8 string in any representation,
+ * and set `len` to its length.
+ */
+uint8_t *hsdt_value_str(HSDT_Value *val, size_t *len);
+
 /* Free all heap-allocated data associated with the given value. */
 void hsdt_value_free(HSDT_Value val);
 
@@ -54,6 +161,42 @@ void hsdt_value_free(HSDT_Value val);
  * The implementation currently crashes when out of memory!
  */
 
+/*
+ * Region-based allocation: `hsdt_decode_arena` takes all memory of the decoded
+ * value from a `HSDT_Arena`, which is then released all at once. The fields of
+ * this struct are not part of the API.
+ */
+typedef struct HSDT_Arena_Chunk HSDT_Arena_Chunk;
+
+typedef struct HSDT_Arena {
+  HSDT_Arena_Chunk *chunks; /* The chunk currently allocated from, linked to all previous ones */
+  uint8_t *next; /* Start of the free space in the current chunk */
+  uint8_t *end; /* End of the current chunk */
+  size_t allocated; /* Total size of all chunks */
+} HSDT_Arena;
+
+/* Initialize an empty arena. */
+void hsdt_arena_init(HSDT_Arena *arena);
+
+/*
+ * Release everything that has been allocated from the arena, invalidating all
+ * values decoded with it. Keeps the largest chunk of memory for reuse.
+ */
+void hsdt_arena_reset(HSDT_Arena *arena);
+
+/* Release everything that has been allocated from the arena, and the arena's own memory. */
+void hsdt_arena_free(HSDT_Arena *arena);
+
+/*
+ * The allocator used for all memory owned by `HSDT_Value`s, also used by rax
+ * and sds (see `rax_malloc.h` and `sdsalloc.h`). Outside of
+ * `hsdt_decode_arena`, these are `malloc`, `realloc` and `free`. While an
+ * arena is in use, `hsdt_realloc` must only be passed memory from that arena.
+ */
+void *hsdt_malloc(size_t size);
+void *hsdt_realloc(void *ptr, size_t size);
+void hsdt_free(void *ptr);
+
 /* Errors that can occur during decoding of an encoded value. */
 typedef enum {
   HSDT_ERR_NONE, /* No error occured */
@@ -64,15 +207,29 @@ typedef enum {
   HSDT_ERR_INVALID_NAN, /* A float is an NaN value other than 0xf97e00 */
   HSDT_ERR_UTF8_KEY, /* A map contains a key that is not a utf8 string */
   HSDT_ERR_CANONIC_ORDER, /* The keys of a map are not sorted correctly */
-  HSDT_ERR_CANONIC_LENGTH /* The length of a collection or array is not given in the canonical format */
+  HSDT_ERR_CANONIC_LENGTH, /* The length of a collection or array is not given in the canonical format */
+  HSDT_ERR_DEPTH, /* Collections are nested deeper than the decoder allows */
+  HSDT_ERR_ABORTED /* A callback requested to stop parsing */
 } HSDT_ERR;
 
 #ifdef COLLECTION_SIZE_IN_BYTES
+/*
+ * When compiled with COLLECTION_SIZE_IN_BYTES, the headers of arrays and maps
+ * give the size of their content in bytes rather than their number of entries,
+ * so whole collections can be skipped in constant time. The content must then
+ * consist of exactly as many bytes of whole items (pairs of them for maps);
+ * items that cross the end of their collection are an
+ * `HSDT_ERR_CANONIC_LENGTH`. Decoders count the entries of a collection when
+ * they read its header, which only looks at the headers of the items directly
+ * inside. Encoders compute and memoize the sizes of all collections in one
+ * pass before writing, so encoding stays linear in the size of the value.
+ */
+
 /*
  * Decodes enough data from `in` to compute the length of the encoded object in
- * bytes. Since this implementation does not support partial decoding, you can
- * to use this function to ensure that a buffer of sufficient size is passed to
- * `hsdt_decode`.
+ * bytes, without looking at the content of collections. You can use this
+ * function to ensure that a buffer of sufficient size is passed to
+ * `hsdt_decode`, or use `hsdt_dec_feed` instead.
  *
  * This function returns 0 if and only if `in` does not contain a prefix of a
  * valid encoded value.
@@ -95,12 +252,706 @@ size_t hsdt_decode_len(uint8_t *in, size_t in_len);
  */
 HSDT_ERR hsdt_decode(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed);
 
+/* Like `hsdt_decode`, but represents the value as `opts` select. `NULL` selects the defaults. */
+HSDT_ERR hsdt_decode_with(const HSDT_Dec_Options *opts, uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed);
+
+/*
+ * Check whether `in` starts with a valid canonical encoding, without decoding
+ * it. Performs exactly the same checks as `hsdt_decode` (including the
+ * `HSDT_DEFAULT_MAX_DEPTH` limit), and returns the same error and `consumed`
+ * count. The only memory it allocates is a stack of the open collections.
+ */
+HSDT_ERR hsdt_validate(uint8_t *in, size_t in_len, size_t *consumed);
+
+/*
+ * Utf8 validation of strings and map keys uses SIMD instructions if the CPU
+ * supports them. By default, the fastest available implementation is selected
+ * at runtime, the functions below allow to pick one explicitly (e.g. for
+ * testing or benchmarking). The table-driven scalar implementation is always
+ * available.
+ */
+typedef enum {
+  HSDT_UTF8_AUTO,
+  HSDT_UTF8_SCALAR,
+  HSDT_UTF8_SSE42,
+  HSDT_UTF8_AVX2
+} HSDT_UTF8_IMPL;
+
+/*
+ * Select the utf8 validation to use. Returns false if the CPU does not support
+ * it. Must not be called while other threads decode or validate. Automatic
+ * selection needs no call, it happens once, safely, on first use.
+ */
+bool hsdt_set_utf8_impl(HSDT_UTF8_IMPL impl);
+
+/* Return the utf8 validation that is in use. Never returns `HSDT_UTF8_AUTO`. */
+HSDT_UTF8_IMPL hsdt_get_utf8_impl(void);
+
+/*
+ * Key interning: an `HSDT_Intern_Table` maps key bytes to `HSDT_Key`s that stay
+ * at the same address for the lifetime of the table. Sorted maps decoded with
+ * the table in `HSDT_Dec_Options.intern` share its keys instead of copying
+ * them, and lookups with interned keys compare pointers rather than bytes. A
+ * table may be used for any number of decodes, but by only one thread at a
+ * time.
+ *
+ * The fields of this struct are not part of the API.
+ */
+typedef struct HSDT_Intern_Table {
+  HSDT_Key **slots; /* Open addressing with linear probing, NULL for free slots */
+  size_t cap; /* Number of slots, a power of two */
+  size_t len; /* Number of keys */
+  size_t max_keys;
+} HSDT_Intern_Table;
+
+/*
+ * Initialize an empty table that holds at most `max_keys` keys. Once it is
+ * full, further keys are copied into the decoded maps as usual.
+ */
+void hsdt_intern_init(HSDT_Intern_Table *table, size_t max_keys);
+
+/* Release the table and all its keys. Values decoded with it must be freed before. */
+void hsdt_intern_free(HSDT_Intern_Table *table);
+
+/* Return the interned key with the given content, adding it if it does not exist yet. Returns NULL if the table is full. */
+HSDT_Key *hsdt_intern(HSDT_Intern_Table *table, uint8_t *key, size_t key_len);
+
+/* Return the interned key with the given content, or NULL if there is none. Never adds a key. */
+HSDT_Key *hsdt_intern_find(HSDT_Intern_Table *table, uint8_t *key, size_t key_len);
+
+/*
+ * Like `hsdt_map_get`, but with an interned `key`. Interned keys of the map are
+ * compared by address, so they must come from the table of `key`. All other
+ * keys, including those of maps decoded without a table, are compared by
+ * content.
+ */
+HSDT_Value *hsdt_map_get_interned(HSDT_Value *map, HSDT_Key *key);
+
+/*
+ * Lazy decoding: `hsdt_decode_lazy` only decodes the outermost value. The
+ * arrays and maps inside of it are `HSDT_LAZY` values that point to their
+ * encoding in `in`, so `in` must outlive the decoded value. Lazy values are
+ * decoded on first access (by `hsdt_lazy_load`, `hsdt_array_get` or
+ * `hsdt_map_get`), again only one level deep. Equality, encoding and freeing
+ * work without decoding them, encoding copies them as they are.
+ *
+ * If `validate` is true, all of `in` is checked exactly like `hsdt_decode`
+ * would, so later decoding can not fail. Else, only the structure of the
+ * lazy values is checked (lengths and nesting), the remaining checks are
+ * deferred until they are decoded, and may then fail. Encoding a lazy value
+ * that has not been checked may produce an invalid encoding.
+ */
+HSDT_ERR hsdt_decode_lazy(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed, bool validate);
+
+/*
+ * If `val` is lazy, decode it in place (one level deep). On error, `val` is
+ * left unchanged. Does nothing for other values.
+ */
+HSDT_ERR hsdt_lazy_load(HSDT_Value *val);
+
+/*
+ * Encode `val` like `hsdt_encode`, then turn the arrays and maps directly
+ * inside of it into lazy values that point into the returned encoding, as if
+ * it had been passed to `hsdt_decode_lazy`. Lazy values are copied without
+ * looking at them, so if a value is only changed through `hsdt_array_get` and
+ * `hsdt_map_get` (which decode the collections on the way), encoding it again
+ * copies the unchanged collections and serializes only the changed paths.
+ *
+ * The returned encoding must outlive `val`. Afterwards, nothing points into
+ * an earlier encoding passed to this function anymore, so that one may be
+ * freed. The collections that had been decoded are freed, pointers into them
+ * become invalid. `val` must not have been decoded into an arena.
+ */
+uint8_t *hsdt_encode_lazy(HSDT_Value *val, size_t *out_len);
+
+/*
+ * Like `hsdt_decode`, but all memory for `out` is taken from `arena`. The value
+ * must not be passed to `hsdt_value_free` or be modified, it stays valid until
+ * the arena is reset or freed. Many values can be decoded into the same arena.
+ */
+HSDT_ERR hsdt_decode_arena(HSDT_Arena *arena, uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed);
+
+/* The maximum nesting depth of collections accepted by `hsdt_decode`. */
+#define HSDT_DEFAULT_MAX_DEPTH 1024
+
+/*
+ * The decoder does not recurse, it keeps one frame per open collection on an
+ * explicit stack instead. The struct is only public so that callers can
+ * provide the memory for that stack, its fields are not part of the API.
+ */
+typedef struct HSDT_Dec_Frame {
+  HSDT_Value *val; /* The collection that is being decoded */
+  size_t remaining; /* How many entries still need to be decoded */
+  uint8_t *last_key; /* The previous key of a map, points into the input */
+  size_t last_key_len;
+} HSDT_Dec_Frame;
+
+/*
+ * Like `hsdt_decode`, but fails with `HSDT_ERR_DEPTH` if collections are nested
+ * more than `max_depth` levels deep (a top-level collection has depth 1, so a
+ * `max_depth` of 0 only admits scalars).
+ *
+ * If `stack` is not `NULL`, it must point to space for `max_depth` frames, and
+ * the decoder does not allocate any memory for its own bookkeeping. Else, the
+ * stack is allocated on the heap and grown as needed.
+ *
+ * On error, all memory allocated for `out` has already been freed again.
+ */
+HSDT_ERR hsdt_decode_stack(uint8_t *in, size_t in_len, HSDT_Value *out, size_t *consumed, HSDT_Dec_Frame *stack, size_t max_depth);
+
+/* The outcome of decoding one value of a batch. */
+typedef struct HSDT_Batch_Result {
+  HSDT_ERR err;
+  size_t offset; /* Where the value starts in the batch */
+  size_t len; /* How many bytes were consumed */
+  HSDT_Value val; /* Only meaningful if `err` is `HSDT_ERR_NONE` */
+} HSDT_Batch_Result;
+
+/*
+ * Decode a buffer of concatenated values, as `hsdt_decode` would decode each
+ * of them, into `results`, which has room for `max_results` many results.
+ * Returns the number of results, and sets `consumed` to the number of bytes
+ * taken up by the successfully decoded values.
+ *
+ * Decoding stops when the input ends, when `results` is full, or after the
+ * first value that fails to decode, since the start of the next value is
+ * unknown then. Only the last result can have an error.
+ *
+ * All values share one decoding stack. If `arena` is not `NULL`, they are
+ * allocated in it as with `hsdt_decode_arena`, else with `hsdt_malloc`.
+ */
+size_t hsdt_decode_batch(HSDT_Arena *arena, uint8_t *in, size_t in_len, HSDT_Batch_Result *results, size_t max_results, size_t *consumed);
+
+/*
+ * A fixed pool of threads for the parallel functions. A pool of `threads`
+ * threads starts `threads - 1` workers, the calling thread of a parallel
+ * function does its share of the work as well. A pool runs one parallel
+ * function at a time.
+ */
+typedef struct HSDT_Pool HSDT_Pool;
+
+/* Start a pool of `threads` threads (at least one). Returns NULL if the workers could not be started. */
+HSDT_Pool *hsdt_pool_new(size_t threads);
+
+/* Stop the workers and release the pool. */
+void hsdt_pool_free(HSDT_Pool *pool);
+
+/* Return the number of threads of the pool, including the calling one. */
+size_t hsdt_pool_threads(const HSDT_Pool *pool);
+
+/*
+ * Like `hsdt_decode_batch`, with the same results, but decodes on all threads
+ * of `pool`. A serial pass finds where each value ends by reading only
+ * headers, then the values are decoded in parallel.
+ *
+ * `arenas` is either `NULL`, or points to one arena per thread of the pool.
+ * Each value is allocated in the arena of the thread that decoded it, so all
+ * arenas must be kept until the values are no longer needed.
+ */
+size_t hsdt_decode_batch_parallel(HSDT_Pool *pool, HSDT_Arena *arenas, uint8_t *in, size_t in_len, HSDT_Batch_Result *results, size_t max_results, size_t *consumed);
+
+/*
+ * Like `hsdt_validate`, with the same error and `consumed` count, but checks a
+ * large document on all threads of `pool`. A serial pass finds the entries of
+ * the top-level array or map by reading only headers, then the threads check
+ * contiguous runs of entries (strings, floats, keys and their order). Inputs
+ * shorter than 64 KiB are validated serially.
+ */
+HSDT_ERR hsdt_validate_parallel(HSDT_Pool *pool, uint8_t *in, size_t in_len, size_t *consumed);
+
+/*
+ * Incremental decoding: a `HSDT_Dec_State` decodes a single value from input
+ * that arrives in arbitrary chunks, e.g. straight off a socket. Each chunk is
+ * only looked at once, progress (including partially read headers and
+ * strings) is kept in the state between calls.
+ *
+ * The fields of these structs are not part of the API.
+ */
+typedef struct HSDT_Stream_Frame {
+  HSDT_Value *val; /* The collection that is being decoded */
+  size_t remaining; /* How many entries still need to be decoded */
+  size_t cap; /* How many entries of an array or sorted map have been allocated */
+  sds last_key; /* The previous key of a map, or NULL */
+#ifdef COLLECTION_SIZE_IN_BYTES
+  uint64_t end; /* The offset in the input at which the content ends, `remaining` is not used */
+#endif
+} HSDT_Stream_Frame;
+
+typedef enum {
+  HSDT_DEC_HEADER, /* Reading a tag and its length data */
+  HSDT_DEC_BODY, /* Reading the content of a string */
+  HSDT_DEC_DONE /* The value has been decoded */
+} HSDT_DEC_PHASE;
+
+typedef struct HSDT_Dec_State {
+  HSDT_Value *out;
+  size_t max_depth;
+  HSDT_Dec_Options opts;
+  HSDT_Stream_Frame *frames;
+  size_t frames_cap;
+  size_t depth;
+  HSDT_Value *current; /* Where to put the next decoded item */
+  HSDT_DEC_PHASE phase;
+  bool in_key; /* Whether the current header or string is a map key */
+  uint8_t header[9];
+  size_t header_len; /* How many bytes of `header` have been read */
+  sds str; /* The string that is being read, its length is the allocated space */
+  uint8_t str_major;
+  size_t str_filled; /* How many bytes of `str` have been read */
+  uint64_t str_remaining; /* How many bytes of the string are still missing */
+  uint32_t utf8_state;
+  HSDT_ERR err; /* HSDT_ERR_EOF while decoding is in progress */
+#ifdef COLLECTION_SIZE_IN_BYTES
+  uint64_t offset; /* How many bytes of input have been consumed */
+#endif
+} HSDT_Dec_State;
+
+/*
+ * Prepare `state` for decoding a value into `out`, rejecting collections
+ * nested deeper than `max_depth` (see `hsdt_decode_stack`).
+ */
+void hsdt_dec_init(HSDT_Dec_State *state, HSDT_Value *out, size_t max_depth);
+
+/* Like `hsdt_dec_init`, but the value is represented as `opts` select (see `hsdt_decode_with`). */
+void hsdt_dec_init_with(const HSDT_Dec_Options *opts, HSDT_Dec_State *state, HSDT_Value *out, size_t max_depth);
+
+/*
+ * Feed the next `in_len` bytes of input to the decoder. `consumed` is set to
+ * the number of bytes that were used.
+ *
+ * Returns `HSDT_ERR_EOF` if all of the chunk has been consumed but the value
+ * is not complete yet, call this again with more data then. Returns
+ * `HSDT_ERR_NONE` once the value has been decoded into `out`, any remaining
+ * bytes of the chunk belong to whatever follows the value. Any other error is
+ * final and is returned again by subsequent calls.
+ *
+ * Since the input is not available in one piece, errors may be reported
+ * earlier than `hsdt_decode` would report them, e.g. invalid utf8 at the
+ * start of a truncated string is an `HSDT_ERR_UTF8` rather than an
+ * `HSDT_ERR_EOF`. Memory for collections and strings grows with the data that
+ * actually arrives, not with the announced lengths. With
+ * COLLECTION_SIZE_IN_BYTES, the content of a collection is only checked to
+ * fit its size as it arrives, rather than when the header is read.
+ */
+HSDT_ERR hsdt_dec_feed(HSDT_Dec_State *state, uint8_t *in, size_t in_len, size_t *consumed);
+
+/*
+ * Release the memory held by `state`. If decoding has not successfully
+ * completed, this also frees the partially decoded value. Must be called
+ * exactly once for each call to `hsdt_dec_init` or `hsdt_dec_init_with`.
+ */
+void hsdt_dec_free(HSDT_Dec_State *state);
+
+/*
+ * Zero-copy decoding: a `HSDT_View` is a read-only tree whose strings and map
+ * keys point directly into the buffer it was decoded from, so the buffer must
+ * outlive the view. Only arrays and maps allocate memory. Map entries are
+ * stored in canonical (i.e. sorted) order.
+ */
+typedef struct HSDT_View HSDT_View;
+typedef struct HSDT_View_Entry HSDT_View_Entry;
+
+typedef struct HSDT_View_Str {
+  uint8_t *ptr;
+  size_t len;
+} HSDT_View_Str;
+
+typedef struct HSDT_View_Array {
+  size_t len;
+  HSDT_View *elems;
+} HSDT_View_Array;
+
+typedef struct HSDT_View_Map {
+  size_t len;
+  HSDT_View_Entry *entries;
+} HSDT_View_Map;
+
+struct HSDT_View {
+  HSDT_TYPE_TAG tag;
+  union {
+    HSDT_View_Str byte_string;
+    HSDT_View_Str utf8_string;
+    double fp;
+    HSDT_View_Array array;
+    HSDT_View_Map map;
+  };
+};
+
+struct HSDT_View_Entry {
+  HSDT_View_Str key;
+  HSDT_View val;
+};
+
+/*
+ * Like `hsdt_decode_stack` with a heap-allocated stack, but decodes into a
+ * view of `in` rather than copying the data. Performs exactly the same checks
+ * as `hsdt_decode`, and reports the same errors.
+ */
+HSDT_ERR hsdt_decode_view(uint8_t *in, size_t in_len, HSDT_View *out, size_t *consumed, size_t max_depth);
+
+/* Free the arrays and maps of a view. Does not touch the decoded buffer. */
+void hsdt_view_free(HSDT_View view);
+
+/* Return the value for `key` in the map `map`, or NULL if there is none. Uses binary search. */
+HSDT_View *hsdt_view_map_get(HSDT_View_Map map, uint8_t *key, size_t key_len);
+
+/* Copy a view into a self-contained value. */
+HSDT_Value hsdt_view_to_value(HSDT_View view);
+
+/*
+ * Tape decoding: a `HSDT_Tape` holds a whole decoded document in two flat
+ * buffers, an array of entries in the order of the encoding and an arena with
+ * the content of all strings. Values are referred to by their index on the
+ * tape, the decoded value itself is at index 0.
+ *
+ * A collection entry is directly followed by the entries of its content. For
+ * maps, each key is an `HSDT_UTF8_STRING` entry followed by the entries of its
+ * value. Collections store the index of the first entry after their content,
+ * so they can be skipped in constant time.
+ */
+typedef struct HSDT_Tape_Entry {
+  HSDT_TYPE_TAG tag;
+  size_t len; /* The length of a string, or the number of entries of a collection */
+  union {
+    double fp;
+    size_t str; /* Offset of the content of a string in the string arena */
+    size_t end; /* Index of the entry after the content of a collection */
+  };
+} HSDT_Tape_Entry;
+
+/* The fields of this struct are not part of the API. */
+typedef struct HSDT_Tape {
+  HSDT_Tape_Entry *entries;
+  size_t len;
+  size_t cap;
+  uint8_t *strings;
+  size_t strings_len;
+  size_t strings_cap;
+} HSDT_Tape;
+
+/* Initialize an empty tape. */
+void hsdt_tape_init(HSDT_Tape *tape);
+
+/* Release the memory of the tape. */
+void hsdt_tape_free(HSDT_Tape *tape);
+
+/*
+ * Decode a value from `in` onto `tape`, replacing whatever the tape held
+ * before but reusing its memory. Performs exactly the same checks as
+ * `hsdt_decode`, and rejects collections nested deeper than `max_depth`. On
+ * error, the tape is empty.
+ */
+HSDT_ERR hsdt_decode_tape(HSDT_Tape *tape, uint8_t *in, size_t in_len, size_t *consumed, size_t max_depth);
+
+/* Return the index of the entry after the value at index `i`, skipping the content of collections. */
+size_t hsdt_tape_skip(const HSDT_Tape *tape, size_t i);
+
+/* Return the content of the string (or map key) at index `i`, its length is the `len` of the entry. */
+uint8_t *hsdt_tape_str(const HSDT_Tape *tape, size_t i);
+
+/* Return the index of element `n` of the array at index `array`, or SIZE_MAX if it has no such element. */
+size_t hsdt_tape_array_get(const HSDT_Tape *tape, size_t array, size_t n);
+
+/*
+ * Return the index of the value for `key` in the map at index `map`, or
+ * SIZE_MAX if there is none. Skips over the values of all smaller keys, and
+ * stops at the first greater one.
+ */
+size_t hsdt_tape_map_get(const HSDT_Tape *tape, size_t map, uint8_t *key, size_t key_len);
+
+/* Copy the value at index `i` into a self-contained value. */
+HSDT_Value hsdt_tape_to_value(const HSDT_Tape *tape, size_t i);
+
+/*
+ * Event-based parsing: `hsdt_parse` reports the items of an encoded value to
+ * callbacks as it reads them, without building a value and without allocating.
+ * It performs exactly the same checks as `hsdt_decode`.
+ *
+ * Strings and keys point into the input. Each `start_array` and `start_map` is
+ * matched by an `end` after all its entries have been reported, map entries are
+ * reported as a `key` followed by the events of the value.
+ *
+ * Each callback may be `NULL` to ignore the corresponding events. Returning
+ * `false` from a callback stops parsing with `HSDT_ERR_ABORTED`.
+ */
+typedef struct HSDT_Callbacks {
+  bool (*null)(void *ctx);
+  bool (*boolean)(void *ctx, bool val);
+  bool (*fp)(void *ctx, double val);
+  bool (*byte_string)(void *ctx, uint8_t *str, size_t len);
+  bool (*utf8_string)(void *ctx, uint8_t *str, size_t len);
+  bool (*start_array)(void *ctx, size_t len);
+  bool (*start_map)(void *ctx, size_t len);
+  bool (*key)(void *ctx, uint8_t *key, size_t len);
+  bool (*end)(void *ctx);
+} HSDT_Callbacks;
+
+/* The stack of the parser, one frame per open collection. The fields are not part of the API. */
+typedef struct HSDT_Parse_Frame {
+  size_t remaining; /* How many entries still need to be parsed */
+  bool is_map;
+  uint8_t *last_key; /* The previous key of a map, points into the input */
+  size_t last_key_len;
+} HSDT_Parse_Frame;
+
+/*
+ * Parse one encoded value from `in`, reporting it to `callbacks`, which receive
+ * `ctx` as their first argument. `consumed` is set to the number of bytes read.
+ *
+ * `stack` and `max_depth` work as for `hsdt_decode_stack`. Passing a stack of
+ * `max_depth` frames guarantees that no memory is allocated.
+ */
+HSDT_ERR hsdt_parse(uint8_t *in, size_t in_len, const HSDT_Callbacks *callbacks, void *ctx, size_t *consumed, HSDT_Parse_Frame *stack, size_t max_depth);
+
+/*
+ * Cursors navigate an encoded value without decoding it. A cursor stands on one
+ * value in a sequence: the value that was passed to `hsdt_cursor_init`, or an
+ * entry of a collection that was entered. Cursors never allocate, and all
+ * strings they return point into the input. They are plain structs, copy one
+ * to remember a position.
+ *
+ * Cursors only check what they read: scalars and map keys get the same checks
+ * as in `hsdt_decode`, skipped values only get their lengths checked (as in
+ * `hsdt_decode_lazy` without validation). Skipping a string takes constant
+ * time, skipping a collection reads only the headers of its content.
+ */
+typedef struct HSDT_Cursor {
+  uint8_t *in;
+  size_t in_len;
+  size_t pos; /* Offset of the current value, or of the end of the collection if there are no more entries */
+  uint64_t remaining; /* The number of entries left, including the current one */
+  bool in_map;
+  uint8_t *key; /* In maps, the key of the current entry */
+  size_t key_len;
+} HSDT_Cursor;
+
+/* A value as read by a cursor: either a complete scalar, or the header of a collection. */
+typedef struct HSDT_Cursor_Item {
+  HSDT_TYPE_TAG tag;
+  union {
+    double fp;
+    HSDT_View_Str str; /* The content of a string */
+    size_t len; /* The number of entries of an `HSDT_ARRAY` or `HSDT_MAP` */
+  };
+} HSDT_Cursor_Item;
+
+/* Place the cursor on the value at the start of `in`. */
+void hsdt_cursor_init(HSDT_Cursor *cur, uint8_t *in, size_t in_len);
+
+/* Read the current value. Returns `HSDT_ERR_EOF` if there are no more entries. */
+HSDT_ERR hsdt_cursor_read(const HSDT_Cursor *cur, HSDT_Cursor_Item *item);
+
+/*
+ * Set `enc` and `enc_len` to the encoding of the current value. Returns
+ * `HSDT_ERR_EOF` if there are no more entries.
+ */
+HSDT_ERR hsdt_cursor_encoding(const HSDT_Cursor *cur, uint8_t **enc, size_t *enc_len);
+
+/*
+ * Move the cursor to the first entry of the current collection. If that is
+ * empty, or the current value is not a collection at all, there are no
+ * entries left afterwards. On error, the cursor does not move.
+ */
+HSDT_ERR hsdt_cursor_enter(HSDT_Cursor *cur);
+
+/*
+ * Skip the current value and move to the next entry. If there is none, `pos`
+ * is the offset right after the enclosing collection (or the whole value).
+ * Returns `HSDT_ERR_EOF` if there are no more entries. On error, the cursor
+ * does not move.
+ */
+HSDT_ERR hsdt_cursor_next(HSDT_Cursor *cur);
+
+/*
+ * If the current value is a map with an entry for `key`, move the cursor to
+ * the value of that entry and set `found` to true. Else set `found` to false
+ * and leave the cursor where it is. Stops scanning at the first greater key.
+ */
+HSDT_ERR hsdt_cursor_find(HSDT_Cursor *cur, uint8_t *key, size_t key_len, bool *found);
+
+/*
+ * If the current value is an array with at least `n + 1` elements, move the
+ * cursor to element `n` and set `found` to true. Else set `found` to false and
+ * leave the cursor where it is.
+ */
+HSDT_ERR hsdt_cursor_index(HSDT_Cursor *cur, size_t n, bool *found);
+
+/* One step of a path: the entry for a map key, or an array element if `key` is NULL. */
+typedef struct HSDT_Path_Step {
+  uint8_t *key;
+  size_t key_len;
+  size_t index;
+} HSDT_Path_Step;
+
+/* A compiled path expression. The fields are not part of the API. */
+typedef struct HSDT_Path {
+  size_t len;
+  HSDT_Path_Step *steps;
+  uint8_t *keys; /* The content of all keys */
+} HSDT_Path;
+
+/*
+ * Compile a path expression such as `content.mentions[2].link`: map keys
+ * separated by dots, and array indices in brackets. Keys are nonempty and can
+ * not contain `.` or `[`. The empty expression denotes the whole value.
+ *
+ * Returns false if `expr` is no valid path, there is nothing to free then.
+ */
+bool hsdt_path_compile(HSDT_Path *path, const char *expr);
+
+/* Release the memory of a compiled path. */
+void hsdt_path_free(HSDT_Path *path);
+
+/*
+ * Follow the path from the current value of `cur`, in a single forward pass
+ * that stops as soon as a step can not be taken. If the whole path exists,
+ * `cur` is moved to its target and `found` is set to true. Else `found` is set
+ * to false and `cur` is left where it was. Use `hsdt_cursor_read` or
+ * `hsdt_cursor_encoding` to get at the target.
+ */
+HSDT_ERR hsdt_path_query(const HSDT_Path *path, HSDT_Cursor *cur, bool *found);
+
+/*
+ * A set of paths, compiled into a trie so that all of them can be extracted
+ * in a single pass. The fields of these structs are not part of the API.
+ */
+typedef struct HSDT_Path_Edge {
+  HSDT_Path_Step step;
+  size_t child;
+} HSDT_Path_Edge;
+
+typedef struct HSDT_Path_Node {
+  size_t first_path; /* The first path that ends at this node, or SIZE_MAX */
+  size_t edges; /* Key edges sorted by key, followed by index edges sorted by index */
+  size_t key_edges;
+  size_t index_edges;
+} HSDT_Path_Node;
+
+typedef struct HSDT_Path_Set {
+  size_t len;
+  HSDT_Path *paths;
+  size_t *next_path; /* The next path that ends at the same node, or SIZE_MAX */
+  HSDT_Path_Node *nodes; /* The root is at index 0 */
+  HSDT_Path_Edge *edges;
+} HSDT_Path_Set;
+
+/*
+ * Compile `len` path expressions (see `hsdt_path_compile`) into a set. Returns
+ * false if any of them is invalid, there is nothing to free then.
+ */
+bool hsdt_path_set_compile(HSDT_Path_Set *set, const char **exprs, size_t len);
+
+/* Release the memory of a compiled path set. */
+void hsdt_path_set_free(HSDT_Path_Set *set);
+
+/*
+ * Extract all paths of the set from the current value of `cur`, in a single
+ * traversal that skips all subtrees no path leads into, and stops once no
+ * path can match anymore. For each path `i` (in the order they were given to
+ * `hsdt_path_set_compile`), `found[i]` is set to whether the path exists, and
+ * if so, `results[i]` is set to a cursor on its target. `cur` itself does not
+ * move. On error, the content of `results` and `found` is unspecified.
+ */
+HSDT_ERR hsdt_path_set_extract(const HSDT_Path_Set *set, const HSDT_Cursor *cur, HSDT_Cursor *results, bool *found);
+
+/*
+ * A structural index of an encoded value: for each of its collections with at
+ * least a given number of entries, the offsets of all entries (of the keys,
+ * for maps). With it, cursors reach array elements in constant time and map
+ * entries with a binary search. Offsets are relative to the start of the
+ * encoded value, and fixed-width, so an index can be stored next to the value.
+ */
+typedef struct HSDT_Index_Collection {
+  uint64_t offset; /* Where the collection starts in the encoding */
+  uint64_t first; /* Where the offsets of its entries start */
+  uint64_t len;
+} HSDT_Index_Collection;
+
+/* The fields of this struct are not part of the API. */
+typedef struct HSDT_Index {
+  HSDT_Index_Collection *collections; /* Sorted by offset */
+  size_t collections_len;
+  size_t collections_cap;
+  uint64_t *offsets;
+  size_t offsets_len;
+  size_t offsets_cap;
+} HSDT_Index;
+
+/* Initialize an empty index. */
+void hsdt_index_init(HSDT_Index *index);
+
+/* Release the memory of the index. */
+void hsdt_index_free(HSDT_Index *index);
+
+/*
+ * Index the collections with at least `min_len` entries of the value at the
+ * start of `in`, replacing whatever the index held before but reusing its
+ * memory. Checks the structure of the value and the order of all map keys, but
+ * not the content of other strings or of floats. Rejects collections nested
+ * deeper than `HSDT_DEFAULT_MAX_DEPTH`. On error, the index is empty.
+ */
+HSDT_ERR hsdt_index_build(HSDT_Index *index, uint8_t *in, size_t in_len, size_t min_len, size_t *consumed);
+
+/*
+ * Like `hsdt_cursor_index` and `hsdt_cursor_find`, but take constant and
+ * logarithmic time if the current value was indexed. `cur` must be on the
+ * encoding that `index` was built from, starting at the same address.
+ */
+HSDT_ERR hsdt_index_array_get(const HSDT_Index *index, HSDT_Cursor *cur, size_t n, bool *found);
+HSDT_ERR hsdt_index_map_get(const HSDT_Index *index, HSDT_Cursor *cur, uint8_t *key, size_t key_len, bool *found);
+
+/*
+ * Allocates and returns a platform-independent serialization of the index.
+ * `out_len` is set to its length.
+ */
+uint8_t *hsdt_index_serialize(const HSDT_Index *index, size_t *out_len);
+
+/*
+ * Replace the content of `index` with a serialized index. Returns false if
+ * `in` is no valid serialization, the index is empty then. Offsets are checked
+ * against the encoding when they are used, an index that does not belong to
+ * the encoding gives wrong results, but never reads out of bounds.
+ */
+bool hsdt_index_deserialize(HSDT_Index *index, const uint8_t *in, size_t in_len);
+
 /*
  * Allocates and returns a string holding the canonical encoding of the given value.
  * `out_len` is set to the length of the returned string.
  */
 uint8_t *hsdt_encode(HSDT_Value in, size_t *out_len);
 
+/*
+ * Writes the canonical encoding of the given value into `out`, which has room
+ * for `out_cap` many bytes. Returns the length of the encoding. If that is
+ * greater than `out_cap`, the encoding did not fit and the content of `out` is
+ * unspecified. Call again with a buffer of at least the returned size.
+ */
+size_t hsdt_encode_into(HSDT_Value in, uint8_t *out, size_t out_cap);
+
+/*
+ * Receives a piece of an encoding, returns false to stop encoding. The chunk
+ * may be overwritten once this returns.
+ */
+typedef bool (*HSDT_Write)(void *ctx, const uint8_t *chunk, size_t len);
+
+/*
+ * Writes the canonical encoding of the given value to `write`, in pieces of
+ * exactly `chunk_len` many bytes, except for the last one which may be shorter.
+ * The pieces are assembled in `chunk`, which must have room for `chunk_len`
+ * bytes (at least one). `write` receives `ctx` as its first argument.
+ *
+ * Returns false if `write` stopped the encoding, true otherwise.
+ */
+bool hsdt_encode_stream(HSDT_Value in, uint8_t *chunk, size_t chunk_len, HSDT_Write write, void *ctx);
+
+/*
+ * Like `hsdt_encode`, but encodes the entries of a large top-level array or map
+ * on all threads of `pool`. The threads first compute the encoded size of each
+ * entry, and then, after a prefix sum over these sizes, write their entries
+ * directly to their place in the output. Other values are encoded serially.
+ */
+uint8_t *hsdt_encode_parallel(HSDT_Pool *pool, HSDT_Value in, size_t *out_len);
+
 /* Return how many bytes the value `val` would take in encoded form */
 size_t hsdt_encoding_len(HSDT_Value val);
 #endif
@@ -19,51 +19,340 @@
 //   printf("\n\n");
 // }
 
-static void check(char *hex_input, HSDT_Value expected) {
-  /* Convert input string (hex encoded, null-delimited) into binary data. */
+/* Convert input string (hex encoded, null-delimited) into binary data. */
+static uint8_t *from_hex(char *hex_input, size_t *len) {
   size_t hex_len = strlen(hex_input);
-  size_t valid_bytes_len = hex_len / 2;
-  uint8_t *valid_bytes = malloc(valid_bytes_len);
+  *len = hex_len / 2;
+  uint8_t *bytes = malloc(*len);
   /* https://gist.github.com/xsleonard/7341172 */
-  for (size_t i=0, j=0; j< valid_bytes_len; i+=2, j++)
-    valid_bytes[j] = (hex_input[i] % 32 + 9) % 25 * 16 + (hex_input[i+1] % 32 + 9) % 25;
+  for (size_t i=0, j=0; j< *len; i+=2, j++)
+    bytes[j] = (hex_input[i] % 32 + 9) % 25 * 16 + (hex_input[i+1] % 32 + 9) % 25;
+  return bytes;
+}
 
-  /* Perform the checks */
+#ifdef COLLECTION_SIZE_IN_BYTES
+/* Write the header of a string or collection, return its size. */
+static size_t put_header(uint8_t *out, uint8_t major, uint64_t len) {
+  if (len <= 23) {
+    out[0] = major | len;
+    return 1;
+  } else if (len <= 255) {
+    out[0] = major | 24;
+    out[1] = len;
+    return 2;
+  } else if (len <= 65535) {
+    out[0] = major | 25;
+    out[1] = len >> 8;
+    out[2] = len;
+    return 3;
+  } else {
+    out[0] = major | 26;
+    for (size_t i = 0; i < 4; i++) {
+      out[1 + i] = len >> (24 - 8 * i);
+    }
+    return 5;
+  }
+}
 
-  HSDT_Value actual;
-  size_t consumed;
+/*
+ * Rewrite the valid value at `in[*pos]`, whose collection headers give their
+ * number of entries, into `out` with collection headers that give the size of
+ * their content. Advances `*pos` and returns the size of the result. The
+ * content of a collection is written 9 bytes in, then moved behind its header.
+ */
+static size_t rewrite_sizes(uint8_t *in, size_t *pos, uint8_t *out) {
+  uint8_t tag = in[*pos];
+  size_t item_len = tag == 0xfb ? 9 : 1;
+  uint64_t len = tag & 0x1f;
+
+  if (tag == 0xf4 || tag == 0xf5 || tag == 0xf6 || tag == 0xfb) {
+    memcpy(out, in + *pos, item_len);
+    *pos += item_len;
+    return item_len;
+  }
+
+  if (len >= 24) {
+    size_t extra = (size_t) 1 << (len - 24);
+    len = 0;
+    for (size_t i = 0; i < extra; i++) {
+      len = (len << 8) | in[*pos + 1 + i];
+    }
+    item_len += extra;
+  }
+
+  if ((tag & 0xe0) == 0x40 || (tag & 0xe0) == 0x60) {
+    memcpy(out, in + *pos, item_len + len);
+    *pos += item_len + len;
+    return item_len + len;
+  }
+
+  *pos += item_len;
+  size_t size = 0;
+  for (uint64_t i = 0; i < ((tag & 0xe0) == 0xa0 ? 2 * len : len); i++) {
+    size += rewrite_sizes(in, pos, out + 9 + size);
+  }
+  size_t header_len = put_header(out, tag & 0xe0, size);
+  memmove(out + header_len, out + 9, size);
+  return header_len + size;
+}
+
+/* Convert a sample into the format of this build, see `rewrite_sizes`. */
+static uint8_t *sizes_in_bytes(uint8_t *bytes, size_t *len) {
+  uint8_t *out = malloc(9 * *len + 9);
+  size_t pos = 0;
+  *len = rewrite_sizes(bytes, &pos, out);
+  free(bytes);
+  return out;
+}
+#endif
+
+/* Concatenates the chunks written by `hsdt_encode_stream`. */
+typedef struct Collect {
+  uint8_t *buf;
+  size_t len;
+  size_t chunk_len;
+} Collect;
+
+static bool collect_write(void *ctx, const uint8_t *chunk, size_t len) {
+  Collect *collect = ctx;
+  assert(len > 0 && len <= collect->chunk_len);
+  /* Only the last chunk may be shorter. */
+  assert(collect->len % collect->chunk_len == 0);
+  memcpy(collect->buf + collect->len, chunk, len);
+  collect->len += len;
+  return true;
+}
 
+static bool stop_write(void *ctx, const uint8_t *chunk, size_t len) {
+  (void) chunk;
+  (void) len;
+  size_t *calls = ctx;
+  *calls += 1;
+  return false;
+}
+
+static void check(char *hex_input, HSDT_Value expected) {
+  size_t valid_bytes_len;
+  uint8_t *valid_bytes = from_hex(hex_input, &valid_bytes_len);
   #ifdef COLLECTION_SIZE_IN_BYTES
-  assert(hsdt_decode_len(valid_bytes, valid_bytes_len) == valid_bytes_len);
+  valid_bytes = sizes_in_bytes(valid_bytes, &valid_bytes_len);
   #endif
+
+  /* Perform the checks */
+
+  /* Everything that decodes is done once for each representation of maps and strings. */
+  for (int variant = 0; variant < 4; variant++) {
+    HSDT_Dec_Options opts = {variant % 2 == 0 ? HSDT_MAP_RAX : HSDT_MAP_SORTED, variant >= 2, NULL};
+
+    HSDT_Value actual;
+    size_t consumed;
+
+    #ifdef COLLECTION_SIZE_IN_BYTES
+    assert(hsdt_decode_len(valid_bytes, valid_bytes_len) == valid_bytes_len);
+    #endif
   
-  assert(hsdt_decode(valid_bytes, valid_bytes_len, &actual, &consumed) == HSDT_ERR_NONE);
-  assert(consumed == valid_bytes_len);
-  assert(hsdt_value_eq(actual, expected));
+    assert(hsdt_decode_with(&opts, valid_bytes, valid_bytes_len, &actual, &consumed) == HSDT_ERR_NONE);
+    assert(consumed == valid_bytes_len);
+
+    assert(hsdt_validate(valid_bytes, valid_bytes_len, &consumed) == HSDT_ERR_NONE);
+    assert(consumed == valid_bytes_len);
+    assert(hsdt_value_eq(actual, expected));
+
+    size_t reencoded_len;
+    uint8_t *reencoded = hsdt_encode(actual, &reencoded_len);
+    // print_buf(reencoded, reencoded_len);
+    assert(memcmp(reencoded, valid_bytes, reencoded_len) == 0);
+
+    assert(reencoded_len == hsdt_encoding_len(actual));
+
+    /* Encode again, into buffers that are too small, just right, and too large. */
+    uint8_t *into = malloc(reencoded_len + 1);
+    if (reencoded_len > 0) {
+      assert(hsdt_encode_into(actual, into, reencoded_len - 1) == reencoded_len);
+    }
+    assert(hsdt_encode_into(actual, into, reencoded_len) == reencoded_len);
+    assert(memcmp(into, valid_bytes, reencoded_len) == 0);
+    assert(hsdt_encode_into(actual, into, reencoded_len + 1) == reencoded_len);
+    assert(memcmp(into, valid_bytes, reencoded_len) == 0);
+    free(into);
+
+    /* Encode again, in chunks of various sizes. */
+    for (size_t chunk_len = 1; chunk_len <= 10; chunk_len += 3) {
+      Collect collect = { malloc(reencoded_len), 0, chunk_len };
+      uint8_t chunk[10];
+      assert(hsdt_encode_stream(actual, chunk, chunk_len, collect_write, &collect));
+      assert(collect.len == reencoded_len);
+      assert(memcmp(collect.buf, valid_bytes, reencoded_len) == 0);
+      free(collect.buf);
+    }
+
+    /* Decode again, feeding the input one byte at a time. */
+    HSDT_Value streamed;
+    HSDT_Dec_State state;
+    hsdt_dec_init_with(&opts, &state, &streamed, HSDT_DEFAULT_MAX_DEPTH);
+    for (size_t i = 0; i < valid_bytes_len; i++) {
+      assert(hsdt_dec_feed(&state, valid_bytes + i, 1, &consumed) == (i + 1 == valid_bytes_len ? HSDT_ERR_NONE : HSDT_ERR_EOF));
+      assert(consumed == 1);
+    }
+    hsdt_dec_free(&state);
+    assert(hsdt_value_eq(streamed, expected));
+
+    /* Decode again, into a view of the input. */
+    HSDT_View view;
+    assert(hsdt_decode_view(valid_bytes, valid_bytes_len, &view, &consumed, HSDT_DEFAULT_MAX_DEPTH) == HSDT_ERR_NONE);
+    assert(consumed == valid_bytes_len);
+    HSDT_Value copied = hsdt_view_to_value(view);
+    assert(hsdt_value_eq(copied, expected));
+    hsdt_view_free(view);
+
+    /* Decode again, into an arena. Decoding twice forces in-place growth as well as new chunks. */
+    HSDT_Arena arena;
+    hsdt_arena_init(&arena);
+    for (int i = 0; i < 2; i++) {
+      HSDT_Value in_arena;
+      assert(hsdt_decode_arena(&arena, valid_bytes, valid_bytes_len, &in_arena, &consumed) == HSDT_ERR_NONE);
+      assert(consumed == valid_bytes_len);
+      assert(hsdt_value_eq(in_arena, expected));
+      hsdt_arena_reset(&arena);
+    }
+    hsdt_arena_free(&arena);
 
-  size_t reencoded_len;
-  uint8_t *reencoded = hsdt_encode(actual, &reencoded_len);
-  // print_buf(reencoded, reencoded_len);
-  assert(memcmp(reencoded, valid_bytes, reencoded_len) == 0);
+    /* Decode again, lazily, with and without validating everything up front. */
+    for (int validate = 0; validate < 2; validate++) {
+      HSDT_Value lazy;
+      assert(hsdt_decode_lazy(valid_bytes, valid_bytes_len, &lazy, &consumed, validate) == HSDT_ERR_NONE);
+      assert(consumed == valid_bytes_len);
+      assert(hsdt_value_eq(lazy, expected) && hsdt_value_eq(expected, lazy));
+      assert(hsdt_encoding_len(lazy) == valid_bytes_len);
+      uint8_t *lazy_enc = malloc(valid_bytes_len);
+      assert(hsdt_encode_into(lazy, lazy_enc, valid_bytes_len) == valid_bytes_len);
+      assert(memcmp(lazy_enc, valid_bytes, valid_bytes_len) == 0);
+      free(lazy_enc);
+      /* Encode once more, which leaves the value lazy in the new encoding. */
+      lazy_enc = hsdt_encode_lazy(&lazy, &reencoded_len);
+      assert(reencoded_len == valid_bytes_len && memcmp(lazy_enc, valid_bytes, valid_bytes_len) == 0);
+      assert(hsdt_value_eq(lazy, expected));
+      hsdt_value_free(lazy);
+      free(lazy_enc);
+    }
 
-  assert(reencoded_len == hsdt_encoding_len(actual));
+    /* Decode again, onto a tape. */
+    HSDT_Tape tape;
+    hsdt_tape_init(&tape);
+    assert(hsdt_decode_tape(&tape, valid_bytes, valid_bytes_len, &consumed, HSDT_DEFAULT_MAX_DEPTH) == HSDT_ERR_NONE);
+    assert(consumed == valid_bytes_len);
+    assert(hsdt_tape_skip(&tape, 0) == tape.len);
+    HSDT_Value from_tape = hsdt_tape_to_value(&tape, 0);
+    assert(hsdt_value_eq(from_tape, expected));
+    hsdt_value_free(from_tape);
+    hsdt_tape_free(&tape);
+
+    /* Encode a decoded value such that it becomes lazy. */
+    uint8_t *copied_enc = hsdt_encode_lazy(&copied, &reencoded_len);
+    assert(reencoded_len == valid_bytes_len && memcmp(copied_enc, valid_bytes, valid_bytes_len) == 0);
+    assert(hsdt_value_eq(copied, expected));
+    hsdt_value_free(copied);
+    free(copied_enc);
+    hsdt_value_free(streamed);
+    hsdt_value_free(actual);
+    free(reencoded);
+  }
+
+  /* Decode twice with interned keys, the second decode finds all keys in the table. */
+  HSDT_Intern_Table table;
+  hsdt_intern_init(&table, 64);
+  HSDT_Dec_Options intern_opts = {HSDT_MAP_SORTED, true, &table};
+  for (int i = 0; i < 2; i++) {
+    HSDT_Value interned;
+    size_t consumed;
+    assert(hsdt_decode_with(&intern_opts, valid_bytes, valid_bytes_len, &interned, &consumed) == HSDT_ERR_NONE);
+    assert(consumed == valid_bytes_len);
+    assert(hsdt_value_eq(interned, expected));
+    size_t interned_enc_len;
+    uint8_t *interned_enc = hsdt_encode(interned, &interned_enc_len);
+    assert(interned_enc_len == valid_bytes_len && memcmp(interned_enc, valid_bytes, valid_bytes_len) == 0);
+    free(interned_enc);
+    hsdt_value_free(interned);
+  }
+  hsdt_intern_free(&table);
+
+  /* Decode a batch of the value three times, once without an arena and once with one. */
+  uint8_t *batch = malloc(3 * valid_bytes_len);
+  for (int i = 0; i < 3; i++) {
+    memcpy(batch + i * valid_bytes_len, valid_bytes, valid_bytes_len);
+  }
+  HSDT_Arena batch_arena;
+  hsdt_arena_init(&batch_arena);
+  for (int with_arena = 0; with_arena < 2; with_arena++) {
+    HSDT_Batch_Result results[4];
+    size_t batch_consumed;
+    assert(hsdt_decode_batch(with_arena ? &batch_arena : NULL, batch, 3 * valid_bytes_len, results, 4, &batch_consumed) == 3);
+    assert(batch_consumed == 3 * valid_bytes_len);
+    for (size_t i = 0; i < 3; i++) {
+      assert(results[i].err == HSDT_ERR_NONE && results[i].offset == i * valid_bytes_len && results[i].len == valid_bytes_len);
+      assert(hsdt_value_eq(results[i].val, expected));
+      if (!with_arena) {
+        hsdt_value_free(results[i].val);
+      }
+    }
+    /* Stop once the results are full */
+    assert(hsdt_decode_batch(NULL, batch, 3 * valid_bytes_len, results, 1, &batch_consumed) == 1);
+    assert(batch_consumed == valid_bytes_len);
+    hsdt_value_free(results[0].val);
+  }
+  hsdt_arena_free(&batch_arena);
+
+  /* Decode the batch in parallel, with and without arenas. */
+  HSDT_Pool *pool = hsdt_pool_new(3);
+  HSDT_Arena pool_arenas[3];
+  for (size_t i = 0; i < 3; i++) {
+    hsdt_arena_init(pool_arenas + i);
+  }
+  for (int with_arenas = 0; with_arenas < 2; with_arenas++) {
+    HSDT_Batch_Result results[4];
+    size_t batch_consumed;
+    assert(hsdt_decode_batch_parallel(pool, with_arenas ? pool_arenas : NULL, batch, 3 * valid_bytes_len, results, 4, &batch_consumed) == 3);
+    assert(batch_consumed == 3 * valid_bytes_len);
+    for (size_t i = 0; i < 3; i++) {
+      assert(results[i].err == HSDT_ERR_NONE && results[i].offset == i * valid_bytes_len && results[i].len == valid_bytes_len);
+      assert(hsdt_value_eq(results[i].val, expected));
+      if (!with_arenas) {
+        hsdt_value_free(results[i].val);
+      }
+    }
+  }
+  for (size_t i = 0; i < 3; i++) {
+    hsdt_arena_free(pool_arenas + i);
+  }
+  hsdt_pool_free(pool);
+  free(batch);
+
+  /* The index covers the whole value. */
+  HSDT_Index index;
+  size_t index_consumed;
+  hsdt_index_init(&index);
+  assert(hsdt_index_build(&index, valid_bytes, valid_bytes_len, 0, &index_consumed) == HSDT_ERR_NONE);
+  assert(index_consumed == valid_bytes_len);
+  hsdt_index_free(&index);
+
+  /* A cursor skips over the whole value. */
+  HSDT_Cursor cur;
+  uint8_t *cur_enc;
+  size_t cur_enc_len;
+  hsdt_cursor_init(&cur, valid_bytes, valid_bytes_len);
+  assert(hsdt_cursor_encoding(&cur, &cur_enc, &cur_enc_len) == HSDT_ERR_NONE);
+  assert(cur_enc == valid_bytes && cur_enc_len == valid_bytes_len);
+  assert(hsdt_cursor_next(&cur) == HSDT_ERR_NONE && cur.pos == valid_bytes_len && cur.remaining == 0);
 
   hsdt_value_free(expected);
-  hsdt_value_free(actual);
-  free(reencoded);
   free(valid_bytes);
 }
 
 static void reject(char *hex_input, HSDT_ERR expected_err) {
   assert(expected_err != HSDT_ERR_NONE);
 
-  /* Convert input string (hex encoded, null-delimited) into binary data. */
-  size_t hex_len = strlen(hex_input);
-  size_t valid_bytes_len = hex_len / 2;
-  uint8_t *valid_bytes = malloc(valid_bytes_len);
-  /* https://gist.github.com/xsleonard/7341172 */
-  for (size_t i=0, j=0; j< valid_bytes_len; i+=2, j++)
-    valid_bytes[j] = (hex_input[i] % 32 + 9) % 25 * 16 + (hex_input[i+1] % 32 + 9) % 25;
+  size_t valid_bytes_len;
+  uint8_t *valid_bytes = from_hex(hex_input, &valid_bytes_len);
 
   /* Perform the checks */
   HSDT_Value val;
@@ -71,9 +360,301 @@ static void reject(char *hex_input, HSDT_ERR expected_err) {
   size_t consumed;
   assert(hsdt_decode(valid_bytes, valid_bytes_len, &val, &consumed) == expected_err);
 
+  size_t validated;
+  assert(hsdt_validate(valid_bytes, valid_bytes_len, &validated) == expected_err);
+  assert(validated == consumed);
+
+  HSDT_Dec_Options sorted_opts = {HSDT_MAP_SORTED, true, NULL};
+  assert(hsdt_decode_with(&sorted_opts, valid_bytes, valid_bytes_len, &val, &consumed) == expected_err);
+  assert(consumed == validated);
+  HSDT_Dec_State sorted_state;
+  hsdt_dec_init_with(&sorted_opts, &sorted_state, &val, HSDT_DEFAULT_MAX_DEPTH);
+  assert(hsdt_dec_feed(&sorted_state, valid_bytes, valid_bytes_len, &consumed) == expected_err);
+  hsdt_dec_free(&sorted_state);
+
+  HSDT_Dec_State state;
+  hsdt_dec_init(&state, &val, HSDT_DEFAULT_MAX_DEPTH);
+  assert(hsdt_dec_feed(&state, valid_bytes, valid_bytes_len, &consumed) == expected_err);
+  hsdt_dec_free(&state);
+
+  HSDT_View view;
+  assert(hsdt_decode_view(valid_bytes, valid_bytes_len, &view, &consumed, HSDT_DEFAULT_MAX_DEPTH) == expected_err);
+
+  HSDT_Arena arena;
+  hsdt_arena_init(&arena);
+  assert(hsdt_decode_arena(&arena, valid_bytes, valid_bytes_len, &val, &consumed) == expected_err);
+  hsdt_arena_free(&arena);
+
+  HSDT_Tape tape;
+  hsdt_tape_init(&tape);
+  assert(hsdt_decode_tape(&tape, valid_bytes, valid_bytes_len, &consumed, HSDT_DEFAULT_MAX_DEPTH) == expected_err);
+  assert(tape.len == 0);
+  hsdt_tape_free(&tape);
+
+  assert(hsdt_decode_lazy(valid_bytes, valid_bytes_len, &val, &consumed, true) == expected_err);
+  assert(consumed == validated);
+
+  HSDT_Intern_Table table;
+  hsdt_intern_init(&table, 64);
+  HSDT_Dec_Options intern_opts = {HSDT_MAP_SORTED, false, &table};
+  assert(hsdt_decode_with(&intern_opts, valid_bytes, valid_bytes_len, &val, &consumed) == expected_err);
+  hsdt_intern_free(&table);
+
+  HSDT_Callbacks ignore_all = {0};
+  assert(hsdt_parse(valid_bytes, valid_bytes_len, &ignore_all, NULL, &consumed, NULL, HSDT_DEFAULT_MAX_DEPTH) == expected_err);
+
+  /* In a batch, decoding stops at the invalid value. */
+  uint8_t *batch = malloc(valid_bytes_len + 1);
+  HSDT_Batch_Result results[3];
+  batch[0] = 0xF6;
+  memcpy(batch + 1, valid_bytes, valid_bytes_len);
+  size_t num_results = hsdt_decode_batch(NULL, batch, valid_bytes_len + 1, results, 3, &consumed);
+  assert(consumed == 1 && results[0].err == HSDT_ERR_NONE && results[0].val.tag == HSDT_NULL);
+  assert(valid_bytes_len == 0 || (num_results == 2 && results[1].err == expected_err));
+  assert(valid_bytes_len == 0 || (results[1].offset == 1 && results[1].len == validated));
+  HSDT_Pool *pool = hsdt_pool_new(2);
+  HSDT_Batch_Result parallel[3];
+  size_t parallel_consumed;
+  assert(hsdt_decode_batch_parallel(pool, NULL, batch, valid_bytes_len + 1, parallel, 3, &parallel_consumed) == num_results);
+  assert(parallel_consumed == consumed && parallel[0].err == HSDT_ERR_NONE);
+  assert(valid_bytes_len == 0 || (parallel[1].err == expected_err && parallel[1].len == results[1].len));
+  hsdt_pool_free(pool);
+  free(batch);
+
   free(valid_bytes);
 }
 
+/* Decode with a bounded nesting depth, once with a heap stack and once with a caller-provided one. */
+static void check_depth(char *hex_input, size_t max_depth, HSDT_ERR expected_err) {
+  size_t bytes_len;
+  uint8_t *bytes = from_hex(hex_input, &bytes_len);
+
+  HSDT_Value val;
+  size_t consumed;
+  HSDT_Dec_Frame stack[8];
+  assert(max_depth <= 8);
+
+  assert(hsdt_decode_stack(bytes, bytes_len, &val, &consumed, NULL, max_depth) == expected_err);
+  if (expected_err == HSDT_ERR_NONE) {
+    assert(consumed == bytes_len);
+    hsdt_value_free(val);
+  }
+
+  assert(hsdt_decode_stack(bytes, bytes_len, &val, &consumed, stack, max_depth) == expected_err);
+  if (expected_err == HSDT_ERR_NONE) {
+    hsdt_value_free(val);
+  }
+
+  free(bytes);
+}
+
+/* Event callbacks that write a textual trace of the events into a string */
+static bool trace_null(void *ctx) {
+  sds *trace = ctx;
+  *trace = sdscat(*trace, "null ");
+  return true;
+}
+
+static bool trace_boolean(void *ctx, bool val) {
+  sds *trace = ctx;
+  *trace = sdscat(*trace, val ? "true " : "false ");
+  return true;
+}
+
+static bool trace_fp(void *ctx, double val) {
+  sds *trace = ctx;
+  *trace = sdscatprintf(*trace, "%g ", val);
+  return true;
+}
+
+static bool trace_byte_string(void *ctx, uint8_t *str, size_t len) {
+  sds *trace = ctx;
+  *trace = sdscatprintf(*trace, "b:%.*s ", (int) len, (char *) str);
+  return true;
+}
+
+static bool trace_utf8_string(void *ctx, uint8_t *str, size_t len) {
+  sds *trace = ctx;
+  *trace = sdscatprintf(*trace, "s:%.*s ", (int) len, (char *) str);
+  return true;
+}
+
+static bool trace_start_array(void *ctx, size_t len) {
+  sds *trace = ctx;
+  *trace = sdscatprintf(*trace, "[%zu ", len);
+  return true;
+}
+
+static bool trace_start_map(void *ctx, size_t len) {
+  sds *trace = ctx;
+  *trace = sdscatprintf(*trace, "{%zu ", len);
+  return true;
+}
+
+static bool trace_key(void *ctx, uint8_t *key, size_t len) {
+  sds *trace = ctx;
+  *trace = sdscatprintf(*trace, "k:%.*s ", (int) len, (char *) key);
+  return true;
+}
+
+static bool trace_end(void *ctx) {
+  sds *trace = ctx;
+  *trace = sdscat(*trace, "end ");
+  /* Stop after the first collection, to test aborting */
+  return strstr(*trace, "stop") == NULL;
+}
+
+static const HSDT_Callbacks trace_callbacks = {
+  trace_null, trace_boolean, trace_fp, trace_byte_string, trace_utf8_string,
+  trace_start_array, trace_start_map, trace_key, trace_end
+};
+
+static void check_events(char *hex_input, char *expected_trace, HSDT_ERR expected_err) {
+  size_t bytes_len;
+  uint8_t *bytes = from_hex(hex_input, &bytes_len);
+  HSDT_Parse_Frame stack[8];
+  size_t consumed;
+
+  sds trace = sdsempty();
+  assert(hsdt_parse(bytes, bytes_len, &trace_callbacks, &trace, &consumed, stack, 8) == expected_err);
+  assert(strcmp(trace, expected_trace) == 0);
+  sdsfree(trace);
+
+  free(bytes);
+}
+
+/*
+ * Validate a utf8 string of `len` bytes from `str` with every available
+ * implementation and check that all agree on the result.
+ */
+static void check_utf8_impls(uint8_t *str, size_t len) {
+  uint8_t *enc = malloc(len + 3);
+  enc[0] = 0x79;
+  enc[1] = len >> 8;
+  enc[2] = len;
+  memcpy(enc + 3, str, len);
+
+  size_t consumed;
+  assert(hsdt_set_utf8_impl(HSDT_UTF8_SCALAR));
+  HSDT_ERR expected = hsdt_validate(enc, len + 3, &consumed);
+
+  HSDT_UTF8_IMPL impls[] = {HSDT_UTF8_SSE42, HSDT_UTF8_AVX2};
+  for (size_t i = 0; i < 2; i++) {
+    if (hsdt_set_utf8_impl(impls[i])) {
+      assert(hsdt_validate(enc, len + 3, &consumed) == expected);
+    }
+  }
+
+  assert(hsdt_set_utf8_impl(HSDT_UTF8_AUTO));
+  free(enc);
+}
+
+#ifdef COLLECTION_SIZE_IN_BYTES
+/* Build an array of `len` values, cycling through a string, an empty array, and a nested array. */
+static HSDT_Value sample_array(size_t len) {
+  HSDT_Value array;
+  array.tag = HSDT_ARRAY;
+  array.array.len = len;
+  array.array.elems = malloc(len * sizeof(HSDT_Value));
+  for (size_t i = 0; i < len; i++) {
+    HSDT_Value *elem = array.array.elems + i;
+    if (i % 3 == 0) {
+      elem->tag = HSDT_UTF8_STRING;
+      elem->utf8_string = sdsnew("aaaa");
+    } else {
+      elem->tag = HSDT_ARRAY;
+      elem->array.len = i % 3 - 1;
+      elem->array.elems = NULL;
+      if (elem->array.len > 0) {
+        elem->array.elems = malloc(sizeof(HSDT_Value));
+        elem->array.elems[0].tag = HSDT_NULL;
+      }
+    }
+  }
+  return array;
+}
+
+/* Checks that only apply when collection headers give the size of their content. */
+static void check_sizes_in_bytes(void) {
+  /* Content has to fill its collection exactly */
+  reject("81", HSDT_ERR_EOF); /* Not enough data */
+  reject("a1", HSDT_ERR_EOF); /* Not enough data */
+  reject("8262616161", HSDT_ERR_CANONIC_LENGTH); /* A string crosses the end of the array */
+  reject("a2616161", HSDT_ERR_CANONIC_LENGTH); /* A key without a value */
+  reject("a3616161f6", HSDT_ERR_CANONIC_LENGTH); /* A value crosses the end of the map */
+  reject("81fb3ff8000000000000", HSDT_ERR_CANONIC_LENGTH); /* A float crosses the end of the array */
+  reject("a86162616161616161", HSDT_ERR_CANONIC_ORDER); /* Keys not sorted */
+  reject("a3406161", HSDT_ERR_UTF8_KEY); /* Key is a byte string */
+  reject("8261ff", HSDT_ERR_UTF8); /* Invalid utf8 */
+  reject("9801f6", HSDT_ERR_CANONIC_LENGTH); /* Length could be in the tag */
+  reject("81fc", HSDT_ERR_TAG); /* Invalid additional type */
+
+  /* The length of a collection is known from its header alone */
+  uint8_t header[] = {0x99, 0x01, 0x00, 0xff, 0xff};
+  assert(hsdt_decode_len(header, sizeof(header)) == 3 + 256);
+
+  /* Skipping does not look inside of collections, reading does */
+  size_t bytes_len;
+  uint8_t *bytes = from_hex("8581fc8180f5", &bytes_len); /* [<invalid>, [[]], true] */
+  HSDT_Cursor cur;
+  HSDT_Cursor_Item item;
+  bool found;
+  size_t consumed;
+  hsdt_cursor_init(&cur, bytes, bytes_len);
+  assert(hsdt_cursor_index(&cur, 2, &found) == HSDT_ERR_NONE && found);
+  assert(hsdt_cursor_read(&cur, &item) == HSDT_ERR_NONE && item.tag == HSDT_TRUE);
+  assert(hsdt_validate(bytes, bytes_len, &consumed) == HSDT_ERR_TAG);
+  free(bytes);
+
+  /* Encoding deeply nested values takes linear time */
+  size_t depth = 100000;
+  HSDT_Value deep;
+  HSDT_Value *inner = &deep;
+  for (size_t i = 0; i < depth; i++) {
+    inner->tag = HSDT_ARRAY;
+    inner->array.len = 1;
+    inner->array.elems = malloc(sizeof(HSDT_Value));
+    inner = inner->array.elems;
+  }
+  inner->tag = HSDT_NULL;
+  size_t deep_len = hsdt_encoding_len(deep);
+  size_t deep_enc_len;
+  uint8_t *deep_enc = hsdt_encode(deep, &deep_enc_len);
+  assert(deep_enc_len == deep_len && hsdt_decode_len(deep_enc, deep_enc_len) == deep_len);
+  assert(deep_enc[0] == 0x9a && deep_enc[deep_len - 2] == 0x81 && deep_enc[deep_len - 1] == 0xf6);
+  HSDT_Value deep_decoded;
+  assert(hsdt_decode_stack(deep_enc, deep_enc_len, &deep_decoded, &consumed, NULL, SIZE_MAX) == HSDT_ERR_NONE);
+  assert(consumed == deep_len && hsdt_value_eq(deep, deep_decoded));
+  hsdt_value_free(deep_decoded);
+  hsdt_value_free(deep);
+  free(deep_enc);
+
+  /* Parallel encoding and validation agree with the serial ones */
+  HSDT_Value large = sample_array(30000);
+  size_t large_len;
+  uint8_t *large_enc = hsdt_encode(large, &large_len);
+  assert(large_len == hsdt_encoding_len(large) && large_len > 65536);
+  for (size_t threads = 1; threads <= 4; threads++) {
+    HSDT_Pool *pool = hsdt_pool_new(threads);
+    size_t parallel_len;
+    uint8_t *parallel_enc = hsdt_encode_parallel(pool, large, &parallel_len);
+    assert(parallel_len == large_len && memcmp(parallel_enc, large_enc, large_len) == 0);
+    free(parallel_enc);
+    assert(hsdt_validate_parallel(pool, large_enc, large_len, &consumed) == HSDT_ERR_NONE && consumed == large_len);
+    uint8_t original = large_enc[large_len / 2];
+    large_enc[large_len / 2] = 0xff;
+    size_t serial_consumed;
+    HSDT_ERR serial_err = hsdt_validate(large_enc, large_len, &serial_consumed);
+    assert(serial_err != HSDT_ERR_NONE);
+    assert(hsdt_validate_parallel(pool, large_enc, large_len, &consumed) == serial_err && consumed == serial_consumed);
+    large_enc[large_len / 2] = original;
+    hsdt_pool_free(pool);
+  }
+  free(large_enc);
+  hsdt_value_free(large);
+}
+#endif
+
 int main(void) {
   HSDT_Value expected;
 
@@ -169,9 +750,609 @@ int main(void) {
   raxInsert(elems[1].map, (unsigned char*) "b", 1, (void *) inner, NULL);
   check("826161a161626163", expected);
 
+#ifdef COLLECTION_SIZE_IN_BYTES
+  check_sizes_in_bytes();
+#else
   /* Stuff that must be rejected */
   reject("81", HSDT_ERR_EOF); /* Not enough data */
   reject("9a80003f6581", HSDT_ERR_EOF); /* Not enough data */
+  reject("a1", HSDT_ERR_EOF); /* Not enough data */
+  reject("8261616362", HSDT_ERR_EOF); /* Not enough data */
+  reject("a261626163616161", HSDT_ERR_CANONIC_ORDER); /* Keys not sorted */
+  reject("a1616141", HSDT_ERR_EOF); /* Not enough data */
+  reject("b818616180", HSDT_ERR_EOF); /* Not enough data for the announced entries */
+  reject("bb0000000100000000616180", HSDT_ERR_EOF); /* Not enough data for the announced entries */
+  reject("a140f6", HSDT_ERR_UTF8_KEY); /* Key is a byte string */
+  reject("8261ff", HSDT_ERR_UTF8); /* Invalid utf8 */
+  reject("9801f6", HSDT_ERR_CANONIC_LENGTH); /* Length could be in the tag */
+  reject("fb7ff8000000000001", HSDT_ERR_INVALID_NAN); /* Non-canonic NaN */
+  reject("81fc", HSDT_ERR_TAG); /* Invalid additional type */
+
+  /* Key lookup in views */
+  size_t map_len;
+  uint8_t *map_bytes = from_hex("a3616141016262624102636363634103", &map_len); /* {"a": h'01', "bb": h'02', "ccc": h'03'} */
+  HSDT_View view;
+  size_t consumed;
+  assert(hsdt_decode_view(map_bytes, map_len, &view, &consumed, HSDT_DEFAULT_MAX_DEPTH) == HSDT_ERR_NONE);
+  assert(view.tag == HSDT_MAP && view.map.len == 3);
+  assert(hsdt_view_map_get(view.map, (uint8_t *) "a", 1) == &view.map.entries[0].val);
+  assert(hsdt_view_map_get(view.map, (uint8_t *) "ccc", 3) == &view.map.entries[2].val);
+  assert(hsdt_view_map_get(view.map, (uint8_t *) "b", 1) == NULL);
+  assert(hsdt_view_map_get(view.map, (uint8_t *) "d", 1) == NULL);
+  assert(view.map.entries[1].key.ptr == map_bytes + 6); /* No copy was made */
+  hsdt_view_free(view);
+
+  /* Key lookup in both representations of maps */
+  for (HSDT_MAP_REPR repr = HSDT_MAP_RAX; repr <= HSDT_MAP_SORTED; repr++) {
+    HSDT_Value map;
+    HSDT_Dec_Options opts = {repr, false, NULL};
+    assert(hsdt_decode_with(&opts, map_bytes, map_len, &map, &consumed) == HSDT_ERR_NONE);
+    assert(map.tag == (repr == HSDT_MAP_RAX ? HSDT_MAP : HSDT_SORTED_MAP));
+    HSDT_Value *found = hsdt_map_get(&map, (uint8_t *) "bb", 2);
+    assert(found != NULL && found->tag == HSDT_BYTE_STRING && found->byte_string[0] == 2);
+    assert(hsdt_map_get(&map, (uint8_t *) "a", 1) != NULL);
+    assert(hsdt_map_get(&map, (uint8_t *) "ccc", 3) != NULL);
+    assert(hsdt_map_get(&map, (uint8_t *) "b", 1) == NULL);
+    assert(hsdt_map_get(&map, (uint8_t *) "", 0) == NULL);
+    assert(hsdt_map_get(&map, (uint8_t *) "d", 1) == NULL);
+    hsdt_value_free(map);
+  }
+  /* The options only apply to the decode they are passed to */
+  HSDT_Value map;
+  assert(hsdt_decode_with(NULL, map_bytes, map_len, &map, &consumed) == HSDT_ERR_NONE && map.tag == HSDT_MAP);
+  hsdt_value_free(map);
+  assert(hsdt_decode(map_bytes, map_len, &map, &consumed) == HSDT_ERR_NONE && map.tag == HSDT_MAP);
+  hsdt_value_free(map);
+  free(map_bytes);
+
+  /* Interned keys are shared between decoded values, and compared by address */
+  uint8_t *msg_bytes = from_hex("a36161f66162f56163f4", &map_len); /* {"a": null, "b": true, "c": false} */
+  HSDT_Intern_Table table;
+  HSDT_Value msgs[2];
+  hsdt_intern_init(&table, 2);
+  HSDT_Dec_Options intern_opts = {HSDT_MAP_SORTED, false, &table};
+  for (size_t i = 0; i < 2; i++) {
+    assert(hsdt_decode_with(&intern_opts, msg_bytes, map_len, &msgs[i], &consumed) == HSDT_ERR_NONE);
+    assert(msgs[i].tag == HSDT_SORTED_MAP);
+  }
+  HSDT_Key *key_a = hsdt_intern_find(&table, (uint8_t *) "a", 1);
+  HSDT_Key *key_b = hsdt_intern(&table, (uint8_t *) "b", 1);
+  assert(key_a != NULL && key_b != NULL && key_a != key_b);
+  assert(table.len == 2); /* The table is full, "c" was not interned */
+  assert(hsdt_intern_find(&table, (uint8_t *) "c", 1) == NULL && hsdt_intern(&table, (uint8_t *) "c", 1) == NULL);
+  for (size_t i = 0; i < 2; i++) {
+    assert(msgs[i].sorted_map.entries[0].key == key_a && msgs[i].sorted_map.entries[1].key == key_b);
+    assert(!msgs[i].sorted_map.entries[2].key->interned);
+    assert(hsdt_map_get_interned(&msgs[i], key_b) == &msgs[i].sorted_map.entries[1].val);
+    assert(hsdt_map_get(&msgs[i], (uint8_t *) "c", 1) == &msgs[i].sorted_map.entries[2].val);
+    hsdt_value_free(msgs[i]);
+  }
+  /* The streaming decoder interns keys as well */
+  HSDT_Dec_State intern_state;
+  hsdt_dec_init_with(&intern_opts, &intern_state, &msgs[0], HSDT_DEFAULT_MAX_DEPTH);
+  for (size_t i = 0; i < map_len; i++) {
+    assert(hsdt_dec_feed(&intern_state, msg_bytes + i, 1, &consumed) == (i + 1 == map_len ? HSDT_ERR_NONE : HSDT_ERR_EOF));
+  }
+  hsdt_dec_free(&intern_state);
+  assert(msgs[0].tag == HSDT_SORTED_MAP && msgs[0].sorted_map.entries[1].key == key_b);
+  hsdt_value_free(msgs[0]);
+  /* Maps decoded without the table are searched by content, whatever their representation */
+  size_t nested_len;
+  uint8_t *nested_bytes = from_hex("81a36161f66162f56163f4", &nested_len); /* [{"a": null, "b": true, "c": false}] */
+  for (int repr = 0; repr < 3; repr++) {
+    HSDT_Dec_Options plain_opts = {repr == 1 ? HSDT_MAP_SORTED : HSDT_MAP_RAX, false, NULL};
+    if (repr == 2) {
+      assert(hsdt_decode_lazy(nested_bytes, nested_len, &msgs[0], &consumed, true) == HSDT_ERR_NONE);
+      assert(msgs[0].array.elems[0].tag == HSDT_LAZY);
+    } else {
+      assert(hsdt_decode_with(&plain_opts, nested_bytes, nested_len, &msgs[0], &consumed) == HSDT_ERR_NONE);
+    }
+    HSDT_Value *b = hsdt_map_get_interned(&msgs[0].array.elems[0], key_b);
+    assert(b != NULL && b->tag == HSDT_TRUE);
+    hsdt_value_free(msgs[0]);
+  }
+  free(nested_bytes);
+  hsdt_intern_free(&table);
+  free(msg_bytes);
+
+  /* Interning many keys grows the table */
+  hsdt_intern_init(&table, SIZE_MAX);
+  HSDT_Key *keys[1000];
+  for (size_t i = 0; i < 1000; i++) {
+    keys[i] = hsdt_intern(&table, (uint8_t *) &i, sizeof(size_t));
+  }
+  for (size_t i = 0; i < 1000; i++) {
+    assert(hsdt_intern_find(&table, (uint8_t *) &i, sizeof(size_t)) == keys[i]);
+  }
+  hsdt_intern_free(&table);
+
+  /* Lazy values are decoded on access: {"a": [[], "x"], "b": {"c": h'ff'}, "d": 1.5} */
+  uint8_t *lazy_bytes = from_hex("a36161828061786162a1616341ff6164fb3ff8000000000000", &map_len);
+  HSDT_Value lazy;
+  assert(hsdt_decode_lazy(lazy_bytes, map_len, &lazy, &consumed, true) == HSDT_ERR_NONE);
+  assert(consumed == map_len);
+  HSDT_Value *lazy_a = hsdt_map_get(&lazy, (uint8_t *) "a", 1);
+  HSDT_Value *lazy_b = hsdt_map_get(&lazy, (uint8_t *) "b", 1);
+  assert(lazy_a->tag == HSDT_LAZY && lazy_b->tag == HSDT_LAZY);
+  assert(hsdt_value_type(lazy_a) == HSDT_ARRAY && hsdt_value_type(lazy_b) == HSDT_MAP);
+  assert(lazy_a->lazy.enc == lazy_bytes + 3 && lazy_a->lazy.len == 4);
+  assert(hsdt_value_type(hsdt_array_get(lazy_a, 0)) == HSDT_ARRAY);
+  assert(lazy_a->tag == HSDT_ARRAY && lazy_a->array.elems[0].tag == HSDT_LAZY);
+  assert(hsdt_array_get(lazy_a, 2) == NULL);
+  assert(hsdt_array_get(hsdt_array_get(lazy_a, 0), 0) == NULL);
+  assert(hsdt_map_get(lazy_b, (uint8_t *) "c", 1)->tag == HSDT_BYTE_STRING);
+  assert(hsdt_map_get(&lazy, (uint8_t *) "d", 1)->fp == 1.5);
+  size_t lazy_enc_len;
+  uint8_t *lazy_enc = hsdt_encode(lazy, &lazy_enc_len);
+  assert(lazy_enc_len == map_len && memcmp(lazy_enc, lazy_bytes, map_len) == 0);
+  free(lazy_enc);
+  hsdt_value_free(lazy);
+
+  /* Lazy values compare like decoded ones, also where the encodings differ: [[0.0]], [[-0.0]], [[1.0]] */
+  size_t zeros_len;
+  uint8_t *zero = from_hex("8181fb0000000000000000", &zeros_len);
+  uint8_t *neg_zero = from_hex("8181fb8000000000000000", &zeros_len);
+  uint8_t *one = from_hex("8181fb3ff0000000000000", &zeros_len);
+  HSDT_Value zero_decoded, neg_zero_decoded, zero_lazy, neg_zero_lazy, one_lazy;
+  assert(hsdt_decode(zero, zeros_len, &zero_decoded, &consumed) == HSDT_ERR_NONE);
+  assert(hsdt_decode(neg_zero, zeros_len, &neg_zero_decoded, &consumed) == HSDT_ERR_NONE);
+  assert(hsdt_decode_lazy(zero, zeros_len, &zero_lazy, &consumed, true) == HSDT_ERR_NONE);
+  assert(hsdt_decode_lazy(neg_zero, zeros_len, &neg_zero_lazy, &consumed, true) == HSDT_ERR_NONE);
+  assert(hsdt_decode_lazy(one, zeros_len, &one_lazy, &consumed, true) == HSDT_ERR_NONE);
+  HSDT_Value whole_lazy = {.tag = HSDT_LAZY, .lazy = {neg_zero + 1, zeros_len - 1}};
+  assert(hsdt_value_eq(zero_decoded, neg_zero_decoded));
+  assert(hsdt_value_eq(zero_lazy, neg_zero_lazy) && hsdt_value_eq(neg_zero_lazy, zero_lazy));
+  assert(hsdt_value_eq(zero_decoded, neg_zero_lazy) && hsdt_value_eq(neg_zero_lazy, zero_decoded));
+  assert(hsdt_value_eq(zero_decoded.array.elems[0], whole_lazy) && hsdt_value_eq(whole_lazy, zero_lazy.array.elems[0]));
+  assert(!hsdt_value_eq(one_lazy, zero_lazy) && !hsdt_value_eq(zero_decoded, one_lazy));
+  assert(!hsdt_value_eq(one_lazy.array.elems[0], zero_decoded.array.elems[0].array.elems[0]));
+  hsdt_value_free(zero_decoded);
+  hsdt_value_free(neg_zero_decoded);
+  hsdt_value_free(zero_lazy);
+  hsdt_value_free(neg_zero_lazy);
+  hsdt_value_free(one_lazy);
+  free(zero);
+  free(neg_zero);
+  free(one);
+
+  /* Encoding lazily copies what has not been accessed, and serializes only the changed paths */
+  assert(hsdt_decode_lazy(lazy_bytes, map_len, &lazy, &consumed, true) == HSDT_ERR_NONE);
+  hsdt_map_get(hsdt_map_get(&lazy, (uint8_t *) "b", 1), (uint8_t *) "c", 1)->byte_string[0] = 0x00;
+  lazy_bytes[6] = 0xff; /* Would be rejected if "a" was looked at */
+  uint8_t *reencoded = hsdt_encode_lazy(&lazy, &lazy_enc_len);
+  lazy_bytes[6] = 'x';
+  assert(lazy_enc_len == map_len && reencoded[6] == 0xff && reencoded[13] == 0x00);
+  reencoded[6] = 'x';
+  lazy_a = hsdt_map_get(&lazy, (uint8_t *) "a", 1);
+  lazy_b = hsdt_map_get(&lazy, (uint8_t *) "b", 1);
+  assert(lazy_a->tag == HSDT_LAZY && lazy_a->lazy.enc == reencoded + 3 && lazy_a->lazy.len == 4);
+  assert(lazy_b->tag == HSDT_LAZY && lazy_b->lazy.enc == reencoded + 9 && lazy_b->lazy.len == 5);
+  /* Nothing points into the previous encoding anymore */
+  lazy_enc = hsdt_encode_lazy(&lazy, &lazy_enc_len);
+  free(reencoded);
+  reencoded = hsdt_encode(lazy, &lazy_enc_len);
+  assert(lazy_enc_len == map_len && memcmp(reencoded, lazy_enc, map_len) == 0);
+  lazy_enc[13] = 0xff;
+  assert(memcmp(lazy_enc, lazy_bytes, map_len) == 0);
+  hsdt_value_free(lazy);
+  free(lazy_enc);
+  free(reencoded);
+
+  /* Deferred validation only fails once the invalid part is decoded */
+  lazy_bytes[6] = 0xff; /* "x" is no valid utf8 anymore */
+  assert(hsdt_decode_lazy(lazy_bytes, map_len, &lazy, &consumed, true) == HSDT_ERR_UTF8);
+  assert(hsdt_decode_lazy(lazy_bytes, map_len, &lazy, &consumed, false) == HSDT_ERR_NONE);
+  assert(consumed == map_len);
+  lazy_a = hsdt_map_get(&lazy, (uint8_t *) "a", 1);
+  assert(hsdt_lazy_load(lazy_a) == HSDT_ERR_UTF8 && lazy_a->tag == HSDT_LAZY);
+  assert(hsdt_array_get(lazy_a, 0) == NULL);
+  assert(hsdt_map_get(&lazy, (uint8_t *) "b", 1) != NULL);
+  hsdt_value_free(lazy);
+  /* The structure of lazy values is always checked */
+  lazy_bytes[3] = 0x83;
+  assert(hsdt_decode_lazy(lazy_bytes, map_len, &lazy, &consumed, false) == HSDT_ERR_UTF8_KEY);
+  lazy_bytes[3] = 0x98;
+  lazy_bytes[4] = 0x01;
+  assert(hsdt_decode_lazy(lazy_bytes, map_len, &lazy, &consumed, false) == HSDT_ERR_CANONIC_LENGTH);
+  free(lazy_bytes);
+
+  /* A parallel batch of many values stops at the first one that fails to decode, like a serial one */
+  uint8_t many[1000];
+  for (size_t i = 0; i < 1000; i += 2) {
+    many[i] = 0x61;
+    many[i + 1] = i == 600 ? 0xff : 'x';
+  }
+  HSDT_Batch_Result serial_results[500];
+  HSDT_Batch_Result parallel_results[500];
+  size_t serial_consumed;
+  size_t parallel_consumed;
+  assert(hsdt_decode_batch(NULL, many, 1000, serial_results, 500, &serial_consumed) == 301);
+  assert(serial_consumed == 600 && serial_results[300].err == HSDT_ERR_UTF8);
+  for (size_t threads = 1; threads <= 4; threads++) {
+    HSDT_Pool *pool = hsdt_pool_new(threads);
+    assert(hsdt_pool_threads(pool) == threads);
+    assert(hsdt_decode_batch_parallel(pool, NULL, many, 1000, parallel_results, 500, &parallel_consumed) == 301);
+    assert(parallel_consumed == 600 && parallel_results[300].err == HSDT_ERR_UTF8);
+    for (size_t i = 0; i < 300; i++) {
+      assert(hsdt_value_eq(serial_results[i].val, parallel_results[i].val));
+      hsdt_value_free(parallel_results[i].val);
+    }
+    hsdt_pool_free(pool);
+  }
+  for (size_t i = 0; i < 300; i++) {
+    hsdt_value_free(serial_results[i].val);
+  }
+
+  /* Large arrays and maps are encoded in parallel, with the same result */
+  uint8_t large[3 + 2000 * 11];
+  for (int is_map = 0; is_map < 2; is_map++) {
+    size_t large_len = 3;
+    large[0] = is_map ? 0xb9 : 0x99;
+    large[1] = 0x07;
+    large[2] = 0xd0;
+    for (size_t i = 0; i < 2000; i++) {
+      if (is_map) {
+        large_len += sprintf((char *) large + large_len, "%c%05d", 0x65, (int) i);
+      }
+      if (i % 3 == 0) {
+        large[large_len++] = 0x60 + i % 7;
+        memset(large + large_len, 'a', i % 7);
+        large_len += i % 7;
+      } else {
+        large[large_len++] = i % 3 == 1 ? 0xf6 : 0x80;
+      }
+    }
+    for (HSDT_MAP_REPR repr = HSDT_MAP_RAX; repr <= HSDT_MAP_SORTED; repr++) {
+      HSDT_Value large_val;
+      HSDT_Dec_Options opts = {repr, false, NULL};
+      assert(hsdt_decode_with(&opts, large, large_len, &large_val, &consumed) == HSDT_ERR_NONE && consumed == large_len);
+      for (size_t threads = 1; threads <= 4; threads++) {
+        HSDT_Pool *pool = hsdt_pool_new(threads);
+        size_t large_enc_len;
+        uint8_t *large_enc = hsdt_encode_parallel(pool, large_val, &large_enc_len);
+        assert(large_enc_len == large_len && memcmp(large_enc, large, large_len) == 0);
+        free(large_enc);
+        hsdt_pool_free(pool);
+      }
+      hsdt_value_free(large_val);
+    }
+  }
+
+  /* Parallel validation of a large document finds the same first error as serial validation */
+  uint8_t *huge = malloc(3 + 10000 * 16);
+  for (int is_map = 0; is_map < 2; is_map++) {
+    size_t huge_len = 3;
+    huge[0] = is_map ? 0xb9 : 0x99;
+    huge[1] = 0x27;
+    huge[2] = 0x10;
+    for (size_t i = 0; i < 10000; i++) {
+      if (is_map) {
+        huge_len += sprintf((char *) huge + huge_len, "%c%05d", 0x65, (int) i);
+      }
+      char *entry = i % 3 == 0 ? "\x64" "aaaa" : i % 3 == 1 ? "\xfb\x3f\xf8\x00\x00\x00\x00\x00\x00" : "\x82\xf6\x61\x62";
+      size_t entry_len = i % 3 == 0 ? 5 : i % 3 == 1 ? 9 : 4;
+      memcpy(huge + huge_len, entry, entry_len);
+      huge_len += entry_len;
+    }
+    uint8_t replacements[] = {0xff, 0x7f, 0x00, 0x65, 0x9b};
+    for (size_t threads = 1; threads <= 4; threads++) {
+      HSDT_Pool *pool = hsdt_pool_new(threads);
+      size_t serial_consumed;
+      assert(hsdt_validate_parallel(pool, huge, huge_len, &parallel_consumed) == HSDT_ERR_NONE && parallel_consumed == huge_len);
+      for (size_t at = 1; at < huge_len; at += 4999) {
+        uint8_t original = huge[at];
+        for (size_t r = 0; r < sizeof(replacements); r++) {
+          huge[at] = replacements[r];
+          HSDT_ERR serial_err = hsdt_validate(huge, huge_len, &serial_consumed);
+          assert(hsdt_validate_parallel(pool, huge, huge_len, &parallel_consumed) == serial_err && parallel_consumed == serial_consumed);
+        }
+        huge[at] = original;
+        HSDT_ERR serial_err = hsdt_validate(huge, at, &serial_consumed);
+        assert(serial_err == HSDT_ERR_EOF);
+        assert(hsdt_validate_parallel(pool, huge, at, &parallel_consumed) == serial_err && parallel_consumed == serial_consumed);
+      }
+      hsdt_pool_free(pool);
+    }
+  }
+  free(huge);
+
+  /* Strings are stored inline up to HSDT_SHORT_STRING_MAX bytes */
+  uint8_t *str_bytes = from_hex("826f6f6f6f6f6f6f6f6f6f6f6f6f6f6f6f7070707070707070707070707070707070", &map_len);
+  HSDT_Value strs;
+  HSDT_Dec_Options short_opts = {HSDT_MAP_RAX, true, NULL};
+  assert(hsdt_decode_with(&short_opts, str_bytes, map_len, &strs, &consumed) == HSDT_ERR_NONE);
+  assert(strs.array.elems[0].tag == HSDT_SHORT_UTF8_STRING && strs.array.elems[1].tag == HSDT_UTF8_STRING);
+  size_t str_len;
+  assert(memcmp(hsdt_value_str(&strs.array.elems[0], &str_len), "ooooooooooooooo", 15) == 0 && str_len == 15);
+  assert(memcmp(hsdt_value_str(&strs.array.elems[1], &str_len), "pppppppppppppppp", 16) == 0 && str_len == 16);
+  hsdt_value_free(strs);
+  free(str_bytes);
+
+  /* Navigating a tape: {"a": [null, "xy"], "b": true, "c": {"d": 1.5}} */
+  uint8_t *tape_bytes = from_hex("a3616182f66278796162f56163a16164fb3ff8000000000000", &map_len);
+  HSDT_Tape tape;
+  hsdt_tape_init(&tape);
+  assert(hsdt_decode_tape(&tape, tape_bytes, map_len, &consumed, HSDT_DEFAULT_MAX_DEPTH) == HSDT_ERR_NONE);
+  assert(tape.len == 11 && tape.entries[0].end == 11);
+  size_t a = hsdt_tape_map_get(&tape, 0, (uint8_t *) "a", 1);
+  assert(a == 2 && tape.entries[a].tag == HSDT_ARRAY && hsdt_tape_skip(&tape, a) == 5);
+  size_t xy = hsdt_tape_array_get(&tape, a, 1);
+  assert(tape.entries[xy].tag == HSDT_UTF8_STRING && tape.entries[xy].len == 2);
+  assert(memcmp(hsdt_tape_str(&tape, xy), "xy", 2) == 0);
+  assert(hsdt_tape_array_get(&tape, a, 2) == SIZE_MAX);
+  assert(tape.entries[hsdt_tape_map_get(&tape, 0, (uint8_t *) "b", 1)].tag == HSDT_TRUE);
+  size_t c = hsdt_tape_map_get(&tape, 0, (uint8_t *) "c", 1);
+  assert(tape.entries[hsdt_tape_map_get(&tape, c, (uint8_t *) "d", 1)].fp == 1.5);
+  assert(hsdt_tape_map_get(&tape, 0, (uint8_t *) "", 0) == SIZE_MAX);
+  assert(hsdt_tape_map_get(&tape, 0, (uint8_t *) "bb", 2) == SIZE_MAX);
+  assert(hsdt_tape_map_get(&tape, 0, (uint8_t *) "d", 1) == SIZE_MAX);
+  /* The tape is reused for the next value. */
+  assert(hsdt_decode_tape(&tape, tape_bytes + 3, 1, &consumed, HSDT_DEFAULT_MAX_DEPTH) == HSDT_ERR_EOF);
+  assert(hsdt_decode_tape(&tape, tape_bytes + 4, 1, &consumed, HSDT_DEFAULT_MAX_DEPTH) == HSDT_ERR_NONE);
+  assert(tape.len == 1 && tape.entries[0].tag == HSDT_NULL);
+  hsdt_tape_free(&tape);
+
+  /* Navigating the same value with a cursor */
+  HSDT_Cursor cur;
+  HSDT_Cursor_Item item;
+  bool found;
+  hsdt_cursor_init(&cur, tape_bytes, map_len);
+  assert(hsdt_cursor_read(&cur, &item) == HSDT_ERR_NONE && item.tag == HSDT_MAP && item.len == 3);
+  HSDT_Cursor root = cur;
+  assert(hsdt_cursor_find(&cur, (uint8_t *) "a", 1, &found) == HSDT_ERR_NONE && found);
+  assert(cur.pos == 3 && cur.remaining == 3 && cur.key_len == 1 && cur.key[0] == 'a');
+  assert(hsdt_cursor_index(&cur, 1, &found) == HSDT_ERR_NONE && found);
+  assert(hsdt_cursor_read(&cur, &item) == HSDT_ERR_NONE && item.tag == HSDT_UTF8_STRING);
+  assert(item.str.ptr == tape_bytes + 6 && item.str.len == 2);
+  assert(hsdt_cursor_next(&cur) == HSDT_ERR_NONE && cur.remaining == 0 && cur.pos == 8);
+  assert(hsdt_cursor_next(&cur) == HSDT_ERR_EOF && hsdt_cursor_read(&cur, &item) == HSDT_ERR_EOF);
+  cur = root;
+  assert(hsdt_cursor_index(&cur, 0, &found) == HSDT_ERR_NONE && !found && cur.pos == 0);
+  assert(hsdt_cursor_find(&cur, (uint8_t *) "bb", 2, &found) == HSDT_ERR_NONE && !found && cur.pos == 0);
+  assert(hsdt_cursor_find(&cur, (uint8_t *) "d", 1, &found) == HSDT_ERR_NONE && !found);
+  assert(hsdt_cursor_find(&cur, (uint8_t *) "c", 1, &found) == HSDT_ERR_NONE && found);
+  uint8_t *enc;
+  size_t enc_len;
+  assert(hsdt_cursor_encoding(&cur, &enc, &enc_len) == HSDT_ERR_NONE && enc == tape_bytes + 13 && enc_len == 12);
+  assert(hsdt_cursor_enter(&cur) == HSDT_ERR_NONE && cur.in_map && cur.remaining == 1);
+  assert(hsdt_cursor_read(&cur, &item) == HSDT_ERR_NONE && item.tag == HSDT_FP && item.fp == 1.5);
+  assert(hsdt_cursor_find(&cur, (uint8_t *) "d", 1, &found) == HSDT_ERR_NONE && !found);
+  assert(hsdt_cursor_enter(&cur) == HSDT_ERR_NONE && cur.remaining == 0 && cur.pos == map_len);
+  /* Path queries */
+  HSDT_Path path;
+  assert(hsdt_path_compile(&path, "a[1]") && path.len == 2);
+  cur = root;
+  assert(hsdt_path_query(&path, &cur, &found) == HSDT_ERR_NONE && found && cur.pos == 5);
+  hsdt_path_free(&path);
+  assert(hsdt_path_compile(&path, "c.d"));
+  cur = root;
+  assert(hsdt_path_query(&path, &cur, &found) == HSDT_ERR_NONE && found);
+  assert(hsdt_cursor_read(&cur, &item) == HSDT_ERR_NONE && item.fp == 1.5);
+  hsdt_path_free(&path);
+  assert(hsdt_path_compile(&path, ""));
+  cur = root;
+  assert(hsdt_path_query(&path, &cur, &found) == HSDT_ERR_NONE && found && cur.pos == 0);
+  hsdt_path_free(&path);
+  const char *missing[] = {"a[2]", "b.c", "c[0]", "c.d.e", "bb", "[0]"};
+  for (size_t i = 0; i < sizeof(missing) / sizeof(char *); i++) {
+    assert(hsdt_path_compile(&path, missing[i]));
+    cur = root;
+    assert(hsdt_path_query(&path, &cur, &found) == HSDT_ERR_NONE && !found && cur.pos == 0);
+    hsdt_path_free(&path);
+  }
+  const char *invalid[] = {".a", "a.", "a..b", "a[", "a[]", "a[1", "a[x]", "a[1]b", "[99999999999999999999999]"};
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(char *); i++) {
+    assert(!hsdt_path_compile(&path, invalid[i]));
+  }
+  assert(hsdt_path_compile(&path, "x]y[0][12].z") && path.len == 4);
+  assert(path.steps[0].key_len == 3 && memcmp(path.steps[0].key, "x]y", 3) == 0);
+  assert(path.steps[1].key == NULL && path.steps[2].index == 12 && path.steps[3].key[0] == 'z');
+  hsdt_path_free(&path);
+  /* Extracting many paths at once agrees with querying them one by one */
+  const char *exprs[] = {"c.d", "a[1]", "b", "a", "zz", "a[0]", "c.d", "a[5]", "[0]", "", "c"};
+  size_t num_exprs = sizeof(exprs) / sizeof(char *);
+  HSDT_Path_Set set;
+  HSDT_Cursor results[sizeof(exprs) / sizeof(char *)];
+  bool founds[sizeof(exprs) / sizeof(char *)];
+  assert(hsdt_path_set_compile(&set, exprs, num_exprs));
+  assert(hsdt_path_set_extract(&set, &root, results, founds) == HSDT_ERR_NONE);
+  for (size_t i = 0; i < num_exprs; i++) {
+    assert(hsdt_path_compile(&path, exprs[i]));
+    cur = root;
+    assert(hsdt_path_query(&path, &cur, &found) == HSDT_ERR_NONE && found == founds[i]);
+    assert(!found || (results[i].pos == cur.pos && results[i].remaining == cur.remaining));
+    hsdt_path_free(&path);
+  }
+  assert(founds[0] && results[0].pos == 16 && !founds[4] && !founds[7] && !founds[8]);
+  hsdt_path_set_free(&set);
+  exprs[4] = "a..b";
+  assert(!hsdt_path_set_compile(&set, exprs, num_exprs));
+  /* Random access through a structural index */
+  HSDT_Index index;
+  hsdt_index_init(&index);
+  assert(hsdt_index_build(&index, tape_bytes, map_len, 0, &consumed) == HSDT_ERR_NONE && consumed == map_len);
+  assert(index.collections_len == 3 && index.offsets_len == 6);
+  assert(index.offsets[0] == 1 && index.offsets[3] == 4 && index.offsets[4] == 5 && index.offsets[5] == 14);
+  cur = root;
+  assert(hsdt_index_map_get(&index, &cur, (uint8_t *) "c", 1, &found) == HSDT_ERR_NONE && found && cur.pos == 13);
+  assert(hsdt_index_map_get(&index, &cur, (uint8_t *) "d", 1, &found) == HSDT_ERR_NONE && found && cur.pos == 16);
+  assert(hsdt_cursor_next(&cur) == HSDT_ERR_NONE && cur.remaining == 0 && cur.pos == map_len);
+  cur = root;
+  assert(hsdt_index_map_get(&index, &cur, (uint8_t *) "bb", 2, &found) == HSDT_ERR_NONE && !found && cur.pos == 0);
+  assert(hsdt_index_array_get(&index, &cur, 0, &found) == HSDT_ERR_NONE && !found);
+  assert(hsdt_index_map_get(&index, &cur, (uint8_t *) "a", 1, &found) == HSDT_ERR_NONE && found && cur.remaining == 3);
+  assert(hsdt_index_array_get(&index, &cur, 2, &found) == HSDT_ERR_NONE && !found);
+  assert(hsdt_index_array_get(&index, &cur, 1, &found) == HSDT_ERR_NONE && found && cur.pos == 5);
+  assert(hsdt_cursor_next(&cur) == HSDT_ERR_NONE && cur.remaining == 0 && cur.pos == 8);
+  /* Only large enough collections are indexed, the others are scanned */
+  assert(hsdt_index_build(&index, tape_bytes, map_len, 2, &consumed) == HSDT_ERR_NONE && index.collections_len == 2);
+  cur = root;
+  assert(hsdt_index_map_get(&index, &cur, (uint8_t *) "c", 1, &found) == HSDT_ERR_NONE && found);
+  assert(hsdt_index_map_get(&index, &cur, (uint8_t *) "d", 1, &found) == HSDT_ERR_NONE && found && cur.pos == 16);
+  /* Serialization */
+  size_t ser_len;
+  uint8_t *ser = hsdt_index_serialize(&index, &ser_len);
+  assert(ser_len == 8 * (2 + 3 * 2 + 5));
+  HSDT_Index loaded;
+  hsdt_index_init(&loaded);
+  assert(hsdt_index_deserialize(&loaded, ser, ser_len));
+  assert(loaded.collections_len == 2 && loaded.offsets_len == 5);
+  assert(memcmp(loaded.collections, index.collections, 2 * sizeof(HSDT_Index_Collection)) == 0);
+  assert(memcmp(loaded.offsets, index.offsets, 5 * sizeof(uint64_t)) == 0);
+  assert(!hsdt_index_deserialize(&loaded, ser, ser_len - 1) && loaded.collections_len == 0);
+  ser[23] = 4; /* The first collection starts after the second one */
+  assert(!hsdt_index_deserialize(&loaded, ser, ser_len));
+  free(ser);
+  hsdt_index_free(&loaded);
+  assert(hsdt_index_build(&index, tape_bytes, 12, 0, &consumed) == HSDT_ERR_EOF && index.collections_len == 0);
+  hsdt_index_free(&index);
+  /* Skipping does not check strings, reading does. */
+  tape_bytes[6] = 0xff;
+  cur = root;
+  assert(hsdt_cursor_find(&cur, (uint8_t *) "b", 1, &found) == HSDT_ERR_NONE && found);
+  cur = root;
+  assert(hsdt_cursor_find(&cur, (uint8_t *) "a", 1, &found) == HSDT_ERR_NONE && found);
+  assert(hsdt_cursor_index(&cur, 1, &found) == HSDT_ERR_NONE && found);
+  assert(hsdt_cursor_read(&cur, &item) == HSDT_ERR_UTF8);
+  free(tape_bytes);
+
+  /* Many values in one arena, spanning several chunks */
+  uint8_t *big_bytes = from_hex("a2616182f66362636463626461626364", &map_len);
+  HSDT_Arena arena;
+  HSDT_Value decoded[1000];
+  hsdt_arena_init(&arena);
+  for (size_t i = 0; i < 1000; i++) {
+    assert(hsdt_decode_arena(&arena, big_bytes, map_len, &decoded[i], &consumed) == HSDT_ERR_NONE);
+  }
+  assert(arena.chunks != NULL);
+  for (size_t i = 1; i < 1000; i++) {
+    assert(hsdt_value_eq(decoded[0], decoded[i]));
+  }
+
+  /* Resetting keeps the largest chunk, even if smaller ones were added after it */
+  size_t huge_str_len = 5 + (2 << 20);
+  uint8_t *huge_str = calloc(huge_str_len, 1);
+  memcpy(huge_str, "\x5a\x00\x20\x00\x00", 5);
+  HSDT_Value huge_val;
+  hsdt_arena_reset(&arena);
+  assert(hsdt_decode_arena(&arena, huge_str, huge_str_len, &huge_val, &consumed) == HSDT_ERR_NONE);
+  for (size_t i = 0; i < 1000; i++) {
+    assert(hsdt_decode_arena(&arena, big_bytes, map_len, &decoded[i], &consumed) == HSDT_ERR_NONE);
+  }
+  hsdt_arena_reset(&arena);
+  size_t kept = arena.allocated;
+  assert(kept > (2 << 20));
+  assert(hsdt_decode_arena(&arena, huge_str, huge_str_len, &huge_val, &consumed) == HSDT_ERR_NONE);
+  assert(arena.allocated == kept);
+  free(huge_str);
+  hsdt_arena_free(&arena);
+  free(big_bytes);
+
+  /* Parsing events */
+  check_events("f6", "null ", HSDT_ERR_NONE);
+  check_events("826161a161626163", "[2 s:a {1 k:b s:c end end ", HSDT_ERR_NONE);
+  check_events("84f4f5fb3ff80000000000004161", "[4 false true 1.5 b:a end ", HSDT_ERR_NONE);
+  check_events("a2616180617a80", "{2 k:a [0 end k:z [0 end end ", HSDT_ERR_NONE);
+  check_events("a3616180616280", "{3 k:a [0 end k:b [0 end ", HSDT_ERR_EOF);
+  check_events("826473746f708080", "[2 s:stop [0 end ", HSDT_ERR_ABORTED);
+  check_events("a2617a80616180", "{2 k:z [0 end ", HSDT_ERR_CANONIC_ORDER);
+
+  /* Vectorized utf8 validation agrees with the scalar one */
+  uint8_t utf8[600];
+  srand(42);
+  for (size_t i = 0; i < 20000; i++) {
+    size_t len = 256 + rand() % 300;
+    for (size_t j = 0; j < len; j++) {
+      /* Mostly ascii and plausible multibyte sequences, some random bytes */
+      uint8_t kind = rand() % 16;
+      utf8[j] = kind < 8 ? 'a' + rand() % 26 : kind < 10 ? 0x80 + rand() % 64 : kind < 15 ? 0xC2 + rand() % 51 : rand();
+    }
+    check_utf8_impls(utf8, len);
+  }
+  /* Surrogates, overlong encodings, too large code points, and truncation at the very end */
+  char *bad_tails[] = {"\xed\xa0\x80", "\xe0\x80\xaf", "\xf4\x90\x80\x80", "\xc0\xaf", "\xe6\xb0", "\xf0\x9f\x98", "\xe6\xb0\xb4"};
+  for (size_t i = 0; i < sizeof(bad_tails) / sizeof(char *); i++) {
+    memset(utf8, 'a', 300);
+    memcpy(utf8 + 300 - strlen(bad_tails[i]), bad_tails[i], strlen(bad_tails[i]));
+    check_utf8_impls(utf8, 300);
+  }
+
+  /* Deeply nested values round-trip */
+  size_t deep_len = 100001;
+  uint8_t *deep = malloc(deep_len);
+  memset(deep, 0x81, deep_len - 1);
+  deep[deep_len - 1] = 0xa0;
+  HSDT_Value deep_val;
+  assert(hsdt_decode_stack(deep, deep_len, &deep_val, &consumed, NULL, SIZE_MAX) == HSDT_ERR_NONE);
+  size_t deep_enc_len;
+  uint8_t *deep_enc = hsdt_encode(deep_val, &deep_enc_len);
+  assert(deep_enc_len == deep_len && memcmp(deep, deep_enc, deep_len) == 0);
+  assert(hsdt_encoding_len(deep_val) == deep_len);
+
+  /* A writer can stop the encoding, and is not called again afterwards. */
+  uint8_t chunk[16];
+  size_t calls = 0;
+  assert(!hsdt_encode_stream(deep_val, chunk, sizeof(chunk), stop_write, &calls));
+  assert(calls == 1);
+
+  /* Equality of deep values, differing only in the innermost item. */
+  HSDT_Value deep_other;
+  assert(hsdt_decode_stack(deep_enc, deep_enc_len, &deep_other, &consumed, NULL, SIZE_MAX) == HSDT_ERR_NONE);
+  assert(hsdt_value_eq(deep_val, deep_other));
+  hsdt_value_free(deep_other);
+  deep_enc[deep_enc_len - 1] = 0x80;
+  assert(hsdt_decode_stack(deep_enc, deep_enc_len, &deep_other, &consumed, NULL, SIZE_MAX) == HSDT_ERR_NONE);
+  assert(!hsdt_value_eq(deep_val, deep_other));
+  hsdt_value_free(deep_other);
+
+  /* Views of deep values are converted and freed without recursion, also when decoding fails */
+  HSDT_View deep_view;
+  assert(hsdt_decode_view(deep, deep_len, &deep_view, &consumed, SIZE_MAX) == HSDT_ERR_NONE);
+  deep_other = hsdt_view_to_value(deep_view);
+  assert(hsdt_value_eq(deep_val, deep_other));
+  hsdt_value_free(deep_other);
+  hsdt_view_free(deep_view);
+  assert(hsdt_decode_view(deep, deep_len - 1, &deep_view, &consumed, SIZE_MAX) == HSDT_ERR_EOF);
+
+  /* So are tapes */
+  HSDT_Tape deep_tape;
+  hsdt_tape_init(&deep_tape);
+  assert(hsdt_decode_tape(&deep_tape, deep, deep_len, &consumed, SIZE_MAX) == HSDT_ERR_NONE);
+  deep_other = hsdt_tape_to_value(&deep_tape, 0);
+  assert(hsdt_value_eq(deep_val, deep_other));
+  hsdt_value_free(deep_other);
+  hsdt_tape_free(&deep_tape);
+
+  hsdt_value_free(deep_val);
+  free(deep_enc);
+  free(deep);
+
+  /* Deeply nested maps, with a string next to every nested map */
+  size_t deep_maps = 20000;
+  uint8_t *deep_map_bytes = malloc(7 * deep_maps + 1);
+  for (size_t i = 0; i < deep_maps; i++) {
+    memcpy(deep_map_bytes + 7 * i, "\xa2\x61" "a" "\x61" "x" "\x61" "b", 7);
+  }
+  deep_map_bytes[7 * deep_maps] = 0xf6;
+  assert(hsdt_decode_stack(deep_map_bytes, 7 * deep_maps + 1, &deep_val, &consumed, NULL, SIZE_MAX) == HSDT_ERR_NONE);
+  assert(hsdt_decode_stack(deep_map_bytes, 7 * deep_maps + 1, &deep_other, &consumed, NULL, SIZE_MAX) == HSDT_ERR_NONE);
+  assert(hsdt_value_eq(deep_val, deep_other));
+  hsdt_value_free(deep_other);
+  deep_map_bytes[7 * deep_maps - 3] = 'y';
+  assert(hsdt_decode_stack(deep_map_bytes, 7 * deep_maps + 1, &deep_other, &consumed, NULL, SIZE_MAX) == HSDT_ERR_NONE);
+  assert(!hsdt_value_eq(deep_val, deep_other));
+  hsdt_value_free(deep_other);
+  hsdt_value_free(deep_val);
+  free(deep_map_bytes);
+
+  /* Nesting depth */
+  check_depth("f6", 0, HSDT_ERR_NONE);
+  check_depth("80", 0, HSDT_ERR_DEPTH);
+  check_depth("818180", 3, HSDT_ERR_NONE);
+  check_depth("81818180", 3, HSDT_ERR_DEPTH);
+  check_depth("82a1616181f68180", 3, HSDT_ERR_NONE);
+  check_depth("82a1616181f6818180", 3, HSDT_ERR_DEPTH);
+#endif
 
   return 0;
 }